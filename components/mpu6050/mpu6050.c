@@ -944,10 +944,60 @@ esp_err_t mpu6050_get_rotation_axis(mpu6050_dev_t *dev, mpu6050_axis_t axis, flo
     return ESP_OK;
 }
 
+esp_err_t mpu6050_get_raw_motion(mpu6050_dev_t *dev, mpu6050_raw_motion_t *motion, int16_t *temperature)
+{
+    CHECK_ARG(dev && motion);
+
+    // accel, temperature, gyro: contiguous from ACCEL_XOUT_H
+    uint16_t buf[7];
+
+    I2C_DEV_TAKE_MUTEX(&dev->i2c_dev);
+    I2C_DEV_CHECK(&dev->i2c_dev, i2c_dev_read_reg(&dev->i2c_dev, MPU6050_REGISTER_ACCEL_XOUT_H, buf, sizeof(buf)));
+    I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
+
+    motion->accel.x = shuffle(buf[0]);
+    motion->accel.y = shuffle(buf[1]);
+    motion->accel.z = shuffle(buf[2]);
+    motion->gyro.x = shuffle(buf[4]);
+    motion->gyro.y = shuffle(buf[5]);
+    motion->gyro.z = shuffle(buf[6]);
+
+    if (temperature)
+        *temperature = shuffle(buf[3]);
+
+    return ESP_OK;
+}
+
 esp_err_t mpu6050_get_motion(mpu6050_dev_t *dev, mpu6050_acceleration_t *accel, mpu6050_rotation_t *gyro)
 {
-    CHECK(mpu6050_get_acceleration(dev, accel));
-    CHECK(mpu6050_get_rotation(dev, gyro));
+    mpu6050_raw_motion_t raw;
+    CHECK(mpu6050_get_raw_motion(dev, &raw, NULL));
+
+    return mpu6050_convert_motion(dev, &raw, accel, gyro);
+}
+
+esp_err_t mpu6050_get_motion_resolution(mpu6050_dev_t *dev, float *accel, float *gyro)
+{
+    CHECK_ARG(dev && accel && gyro);
+
+    *accel = accel_res[dev->ranges.accel];
+    *gyro = gyro_res[dev->ranges.gyro];
+
+    return ESP_OK;
+}
+
+esp_err_t mpu6050_convert_motion(mpu6050_dev_t *dev, const mpu6050_raw_motion_t *raw, mpu6050_acceleration_t *accel, mpu6050_rotation_t *gyro)
+{
+    CHECK_ARG(dev && raw && accel && gyro);
+
+    accel->x = get_accel_value(dev, raw->accel.x);
+    accel->y = get_accel_value(dev, raw->accel.y);
+    accel->z = get_accel_value(dev, raw->accel.z);
+
+    gyro->x = get_gyro_value(dev, raw->gyro.x);
+    gyro->y = get_gyro_value(dev, raw->gyro.y);
+    gyro->z = get_gyro_value(dev, raw->gyro.z);
+
     return ESP_OK;
 }
 
@@ -1204,12 +1254,50 @@ esp_err_t mpu6050_get_fifo_bytes(mpu6050_dev_t *dev, uint8_t *data, size_t lengt
     CHECK_ARG(dev && data && length);
 
     I2C_DEV_TAKE_MUTEX(&dev->i2c_dev);
-    I2C_DEV_CHECK(&dev->i2c_dev, i2c_dev_read_reg(&dev->i2c_dev, MPU6050_REGISTER_FIFO_COUNTH, data, length));
+    I2C_DEV_CHECK(&dev->i2c_dev, i2c_dev_read_reg(&dev->i2c_dev, MPU6050_REGISTER_FIFO_R_W, data, length));
     I2C_DEV_GIVE_MUTEX(&dev->i2c_dev);
 
     return ESP_OK;
 }
 
+_Static_assert(sizeof(mpu6050_raw_motion_t) == 12, "FIFO frames are read in place");
+
+esp_err_t mpu6050_get_fifo_motion(mpu6050_dev_t *dev, mpu6050_raw_motion_t *motion, size_t max_frames, size_t *frames)
+{
+    CHECK_ARG(dev && motion && max_frames && frames);
+
+    *frames = 0;
+
+    uint16_t count;
+    CHECK(mpu6050_get_fifo_count(dev, &count));
+
+    // An overflow drops the oldest bytes, 1024 is not a multiple of the frame size
+    if (count > MPU6050_FIFO_SIZE - sizeof(mpu6050_raw_motion_t) || count % sizeof(mpu6050_raw_motion_t) != 0)
+        return ESP_ERR_INVALID_SIZE;
+
+    size_t n = count / sizeof(mpu6050_raw_motion_t);
+    if (n > max_frames)
+        n = max_frames;
+    if (n == 0)
+        return ESP_OK;
+
+    // Big endian words, swapped in place
+    CHECK(mpu6050_get_fifo_bytes(dev, (uint8_t *)motion, n * sizeof(mpu6050_raw_motion_t)));
+
+    for (size_t i = 0; i < n; i++)
+    {
+        motion[i].accel.x = shuffle(motion[i].accel.x);
+        motion[i].accel.y = shuffle(motion[i].accel.y);
+        motion[i].accel.z = shuffle(motion[i].accel.z);
+        motion[i].gyro.x = shuffle(motion[i].gyro.x);
+        motion[i].gyro.y = shuffle(motion[i].gyro.y);
+        motion[i].gyro.z = shuffle(motion[i].gyro.z);
+    }
+
+    *frames = n;
+    return ESP_OK;
+}
+
 esp_err_t mpu6050_get_fifo_byte(mpu6050_dev_t *dev, uint8_t *data)
 {
     return read_reg(dev, MPU6050_REGISTER_FIFO_R_W, data);
@@ -79,6 +79,17 @@ typedef struct
     int16_t z; //!< raw rotation axis z
 } mpu6050_raw_rotation_t;
 
+/**
+ * Raw accelerometer and gyroscope data of one sampling instant
+ */
+typedef struct
+{
+    mpu6050_raw_acceleration_t accel; //!< raw acceleration
+    mpu6050_raw_rotation_t gyro;      //!< raw rotation
+} mpu6050_raw_motion_t;
+
+#define MPU6050_FIFO_SIZE (1024) // FIFO buffer size, bytes
+
 /**
  * MPU6050 acceleration data, g
  */
@@ -1704,6 +1715,48 @@ esp_err_t mpu6050_get_raw_rotation_axis(mpu6050_dev_t *dev, mpu6050_axis_t axis,
  */
 esp_err_t mpu6050_get_motion(mpu6050_dev_t *dev, mpu6050_acceleration_t *data_accel, mpu6050_rotation_t *data_gyro);
 
+/**
+ * @brief Get raw 6-axis motion and temperature readings in one burst.
+ *
+ * Reads ACCEL_XOUT_H through GYRO_ZOUT_L in a single transaction, so
+ * accelerometer, temperature and gyroscope come from the same sampling
+ * instant.
+ *
+ * @param dev Device descriptor
+ * @param[out] motion Raw motion data.
+ * @param[out] temperature Raw temperature, may be NULL.
+ *
+ * @return `ESP_OK` on success
+ */
+esp_err_t mpu6050_get_raw_motion(mpu6050_dev_t *dev, mpu6050_raw_motion_t *motion, int16_t *temperature);
+
+/**
+ * @brief Get the resolution of raw motion readings.
+ *
+ * Follows the full scale ranges last set through this descriptor.
+ *
+ * @param dev Device descriptor
+ * @param[out] accel_res Acceleration per LSB, g
+ * @param[out] gyro_res Rotation per LSB, °/s
+ *
+ * @return `ESP_OK` on success
+ */
+esp_err_t mpu6050_get_motion_resolution(mpu6050_dev_t *dev, float *accel_res, float *gyro_res);
+
+/**
+ * @brief Convert raw 6-axis motion readings to g and °/s.
+ *
+ * Uses the full scale ranges last set through this descriptor.
+ *
+ * @param dev Device descriptor
+ * @param raw Raw motion data, e.g. a FIFO frame.
+ * @param[out] data_accel acceleration struct.
+ * @param[out] data_gyro rotation struct.
+ *
+ * @return `ESP_OK` on success
+ */
+esp_err_t mpu6050_convert_motion(mpu6050_dev_t *dev, const mpu6050_raw_motion_t *raw, mpu6050_acceleration_t *data_accel, mpu6050_rotation_t *data_gyro);
+
 /**
  * @brief Read bytes from external sensor data register.
  *
@@ -2362,6 +2415,26 @@ esp_err_t mpu6050_get_fifo_byte(mpu6050_dev_t *dev, uint8_t *data);
  */
 esp_err_t mpu6050_get_fifo_bytes(mpu6050_dev_t *dev, uint8_t *data, size_t length);
 
+/**
+ * @brief Get accelerometer and gyroscope frames from FIFO buffer.
+ *
+ * Expects the accelerometer and the three gyroscope axes to be the only
+ * sensors enabled for FIFO, so that every frame is 12 bytes in register
+ * order. Reads FIFO_COUNT once and then burst-reads the whole frames
+ * available, up to max_frames, in a single transaction.
+ *
+ * When the FIFO buffer overflows its oldest bytes are lost and frames no
+ * longer start on a frame boundary: the FIFO has to be reset.
+ *
+ * @param dev Device descriptor
+ * @param[out] motion Frames, oldest first.
+ * @param max_frames Capacity of motion, in frames
+ * @param[out] frames How many frames were read
+ *
+ * @return `ESP_OK` on success, `ESP_ERR_INVALID_SIZE` if the FIFO overflowed
+ */
+esp_err_t mpu6050_get_fifo_motion(mpu6050_dev_t *dev, mpu6050_raw_motion_t *motion, size_t max_frames, size_t *frames);
+
 /**
  * @brief Write byte to FIFO buffer.
  *
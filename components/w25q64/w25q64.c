@@ -1,24 +1,153 @@
 #include "w25q64.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "soc/gpio_num.h"
 
+#include <string.h>
+
 static const char *TAG = "w25q64";
 
 #define CMD_WRITE_ENABLE    0x06
 #define CMD_READ_STATUS_1   0x05
 #define CMD_READ_DATA       0x03
+#define CMD_FAST_READ       0x0B
+#define CMD_FAST_READ_DUAL  0x3B
 #define CMD_PAGE_PROGRAM    0x02
 #define CMD_SECTOR_ERASE    0x20
+#define CMD_BLOCK_ERASE_32K 0x52
+#define CMD_BLOCK_ERASE_64K 0xD8
 #define CMD_JEDEC_ID        0x9F
 #define CMD_CHIP_ERASE      0xC7 // Bulk Erase
+#define CMD_ERASE_SUSPEND   0x75
+#define CMD_ERASE_RESUME    0x7A
+#define CMD_READ_SFDP       0x5A
+#define CMD_ENTER_4B        0xB7
+
+#define STATUS_BUSY 0x01
+
+#define SFDP_SIGNATURE 0x50444653 // "SFDP"
+#define SFDP_BASIC_TABLE_ID 0xFF00 // JEDEC basic flash parameter table
+#define SFDP_MAX_HEADERS 8
+#define SFDP_MAX_DWORDS 16
+
+// JEDEC ID capacity byte of the W25Q family, 2^n bytes: 0x17 is the W25Q64, 0x19 the W25Q256
+#define JEDEC_MIN_CAPACITY_ID 0x10
+#define JEDEC_MAX_CAPACITY_ID 0x1F
+
+// above 16 MB the address no longer fits in 3 bytes
+#define ADDR_3B_LIMIT (16 * 1024 * 1024)
+
+// Dual Output reads data on both DI (IO0) and DO (IO1), only enable it when both are routed to the chip
+#ifndef W25Q64_DUAL_OUTPUT
+#define W25Q64_DUAL_OUTPUT 0
+#endif
+
+// a resumed erase needs time to make progress before it can be suspended again
+#define ERASE_RESUME_MIN_US 500
+
+#define STREAM_CLOCK_HZ 26e6 // GPIO matrix limit for MISO
+#define STREAM_BUFFERS 2
+
+#define WRITER_QUEUE_SIZE 2
+#define WRITER_TASK_STACK 3072
+#define WRITER_TASK_PRIORITY 6
+#define WRITER_TASK_CORE 0
+
+typedef struct {
+    uint32_t address;
+    const uint8_t *data;
+    size_t size;
+} write_request_t;
 
 static spi_device_handle_t w25q64_spi;
+static spi_device_handle_t w25q64_spi_stream;
 static gpio_num_t w25q64_cs_pin;
 
+// serializes every chip access between the caller tasks and the writer task
+static SemaphoreHandle_t w25q64_lock;
+
+static uint32_t page_program_count = 0;
+
+// filled from the JEDEC ID and the SFDP table at init, W25Q64 defaults until then
+static w25q64_geometry_t geometry = {
+    .capacity = 8 * 1024 * 1024,
+    .page_size = W25Q64_PAGE_SIZE,
+    .address_bytes = 3,
+    .sector_erase_cmd = CMD_SECTOR_ERASE,
+    .block32_erase_cmd = CMD_BLOCK_ERASE_32K,
+    .block64_erase_cmd = CMD_BLOCK_ERASE_64K,
+    .stream_read_cmd = CMD_FAST_READ,
+    .stream_dummy_bits = 8,
+    .stream_dual = false,
+    .sfdp = false,
+};
+
+// how to leave 3 byte address mode, for chips that start in it
+static enum { ENTER_4B_NONE, ENTER_4B_CMD, ENTER_4B_WREN_CMD } enter_4b = ENTER_4B_NONE;
+
+// sector and block erases are polled with the lock released: any other operation
+// outside the erased range suspends the erase while it runs
+static struct {
+    bool active;
+    bool suspended;
+    uint32_t address;
+    uint32_t size;
+    int64_t suspended_at;
+    int64_t resumed_at;
+} erase_state;
+
+static w25q64_suspend_stats_t suspend_stats;
+
+// asynchronous writer
+static QueueHandle_t writer_queue;
+static w25q64_write_done_cb_t writer_done_cb;
+static void *writer_done_ctx;
+static volatile uint32_t writer_pending = 0;
+static portMUX_TYPE writer_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t writer_idle; // given each time writer_pending drops to 0
+
+// expected duration of each operation (datasheet typical values)
+typedef struct {
+    uint32_t typical_us; // sleep until roughly this long has passed
+    uint32_t spin_us;    // poll without sleeping while below this, a tick would cost 10 ms
+} op_timing_t;
+
+static const op_timing_t op_timing[W25Q64_OP_COUNT] = {
+    [W25Q64_OP_PAGE_PROGRAM] = { .typical_us = 700,      .spin_us = 5000 },
+    [W25Q64_OP_SECTOR_ERASE] = { .typical_us = 45000,    .spin_us = 0 },
+    [W25Q64_OP_CHIP_ERASE]   = { .typical_us = 20000000, .spin_us = 0 },
+    [W25Q64_OP_BLOCK32_ERASE] = { .typical_us = 120000,  .spin_us = 0 },
+    [W25Q64_OP_BLOCK64_ERASE] = { .typical_us = 150000,  .spin_us = 0 },
+};
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;
+} op_counters_t;
+
+static op_counters_t op_counters[W25Q64_OP_COUNT];
+
+// streaming reads: one chunk is handed to the sink while the next one is in DMA
+static uint8_t stream_buffer[STREAM_BUFFERS][W25Q64_READ_CHUNK_SIZE] __attribute__((aligned(4)));
+static portMUX_TYPE op_counters_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline void w25q64_lock_take(void) {
+    xSemaphoreTakeRecursive(w25q64_lock, portMAX_DELAY);
+}
+
+static inline void w25q64_lock_give(void) {
+    xSemaphoreGiveRecursive(w25q64_lock);
+}
+
 static inline void w25q64_cs_low(void) {
     gpio_set_level(w25q64_cs_pin, 0);
 }
@@ -27,13 +156,155 @@ static inline void w25q64_cs_high(void) {
     gpio_set_level(w25q64_cs_pin, 1);
 }
 
+// the streaming device drives CS from the transaction callbacks, so queued reads need no task in between
+static void IRAM_ATTR w25q64_stream_pre_cb(spi_transaction_t *t) {
+    gpio_set_level(w25q64_cs_pin, 0);
+}
+
+static void IRAM_ATTR w25q64_stream_post_cb(spi_transaction_t *t) {
+    gpio_set_level(w25q64_cs_pin, 1);
+}
+
 static inline void w25q64_wait_ready(void) {
-    while ((w25q64_read_status() & 0x01) == 0x01) {
-        vTaskDelay(pdMS_TO_TICKS(10));
+    while ((w25q64_read_status() & STATUS_BUSY) == STATUS_BUSY) {
+        taskYIELD();
     }
 }
 
-static esp_err_t w25q64_read_JEDEC_ID(void) {
+// command followed by a 3 or 4 byte address, returns the bytes used
+static inline size_t w25q64_cmd_addr(uint8_t *buffer, uint8_t cmd, uint32_t address) {
+    size_t n = 0;
+
+    buffer[n++] = cmd;
+    if (geometry.address_bytes == 4) buffer[n++] = (address >> 24) & 0xFF;
+    buffer[n++] = (address >> 16) & 0xFF;
+    buffer[n++] = (address >> 8) & 0xFF;
+    buffer[n++] = (address) & 0xFF;
+
+    return n;
+}
+
+static void w25q64_send_cmd(uint8_t cmd) {
+    w25q64_cs_low();
+    spi_transaction_t t = { .length = 8, .tx_buffer = &cmd };
+    spi_device_polling_transmit(w25q64_spi, &t);
+    w25q64_cs_high();
+}
+
+static void w25q64_write_enable(void) {
+    w25q64_send_cmd(CMD_WRITE_ENABLE);
+}
+
+// called with the lock held: clears the erase once the chip reports it done
+static bool w25q64_erase_done(void) {
+    if (!erase_state.active) return true;
+    if ((w25q64_read_status() & STATUS_BUSY) == STATUS_BUSY) return false;
+
+    erase_state.active = false;
+    return true;
+}
+
+// called with the lock held: waits for a running erase, releasing the lock in between
+static void w25q64_wait_erase_idle(void) {
+    while (!w25q64_erase_done()) {
+        w25q64_lock_give();
+        vTaskDelay(1);
+        w25q64_lock_take();
+    }
+}
+
+static void w25q64_suspend_erase(void) {
+    w25q64_send_cmd(CMD_ERASE_SUSPEND);
+
+    // tSUS: the erase stops within 20 us
+    w25q64_wait_ready();
+
+    erase_state.suspended = true;
+    erase_state.suspended_at = esp_timer_get_time();
+    suspend_stats.suspends++;
+}
+
+// called with the lock held, before an operation on [address, address + size)
+static void w25q64_ready_for(uint32_t address, size_t size) {
+    bool blocked = false;
+
+    while ((w25q64_read_status() & STATUS_BUSY) == STATUS_BUSY) {
+        if (erase_state.active && !erase_state.suspended) {
+            // the erased range reads as garbage and takes no programs while suspended
+            bool overlaps = address < erase_state.address + erase_state.size && erase_state.address < address + size;
+
+            if (overlaps) {
+                if (!blocked) suspend_stats.blocked++;
+                blocked = true;
+
+                // the erase may take seconds: sleep without the lock, as w25q64_wait_erase_idle() does,
+                // the erase state is read again once it is back
+                w25q64_lock_give();
+                vTaskDelay(1);
+                w25q64_lock_take();
+                continue;
+            } else if (esp_timer_get_time() - erase_state.resumed_at >= ERASE_RESUME_MIN_US) {
+                w25q64_suspend_erase();
+                return;
+            }
+        }
+
+        taskYIELD();
+    }
+}
+
+// called with the lock held, once the operation is done
+static void w25q64_resume_erase(void) {
+    if (!erase_state.suspended) return;
+
+    w25q64_send_cmd(CMD_ERASE_RESUME);
+
+    int64_t now = esp_timer_get_time();
+    uint32_t suspended_us = now - erase_state.suspended_at;
+
+    if (suspended_us > suspend_stats.max_suspend_us) suspend_stats.max_suspend_us = suspended_us;
+    suspend_stats.total_suspend_us += suspended_us;
+
+    erase_state.suspended = false;
+    erase_state.resumed_at = now;
+}
+
+static void w25q64_record_op(w25q64_op_t op, uint32_t elapsed_us) {
+    portENTER_CRITICAL(&op_counters_mux);
+
+    op_counters_t *counters = &op_counters[op];
+    if (counters->count == 0 || elapsed_us < counters->min_us) counters->min_us = elapsed_us;
+    if (elapsed_us > counters->max_us) counters->max_us = elapsed_us;
+    counters->total_us += elapsed_us;
+    counters->count++;
+
+    portEXIT_CRITICAL(&op_counters_mux);
+}
+
+// waits for a program/erase issued just before the call, picking the poll strategy from its expected duration
+static void w25q64_wait_op(w25q64_op_t op) {
+    const op_timing_t *timing = &op_timing[op];
+    int64_t start = esp_timer_get_time();
+
+    while ((w25q64_read_status() & STATUS_BUSY) == STATUS_BUSY) {
+        uint32_t elapsed_us = esp_timer_get_time() - start;
+
+        if (elapsed_us < timing->spin_us) {
+            // short operation: keep polling, only let same priority tasks run
+            taskYIELD();
+        } else if (elapsed_us < timing->typical_us) {
+            // long operation: sleep through most of it
+            TickType_t ticks = pdMS_TO_TICKS((timing->typical_us - elapsed_us) / 1000);
+            vTaskDelay(ticks > 0 ? ticks : 1);
+        } else {
+            vTaskDelay(1);
+        }
+    }
+
+    w25q64_record_op(op, esp_timer_get_time() - start);
+}
+
+static esp_err_t w25q64_read_JEDEC_ID(uint8_t *capacity_id) {
     w25q64_cs_low();
 
     uint8_t cmd = CMD_JEDEC_ID;
@@ -52,10 +323,177 @@ static esp_err_t w25q64_read_JEDEC_ID(void) {
         return ESP_FAIL;
     }
 
+    if (id[2] < JEDEC_MIN_CAPACITY_ID || id[2] > JEDEC_MAX_CAPACITY_ID) {
+        ESP_LOGE(TAG, "Unexpected capacity byte 0x%02X", id[2]);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    *capacity_id = id[2];
+    return ESP_OK;
+}
+
+// SFDP reads always take a 3 byte address and 8 dummy clocks
+static void w25q64_read_sfdp(uint32_t address, uint8_t *data, size_t size) {
+    w25q64_cs_low();
+
+    uint8_t cmd_addr[5] = {
+        CMD_READ_SFDP,
+        (address >> 16) & 0xFF,
+        (address >> 8) & 0xFF,
+        (address) & 0xFF,
+        0x00
+    };
+
+    spi_transaction_t t_cmd = { .length = 40, .tx_buffer = cmd_addr };
+    spi_device_polling_transmit(w25q64_spi, &t_cmd);
+    spi_transaction_t t_data = { .length = size * 8, .rx_buffer = data };
+    spi_device_polling_transmit(w25q64_spi, &t_data);
+
+    w25q64_cs_high();
+}
+
+static inline uint32_t sfdp_dword(const uint8_t *data, uint32_t idx) {
+    const uint8_t *p = data + idx * 4;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// reads the JEDEC basic flash parameter table, ESP_ERR_NOT_FOUND if the chip has none
+static esp_err_t w25q64_parse_sfdp(void) {
+    uint8_t header[8 + SFDP_MAX_HEADERS * 8];
+    w25q64_read_sfdp(0, header, sizeof(header));
+
+    if (sfdp_dword(header, 0) != SFDP_SIGNATURE) return ESP_ERR_NOT_FOUND;
+
+    uint32_t headers = header[6] + 1;
+    if (headers > SFDP_MAX_HEADERS) headers = SFDP_MAX_HEADERS;
+
+    uint32_t table_addr = 0;
+    uint32_t table_dwords = 0;
+
+    for (uint32_t i = 0; i < headers; i++) {
+        const uint8_t *param = header + 8 + i * 8;
+
+        if ((param[0] | (param[7] << 8)) == SFDP_BASIC_TABLE_ID) {
+            table_dwords = param[3];
+            table_addr = param[4] | (param[5] << 8) | (param[6] << 16);
+            break;
+        }
+    }
+
+    // JESD216 requires at least the first 9 dwords
+    if (table_dwords < 9) return ESP_ERR_NOT_FOUND;
+    if (table_dwords > SFDP_MAX_DWORDS) table_dwords = SFDP_MAX_DWORDS;
+
+    uint8_t table[SFDP_MAX_DWORDS * 4];
+    w25q64_read_sfdp(table_addr, table, table_dwords * 4);
+
+    // density: bits - 1, or 2^n bits with the top bit set
+    uint32_t density = sfdp_dword(table, 1);
+    if ((density & 0x80000000) && (density & 0x7FFFFFFF) > 34) return ESP_ERR_NOT_SUPPORTED;
+
+    uint64_t bits = (density & 0x80000000) ? (1ULL << (density & 0x7FFFFFFF)) : (uint64_t)density + 1;
+    if (bits / 8 > UINT32_MAX) return ESP_ERR_NOT_SUPPORTED;
+
+    geometry.capacity = bits / 8;
+
+    // address bytes: 0 is 3 only, 1 is 3 or 4 (starting in 3), 2 is 4 only
+    uint32_t dword1 = sfdp_dword(table, 0);
+    uint32_t address_mode = (dword1 >> 17) & 0x3;
+
+    geometry.address_bytes = 3;
+    enter_4b = ENTER_4B_NONE;
+
+    if (address_mode == 2) {
+        geometry.address_bytes = 4;
+    } else if (address_mode == 1 && geometry.capacity > ADDR_3B_LIMIT) {
+        geometry.address_bytes = 4;
+
+        // JESD216B: bit 0 is B7 alone, bit 1 is 06 then B7
+        uint8_t methods = table_dwords >= 16 ? sfdp_dword(table, 15) >> 24 : 0x01;
+        enter_4b = (methods & 0x01) || !(methods & 0x02) ? ENTER_4B_CMD : ENTER_4B_WREN_CMD;
+    }
+
+    // erase types: size as 2^n bytes and opcode, absent types read as 0
+    geometry.sector_erase_cmd = 0;
+    geometry.block32_erase_cmd = 0;
+    geometry.block64_erase_cmd = 0;
+
+    for (uint32_t i = 0; i < 4; i++) {
+        uint32_t dword = sfdp_dword(table, 7 + i / 2);
+        uint8_t size_exp = (dword >> ((i % 2) * 16)) & 0xFF;
+        uint8_t cmd = (dword >> ((i % 2) * 16 + 8)) & 0xFF;
+
+        if (size_exp == 12) geometry.sector_erase_cmd = cmd;
+        else if (size_exp == 15) geometry.block32_erase_cmd = cmd;
+        else if (size_exp == 16) geometry.block64_erase_cmd = cmd;
+    }
+
+    // page size from JESD216A on, 256 bytes before
+    if (table_dwords >= 11) geometry.page_size = 1 << ((sfdp_dword(table, 10) >> 4) & 0xF);
+
+    // 1-1-2 fast read: opcode, mode clocks and wait states in the low half of DWORD4, 1-2-2 is the high half
+    geometry.stream_read_cmd = CMD_FAST_READ;
+    geometry.stream_dummy_bits = 8;
+    geometry.stream_dual = false;
+
+    if (W25Q64_DUAL_OUTPUT && (dword1 & (1 << 16))) {
+        uint32_t dword4 = sfdp_dword(table, 3);
+
+        geometry.stream_read_cmd = (dword4 >> 8) & 0xFF;
+        geometry.stream_dummy_bits = (dword4 & 0x1F) + ((dword4 >> 5) & 0x7);
+        geometry.stream_dual = true;
+    }
+
+    geometry.sfdp = true;
+    return ESP_OK;
+}
+
+// capacity, erase types and read opcodes from SFDP, or from the JEDEC ID with W25Q defaults
+static esp_err_t w25q64_discover(void) {
+    uint8_t capacity_id;
+
+    esp_err_t ret = w25q64_read_JEDEC_ID(&capacity_id);
+    if (ret != ESP_OK) return ret;
+
+    if (w25q64_parse_sfdp() != ESP_OK) {
+        ESP_LOGW(TAG, "No SFDP table, using the JEDEC capacity");
+
+        geometry.capacity = 1UL << capacity_id;
+        geometry.address_bytes = geometry.capacity > ADDR_3B_LIMIT ? 4 : 3;
+        enter_4b = geometry.address_bytes == 4 ? ENTER_4B_CMD : ENTER_4B_NONE;
+        geometry.stream_read_cmd = W25Q64_DUAL_OUTPUT ? CMD_FAST_READ_DUAL : CMD_FAST_READ;
+        geometry.stream_dummy_bits = 8;
+        geometry.stream_dual = W25Q64_DUAL_OUTPUT;
+    }
+
+    // the flash log layout is built on 4 KB sectors and 256 byte pages
+    if (geometry.page_size != W25Q64_PAGE_SIZE || geometry.sector_erase_cmd == 0) {
+        ESP_LOGE(TAG, "Unsupported geometry: %lu byte pages, 4 KB erase %s", geometry.page_size, geometry.sector_erase_cmd ? "present" : "missing");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (geometry.address_bytes == 3 && geometry.capacity > ADDR_3B_LIMIT) {
+        ESP_LOGE(TAG, "Chip larger than 16 MB without 4 byte addressing");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (W25Q64_DUAL_OUTPUT && !geometry.stream_dual) {
+        ESP_LOGW(TAG, "Dual Output read not supported, streaming on a single line");
+    }
+
+    if (enter_4b == ENTER_4B_WREN_CMD) w25q64_write_enable();
+    if (enter_4b != ENTER_4B_NONE) w25q64_send_cmd(CMD_ENTER_4B);
+
+    ESP_LOGI(TAG, "Geometry%s: %lu KB, %u byte addresses, erase 4K/32K/64K 0x%02X/0x%02X/0x%02X, stream read 0x%02X + %u dummy",
+        geometry.sfdp ? " (SFDP)" : "", geometry.capacity / 1024, geometry.address_bytes,
+        geometry.sector_erase_cmd, geometry.block32_erase_cmd, geometry.block64_erase_cmd,
+        geometry.stream_read_cmd, geometry.stream_dummy_bits);
+
     return ESP_OK;
 }
 
 uint8_t w25q64_read_status(void) {
+    w25q64_lock_take();
     w25q64_cs_low();
 
     uint8_t cmd = CMD_READ_STATUS_1;
@@ -68,16 +506,10 @@ uint8_t w25q64_read_status(void) {
     spi_device_polling_transmit(w25q64_spi, &t_data);
 
     w25q64_cs_high();
+    w25q64_lock_give();
     return status;
 }
 
-static void w25q64_write_enable(void) {
-    w25q64_cs_low();
-    uint8_t cmd = CMD_WRITE_ENABLE;
-    spi_transaction_t t = { .length = 8, .tx_buffer = &cmd };
-    spi_device_polling_transmit(w25q64_spi, &t);
-    w25q64_cs_high();
-}
 
 
 esp_err_t w25q64_init(gpio_num_t mosi_pin, gpio_num_t miso_pin, gpio_num_t sclk_pin, gpio_num_t cs_pin){
@@ -85,6 +517,9 @@ esp_err_t w25q64_init(gpio_num_t mosi_pin, gpio_num_t miso_pin, gpio_num_t sclk_
 
     w25q64_cs_pin = cs_pin;
 
+    w25q64_lock = xSemaphoreCreateRecursiveMutex();
+    if (w25q64_lock == NULL) return ESP_ERR_NO_MEM;
+
     gpio_config_t io_conf = {
         .intr_type = GPIO_INTR_DISABLE,
         .mode = GPIO_MODE_OUTPUT,
@@ -101,7 +536,7 @@ esp_err_t w25q64_init(gpio_num_t mosi_pin, gpio_num_t miso_pin, gpio_num_t sclk_
         .sclk_io_num = sclk_pin,
         .quadwp_io_num = -1,
         .quadhd_io_num = -1,
-        .max_transfer_sz = 4096,
+        .max_transfer_sz = W25Q64_READ_CHUNK_SIZE,
     };
 
     ret = spi_bus_initialize(SPI2_HOST, &bus_cfg, SPI_DMA_CH_AUTO);
@@ -123,52 +558,171 @@ esp_err_t w25q64_init(gpio_num_t mosi_pin, gpio_num_t miso_pin, gpio_num_t sclk_
         return ret;
     }
 
-    // read JEDEC_ID to validate
-    return w25q64_read_JEDEC_ID();
+    ret = w25q64_discover();
+    if (ret != ESP_OK) return ret;
+
+    // fast read device: command, address and dummy clocks handled by the peripheral
+    spi_device_interface_config_t stream_devcfg = {
+        .command_bits = 8,
+        .address_bits = geometry.address_bytes * 8,
+        .dummy_bits = geometry.stream_dummy_bits,
+        .clock_speed_hz = STREAM_CLOCK_HZ,
+        .mode = 0,
+        .spics_io_num = -1, // CS driven by pre/post callbacks
+        .flags = SPI_DEVICE_HALFDUPLEX,
+        .queue_size = STREAM_BUFFERS,
+        .pre_cb = w25q64_stream_pre_cb,
+        .post_cb = w25q64_stream_post_cb,
+    };
+
+    ret = spi_bus_add_device(SPI2_HOST, &stream_devcfg, &w25q64_spi_stream);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add SPI stream device: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    return ESP_OK;
 }
 
 esp_err_t w25q64_read_data(uint32_t address, uint8_t *data, size_t size) {
     if (size == 0 || data == NULL) return ESP_ERR_INVALID_ARG;
 
-    w25q64_wait_ready();
+    w25q64_lock_take();
+    w25q64_ready_for(address, size);
     w25q64_cs_low();
 
-    uint8_t cmd_addr[4] = {
-        CMD_READ_DATA,
-        (address >> 16) & 0xFF,
-        (address >> 8) & 0xFF,
-        (address) & 0xFF
-    };
+    uint8_t cmd_addr[5];
+    size_t cmd_len = w25q64_cmd_addr(cmd_addr, CMD_READ_DATA, address);
 
-    spi_transaction_t t_cmd = { .length = 32, .tx_buffer = cmd_addr };
+    spi_transaction_t t_cmd = { .length = cmd_len * 8, .tx_buffer = cmd_addr };
     spi_device_polling_transmit(w25q64_spi, &t_cmd);
 
     spi_transaction_t t_data = { .length = size * 8, .rx_buffer = data };
     spi_device_polling_transmit(w25q64_spi, &t_data);
 
     w25q64_cs_high();
+    w25q64_resume_erase();
+    w25q64_lock_give();
     return ESP_OK;
 }
 
+static void w25q64_stream_trans(spi_transaction_t *t, uint8_t *buffer, uint32_t address, size_t size) {
+    *t = (spi_transaction_t) {
+        .flags = geometry.stream_dual ? SPI_TRANS_MODE_DIO : 0,
+        .cmd = geometry.stream_read_cmd,
+        .addr = address,
+        .length = 0,
+        .rxlength = size * 8,
+        .rx_buffer = buffer,
+    };
+}
+
+esp_err_t w25q64_read_stream(uint32_t address, uint8_t *data, size_t size) {
+    if (size == 0 || data == NULL) return ESP_ERR_INVALID_ARG;
+
+    w25q64_lock_take();
+    w25q64_ready_for(address, size);
+
+    esp_err_t ret = ESP_OK;
+
+    while (size > 0) {
+        size_t chunk = size < W25Q64_READ_CHUNK_SIZE ? size : W25Q64_READ_CHUNK_SIZE;
+
+        spi_transaction_t t;
+        w25q64_stream_trans(&t, data, address, chunk);
+
+        ret = spi_device_polling_transmit(w25q64_spi_stream, &t);
+        if (ret != ESP_OK) break;
+
+        address += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+
+    w25q64_resume_erase();
+    w25q64_lock_give();
+    return ret;
+}
+
+esp_err_t w25q64_read_stream_cb(uint32_t address, size_t size, w25q64_read_sink_t sink, void *ctx) {
+    if (size == 0 || sink == NULL) return ESP_ERR_INVALID_ARG;
+
+    w25q64_lock_take();
+    w25q64_ready_for(address, size);
+
+    spi_transaction_t t[STREAM_BUFFERS];
+    uint32_t queue_addr = address;
+    size_t queue_remaining = size;
+    uint32_t in_flight = 0;
+    bool stop = false;
+    esp_err_t ret = ESP_OK;
+
+    // prime every buffer
+    for (uint32_t i = 0; i < STREAM_BUFFERS && queue_remaining > 0; i++) {
+        size_t chunk = queue_remaining < W25Q64_READ_CHUNK_SIZE ? queue_remaining : W25Q64_READ_CHUNK_SIZE;
+        w25q64_stream_trans(&t[i], stream_buffer[i], queue_addr, chunk);
+
+        ret = spi_device_queue_trans(w25q64_spi_stream, &t[i], portMAX_DELAY);
+        if (ret != ESP_OK) break;
+
+        in_flight++;
+        queue_addr += chunk;
+        queue_remaining -= chunk;
+    }
+
+    // chunks complete in order: hand each to the sink, then reuse its buffer
+    while (in_flight > 0) {
+        spi_transaction_t *done;
+        esp_err_t result = spi_device_get_trans_result(w25q64_spi_stream, &done, portMAX_DELAY);
+        in_flight--;
+
+        if (result != ESP_OK) {
+            ret = result;
+            stop = true;
+        }
+
+        if (stop || ret != ESP_OK) continue;
+
+        if (!sink((uint32_t)done->addr, done->rx_buffer, done->rxlength / 8, ctx)) {
+            stop = true;
+            continue;
+        }
+
+        if (queue_remaining > 0) {
+            size_t chunk = queue_remaining < W25Q64_READ_CHUNK_SIZE ? queue_remaining : W25Q64_READ_CHUNK_SIZE;
+            w25q64_stream_trans(done, done->rx_buffer, queue_addr, chunk);
+
+            ret = spi_device_queue_trans(w25q64_spi_stream, done, portMAX_DELAY);
+            if (ret != ESP_OK) continue;
+
+            in_flight++;
+            queue_addr += chunk;
+            queue_remaining -= chunk;
+        }
+    }
+
+    w25q64_resume_erase();
+    w25q64_lock_give();
+    return ret;
+}
+
 static esp_err_t w25q64_write_page(uint32_t address, const uint8_t *data, size_t size) {
     w25q64_write_enable();
     w25q64_cs_low();
 
-    uint8_t cmd_addr[4] = {
-        CMD_PAGE_PROGRAM,
-        (address >> 16) & 0xFF,
-        (address >> 8) & 0xFF,
-        (address) & 0xFF
-    };
+    uint8_t cmd_addr[5];
+    size_t cmd_len = w25q64_cmd_addr(cmd_addr, CMD_PAGE_PROGRAM, address);
 
-    spi_transaction_t t_cmd = { .length = 32, .tx_buffer = cmd_addr };
+    spi_transaction_t t_cmd = { .length = cmd_len * 8, .tx_buffer = cmd_addr };
     spi_device_polling_transmit(w25q64_spi, &t_cmd);
 
     spi_transaction_t t_data = { .length = size * 8, .tx_buffer = data };
     spi_device_polling_transmit(w25q64_spi, &t_data);
 
     w25q64_cs_high();
-    w25q64_wait_ready();
+    w25q64_wait_op(W25Q64_OP_PAGE_PROGRAM);
+
+    page_program_count++;
 
     return ESP_OK;
 }
@@ -176,6 +730,9 @@ static esp_err_t w25q64_write_page(uint32_t address, const uint8_t *data, size_t
 esp_err_t w25q64_write_data(uint32_t address, const uint8_t *data, size_t size) {
     if (size == 0 || data == NULL) return ESP_ERR_INVALID_ARG;
 
+    w25q64_lock_take();
+    w25q64_ready_for(address, size);
+
     uint32_t current_addr = address;
     size_t bytes_remaining = size;
     const uint8_t *data_ptr = data;
@@ -189,45 +746,148 @@ esp_err_t w25q64_write_data(uint32_t address, const uint8_t *data, size_t size)
         }
 
         esp_err_t ret = w25q64_write_page(current_addr, data_ptr, bytes_to_write);
-        if (ret != ESP_OK) return ret;
+        if (ret != ESP_OK) {
+            w25q64_resume_erase();
+            w25q64_lock_give();
+            return ret;
+        }
 
         current_addr += bytes_to_write;
         data_ptr += bytes_to_write;
         bytes_remaining -= bytes_to_write;
     }
 
+    w25q64_resume_erase();
+    w25q64_lock_give();
     return ESP_OK;
 }
 
-esp_err_t w25q64_erase_sector(uint32_t sector_address) {
-    if (sector_address % W25Q64_SECTOR_SIZE != 0) {
-        ESP_LOGE(TAG, "Sector address must be a multiple of 4096 bytes");
-        return ESP_ERR_INVALID_ARG;
+// polls until the erase issued just before completes, with the lock released so it can be suspended
+static void w25q64_wait_erase(w25q64_op_t op) {
+    const op_timing_t *timing = &op_timing[op];
+    int64_t start = esp_timer_get_time();
+
+    while (1) {
+        w25q64_lock_take();
+        bool done = w25q64_erase_done();
+        w25q64_lock_give();
+
+        if (done) break;
+
+        uint32_t elapsed_us = esp_timer_get_time() - start;
+
+        if (elapsed_us < timing->typical_us) {
+            TickType_t ticks = pdMS_TO_TICKS((timing->typical_us - elapsed_us) / 1000);
+            vTaskDelay(ticks > 0 ? ticks : 1);
+        } else {
+            vTaskDelay(1);
+        }
     }
 
+    // suspended time included
+    w25q64_record_op(op, esp_timer_get_time() - start);
+}
+
+static esp_err_t w25q64_erase(uint8_t cmd, uint32_t address, uint32_t size, w25q64_op_t op) {
+    w25q64_lock_take();
+
+    // one erase at a time
+    w25q64_wait_erase_idle();
+    w25q64_wait_ready();
+
     w25q64_write_enable();
     w25q64_cs_low();
 
-    uint8_t cmd_addr[4] = {
-        CMD_SECTOR_ERASE,
-        (sector_address >> 16) & 0xFF,
-        (sector_address >> 8) & 0xFF,
-        (sector_address) & 0xFF
-    };
+    uint8_t cmd_addr[5];
+    size_t cmd_len = w25q64_cmd_addr(cmd_addr, cmd, address);
 
-    spi_transaction_t t_cmd = { .length = 32, .tx_buffer = cmd_addr };
-    spi_device_polling_transmit(w25q64_spi, &t_cmd);
+    spi_transaction_t t_cmd = { .length = cmd_len * 8, .tx_buffer = cmd_addr };
+    esp_err_t ret = spi_device_polling_transmit(w25q64_spi, &t_cmd);
 
     w25q64_cs_high();
-    w25q64_wait_ready();
+
+    if (ret == ESP_OK) {
+        erase_state.active = true;
+        erase_state.address = address;
+        erase_state.size = size;
+    }
+
+    w25q64_lock_give();
+
+    if (ret == ESP_OK) w25q64_wait_erase(op);
+
+    return ret;
+}
+
+esp_err_t w25q64_erase_sector(uint32_t sector_address) {
+    if (sector_address % W25Q64_SECTOR_SIZE != 0) {
+        ESP_LOGE(TAG, "Sector address must be a multiple of 4096 bytes");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t ret = w25q64_erase(geometry.sector_erase_cmd, sector_address, W25Q64_SECTOR_SIZE, W25Q64_OP_SECTOR_ERASE);
+    if (ret != ESP_OK) return ret;
 
     ESP_LOGI(TAG, "Erased sector at 0x%06lX", sector_address);
     return ESP_OK;
 }
 
+esp_err_t w25q64_erase_block32(uint32_t block_address) {
+    if (block_address % W25Q64_BLOCK32_SIZE != 0) return ESP_ERR_INVALID_ARG;
+    if (geometry.block32_erase_cmd == 0) return ESP_ERR_NOT_SUPPORTED;
+
+    return w25q64_erase(geometry.block32_erase_cmd, block_address, W25Q64_BLOCK32_SIZE, W25Q64_OP_BLOCK32_ERASE);
+}
+
+esp_err_t w25q64_erase_block64(uint32_t block_address) {
+    if (block_address % W25Q64_BLOCK64_SIZE != 0) return ESP_ERR_INVALID_ARG;
+    if (geometry.block64_erase_cmd == 0) return ESP_ERR_NOT_SUPPORTED;
+
+    return w25q64_erase(geometry.block64_erase_cmd, block_address, W25Q64_BLOCK64_SIZE, W25Q64_OP_BLOCK64_ERASE);
+}
+
+esp_err_t w25q64_erase_range(uint32_t address, size_t size, w25q64_erase_progress_t progress, void *ctx) {
+    if (address % W25Q64_SECTOR_SIZE != 0 || size % W25Q64_SECTOR_SIZE != 0 || address + size > geometry.capacity) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t end = address + size;
+
+    while (address < end) {
+        uint32_t remaining = end - address;
+        uint32_t step;
+        esp_err_t ret;
+
+        // a block erase takes about as long as a few sector erases, when the chip has one
+        if (geometry.block64_erase_cmd && address % W25Q64_BLOCK64_SIZE == 0 && remaining >= W25Q64_BLOCK64_SIZE) {
+            step = W25Q64_BLOCK64_SIZE;
+            ret = w25q64_erase(geometry.block64_erase_cmd, address, step, W25Q64_OP_BLOCK64_ERASE);
+        } else if (geometry.block32_erase_cmd && address % W25Q64_BLOCK32_SIZE == 0 && remaining >= W25Q64_BLOCK32_SIZE) {
+            step = W25Q64_BLOCK32_SIZE;
+            ret = w25q64_erase(geometry.block32_erase_cmd, address, step, W25Q64_OP_BLOCK32_ERASE);
+        } else {
+            step = W25Q64_SECTOR_SIZE;
+            ret = w25q64_erase(geometry.sector_erase_cmd, address, step, W25Q64_OP_SECTOR_ERASE);
+        }
+
+        if (ret != ESP_OK) return ret;
+
+        address += step;
+        if (progress != NULL) progress(size - (end - address), size, ctx);
+    }
+
+    return ESP_OK;
+}
+
 esp_err_t w25q64_erase_chip(void) {
     ESP_LOGI(TAG, "Starting chip erase...");
 
+    w25q64_lock_take();
+
+    // a chip erase cannot be suspended, and cannot start during another erase
+    w25q64_wait_erase_idle();
+    w25q64_wait_ready();
+
     w25q64_write_enable();
     w25q64_cs_low();
 
@@ -238,13 +898,177 @@ esp_err_t w25q64_erase_chip(void) {
     w25q64_cs_high();
 
     if (ret != ESP_OK) {
+        w25q64_lock_give();
         ESP_LOGE(TAG, "Failed to send Bulk Erase command");
         return ret;
     }
 
-    w25q64_wait_ready();
+    w25q64_wait_op(W25Q64_OP_CHIP_ERASE);
+    w25q64_lock_give();
 
     ESP_LOGI(TAG, "Memory erased successfully");
 
     return ESP_OK;
+}
+
+const w25q64_geometry_t* w25q64_get_geometry(void) {
+    return &geometry;
+}
+
+uint32_t w25q64_get_page_program_count(void) {
+    return page_program_count;
+}
+
+static esp_err_t w25q64_queued_write_page(uint32_t address, const uint8_t *data, size_t size) {
+    w25q64_write_enable();
+    w25q64_cs_low();
+
+    uint8_t cmd_addr[5];
+    size_t cmd_len = w25q64_cmd_addr(cmd_addr, CMD_PAGE_PROGRAM, address);
+
+    // queue command and data back to back, the DMA streams the page while CS stays low
+    spi_transaction_t t_cmd = { .length = cmd_len * 8, .tx_buffer = cmd_addr };
+    spi_transaction_t t_data = { .length = size * 8, .tx_buffer = data };
+    spi_transaction_t *t_done;
+    uint32_t queued = 0;
+
+    esp_err_t ret = spi_device_queue_trans(w25q64_spi, &t_cmd, portMAX_DELAY);
+    if (ret == ESP_OK) {
+        queued++;
+        ret = spi_device_queue_trans(w25q64_spi, &t_data, portMAX_DELAY);
+        if (ret == ESP_OK) queued++;
+    }
+
+    while (queued-- > 0) {
+        esp_err_t result = spi_device_get_trans_result(w25q64_spi, &t_done, portMAX_DELAY);
+        if (ret == ESP_OK) ret = result;
+    }
+
+    w25q64_cs_high();
+    if (ret != ESP_OK) return ret;
+
+    w25q64_wait_op(W25Q64_OP_PAGE_PROGRAM);
+
+    page_program_count++;
+
+    return ESP_OK;
+}
+
+static void w25q64_writer_done(void) {
+    portENTER_CRITICAL(&writer_mux);
+    bool idle = --writer_pending == 0;
+    portEXIT_CRITICAL(&writer_mux);
+
+    if (idle) xSemaphoreGive(writer_idle);
+}
+
+static void w25q64_writer_task(void *arg) {
+    write_request_t request;
+
+    while (1) {
+        if (xQueueReceive(writer_queue, &request, portMAX_DELAY) != pdTRUE) continue;
+
+        w25q64_lock_take();
+        w25q64_ready_for(request.address, request.size);
+        esp_err_t ret = w25q64_queued_write_page(request.address, request.data, request.size);
+        w25q64_resume_erase();
+        w25q64_lock_give();
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Async page program at 0x%06lX failed: %s", request.address, esp_err_to_name(ret));
+        }
+
+        // the page buffer belongs to the caller again
+        if (writer_done_cb != NULL) writer_done_cb(request.data, ret, writer_done_ctx);
+
+        w25q64_writer_done();
+    }
+
+    vTaskDelete(NULL);
+}
+
+esp_err_t w25q64_async_init(w25q64_write_done_cb_t done_cb, void *ctx) {
+    if (writer_queue != NULL) return ESP_ERR_INVALID_STATE;
+
+    writer_done_cb = done_cb;
+    writer_done_ctx = ctx;
+
+    writer_idle = xSemaphoreCreateBinary();
+    if (writer_idle == NULL) return ESP_ERR_NO_MEM;
+
+    writer_queue = xQueueCreate(WRITER_QUEUE_SIZE, sizeof(write_request_t));
+    if (writer_queue == NULL) return ESP_ERR_NO_MEM;
+
+    if (xTaskCreatePinnedToCore(w25q64_writer_task, "w25q64_writer", WRITER_TASK_STACK, NULL, WRITER_TASK_PRIORITY, NULL, WRITER_TASK_CORE) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t w25q64_async_write_page(uint32_t address, const uint8_t *data, size_t size, TickType_t timeout) {
+    if (writer_queue == NULL) return ESP_ERR_INVALID_STATE;
+    if (size == 0 || data == NULL) return ESP_ERR_INVALID_ARG;
+
+    // a single page program cannot cross a page boundary
+    if ((address % W25Q64_PAGE_SIZE) + size > W25Q64_PAGE_SIZE) return ESP_ERR_INVALID_SIZE;
+
+    write_request_t request = {
+        .address = address,
+        .data = data,
+        .size = size,
+    };
+
+    portENTER_CRITICAL(&writer_mux);
+    writer_pending++;
+    portEXIT_CRITICAL(&writer_mux);
+
+    if (xQueueSend(writer_queue, &request, timeout) != pdTRUE) {
+        w25q64_writer_done();
+        return ESP_ERR_TIMEOUT;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t w25q64_async_flush(TickType_t timeout) {
+    TickType_t start = xTaskGetTickCount();
+
+    // sleep until the writer drains instead of polling a tick at a time,
+    // a give left over from an earlier drain only costs one more pass
+    while (writer_pending != 0) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) return ESP_ERR_TIMEOUT;
+
+        xSemaphoreTake(writer_idle, timeout - elapsed);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t w25q64_get_op_stats(w25q64_op_t op, w25q64_op_stats_t *stats) {
+    if (op >= W25Q64_OP_COUNT || stats == NULL) return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&op_counters_mux);
+    op_counters_t counters = op_counters[op];
+    portEXIT_CRITICAL(&op_counters_mux);
+
+    stats->count = counters.count;
+    stats->min_us = counters.min_us;
+    stats->max_us = counters.max_us;
+    stats->avg_us = counters.count > 0 ? (uint32_t)(counters.total_us / counters.count) : 0;
+
+    return ESP_OK;
+}
+
+void w25q64_get_suspend_stats(w25q64_suspend_stats_t *stats) {
+    w25q64_lock_take();
+    *stats = suspend_stats;
+    w25q64_lock_give();
+}
+
+void w25q64_reset_op_stats(void) {
+    portENTER_CRITICAL(&op_counters_mux);
+    memset(op_counters, 0, sizeof(op_counters));
+    portEXIT_CRITICAL(&op_counters_mux);
 }
\ No newline at end of file
@@ -3,17 +3,95 @@
 
 #include "driver/gpio.h"
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
+// erase and program granularity the driver requires, capacity and opcodes are read from the chip
 #define W25Q64_SECTOR_SIZE 4096
+#define W25Q64_BLOCK32_SIZE (32 * 1024)
+#define W25Q64_BLOCK64_SIZE (64 * 1024)
 #define W25Q64_PAGE_SIZE 256
+#define W25Q64_READ_CHUNK_SIZE 4096 // SPI bus max_transfer_sz
 
 /**
- * @brief Initializes SPI communication with the W25Q64 chip
+ * @brief Chip geometry discovered at init from the SFDP basic parameter table,
+ *        or from the JEDEC ID capacity byte when the chip has none.
+ */
+typedef struct {
+    uint32_t capacity; // bytes
+    uint32_t page_size;
+    uint8_t address_bytes; // 3, or 4 above 16 MB
+    uint8_t sector_erase_cmd;
+    uint8_t block32_erase_cmd; // 0 when the chip has no such erase
+    uint8_t block64_erase_cmd;
+    uint8_t stream_read_cmd;
+    uint8_t stream_dummy_bits;
+    bool stream_dual;
+    bool sfdp;
+} w25q64_geometry_t;
+
+/**
+ * @brief Busy-waited operations, timed by w25q64_get_op_stats().
+ */
+typedef enum {
+    W25Q64_OP_PAGE_PROGRAM,
+    W25Q64_OP_SECTOR_ERASE,
+    W25Q64_OP_CHIP_ERASE,
+    W25Q64_OP_BLOCK32_ERASE,
+    W25Q64_OP_BLOCK64_ERASE,
+    W25Q64_OP_COUNT,
+} w25q64_op_t;
+
+/**
+ * @brief Measured busy time of an operation, from command to ready.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t max_us;
+} w25q64_op_stats_t;
+
+/**
+ * @brief Erase suspend scheduling: operations outside a running sector or block erase suspend it (0x75)
+ *        and resume it (0x7A) when done, operations inside its range wait for it.
+ */
+typedef struct {
+    uint32_t suspends;
+    uint32_t blocked; // operations that waited for an erase of their own range
+    uint32_t max_suspend_us;
+    uint64_t total_suspend_us;
+} w25q64_suspend_stats_t;
+
+/**
+ * @brief Receives consecutive chunks of a streaming read. Return false to stop the stream.
+ */
+typedef bool (*w25q64_read_sink_t)(uint32_t address, const uint8_t *data, size_t size, void *ctx);
+
+/**
+ * @brief Reports the bytes erased so far by w25q64_erase_range().
+ */
+typedef void (*w25q64_erase_progress_t)(uint32_t erased, uint32_t total, void *ctx);
+
+/**
+ * @brief Called from the writer task when an asynchronous page program completes.
+ *        After this call the page buffer may be reused by the caller.
+ */
+typedef void (*w25q64_write_done_cb_t)(const uint8_t *page, esp_err_t result, void *ctx);
+
+/**
+ * @brief Initializes SPI communication with the flash chip and discovers its geometry.
+ *        Any SPI NOR with 4 KB sectors and 256 byte pages is accepted, up to 4 GB.
  */
 esp_err_t w25q64_init(gpio_num_t mosi_pin, gpio_num_t miso_pin, gpio_num_t sclk_pin, gpio_num_t cs_pin);
 
+/**
+ * @brief Geometry of the chip found by w25q64_init().
+ */
+const w25q64_geometry_t* w25q64_get_geometry(void);
+
 /**
  * @brief read W25Q64 status
  */
@@ -24,6 +102,17 @@ uint8_t w25q64_read_status(void);
  */
 esp_err_t w25q64_read_data(uint32_t address, uint8_t *data, size_t size);
 
+/**
+ * @brief Reads a large range with Fast Read (Dual Output when enabled) at the streaming clock,
+ *        split in W25Q64_READ_CHUNK_SIZE transfers.
+ */
+esp_err_t w25q64_read_stream(uint32_t address, uint8_t *data, size_t size);
+
+/**
+ * @brief Streams a range to a sink chunk by chunk, reading the next chunk while the sink runs.
+ */
+esp_err_t w25q64_read_stream_cb(uint32_t address, size_t size, w25q64_read_sink_t sink, void *ctx);
+
 /**
  * @brief Writes bytes to the flash memory.
  *        Note: The sector (4KB) containing this address MUST be erased before writing!
@@ -35,9 +124,59 @@ esp_err_t w25q64_write_data(uint32_t address, const uint8_t *data, size_t size);
  */
 esp_err_t w25q64_erase_sector(uint32_t sector_address);
 
+/**
+ * @brief Erases a 32KB or 64KB block (0x52 / 0xD8). The address must be aligned to the block size.
+ */
+esp_err_t w25q64_erase_block32(uint32_t block_address);
+esp_err_t w25q64_erase_block64(uint32_t block_address);
+
+/**
+ * @brief Erases a sector aligned range with the largest aligned erase at each step,
+ *        sectors only at the edges. progress may be NULL.
+ */
+esp_err_t w25q64_erase_range(uint32_t address, size_t size, w25q64_erase_progress_t progress, void *ctx);
+
 /**
  * @brief Erases the entire chip.
  */
 esp_err_t w25q64_erase_chip(void);
 
+/**
+ * @brief Returns the number of page program cycles issued since boot.
+ */
+uint32_t w25q64_get_page_program_count(void);
+
+/**
+ * @brief Starts the asynchronous writer task. done_cb is called once per queued page.
+ */
+esp_err_t w25q64_async_init(w25q64_write_done_cb_t done_cb, void *ctx);
+
+/**
+ * @brief Queues a single page program and returns without waiting for the chip.
+ *        The write must not cross a page boundary and data must stay valid
+ *        (and DMA capable) until done_cb reports it.
+ */
+esp_err_t w25q64_async_write_page(uint32_t address, const uint8_t *data, size_t size, TickType_t timeout);
+
+/**
+ * @brief Waits until every queued page program has completed.
+ *        Sleeps until the writer task drains, not in whole ticks.
+ */
+esp_err_t w25q64_async_flush(TickType_t timeout);
+
+/**
+ * @brief Returns the latency counters of an operation type.
+ */
+esp_err_t w25q64_get_op_stats(w25q64_op_t op, w25q64_op_stats_t *stats);
+
+/**
+ * @brief Returns the erase suspend counters.
+ */
+void w25q64_get_suspend_stats(w25q64_suspend_stats_t *stats);
+
+/**
+ * @brief Clears the latency counters of every operation type.
+ */
+void w25q64_reset_op_stats(void);
+
 #endif
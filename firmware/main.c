@@ -14,10 +14,17 @@
 
 #include <math.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 
 #include "flight_logic.h"
+#include "loop_timer.h"
+#include "loop_profile.h"
+#include "dlog.h"
+#include "imu_fifo.h"
 #include "flash_log.h"
 #include "flash_interface.h"
+#include "flash_codec.h"
 #include "tmtc.h"
 #include "crc.h"
 
@@ -50,19 +57,33 @@ typedef enum {
     ABORT_GPS_INIT = 8,
     ABORT_SENSOR_READING = 9,
     ABORT_USB_UART_INIT = 10,
+    ABORT_LOOP_TIMER_INIT = 11,
+    ABORT_DLOG_INIT = 12,
 } abort_code_t;
 
-#define AVIONICS_INTERVAL pdMS_TO_TICKS(40) // 40 ms = 25 Hz
+// paced by a hardware timer, not the tick: up to LOOP_TIMER_MAX_RATE_HZ.
+// flight_logic confirms liftoff and apogee over times, not iterations
+#define AVIONICS_RATE_HZ 100
+#define AVIONICS_STATS_INTERVAL (5 * AVIONICS_RATE_HZ) // iterations
 #define BOOT_TIMEOUT pdMS_TO_TICKS(5000)
 
 #define SPI_MISO GPIO_NUM_22
 #define SPI_MOSI GPIO_NUM_19
 #define SPI_CLK GPIO_NUM_21
 #define W25Q_CS GPIO_NUM_23
-#define FLASH_SAMPLING 5
+#define FLASH_QUEUE_SIZE 128 // a full rate phase queues every IMU sample
+#define FLASH_IDLE_TIMEOUT pdMS_TO_TICKS(100)
+#define FLASH_ERASE_QUEUE_MAX (FLASH_QUEUE_SIZE / 4) // samples waiting, leaves room for a 45 ms sector erase at full rate
+#define FLASH_STATS_INTERVAL pdMS_TO_TICKS(5000)
 
 #define USB_BAUD_RATE 115200
 #define UART_PORT_USB UART_NUM_0
+#define USB_TX_BUFFER_SIZE 4096
+#define USB_RX_TIMEOUT pdMS_TO_TICKS(200)
+#define USB_POLL_INTERVAL pdMS_TO_TICKS(100)
+#define USB_BAUD_CONFIRM_TIMEOUT pdMS_TO_TICKS(1000) // falls back to USB_BAUD_RATE
+#define BULK_ACK_TIMEOUT pdMS_TO_TICKS(500)
+#define BULK_MAX_RETRIES 10
 
 #define LORA_TX GPIO_NUM_32
 #define LORA_RX GPIO_NUM_33
@@ -71,7 +92,7 @@ typedef enum {
 #define LORA_AUX GPIO_NUM_34
 #define LORA_UART UART_NUM_2
 #define LORA_BAUD_RATE 9600
-#define LORA_SAMPLING 10
+#define LORA_SAMPLING (AVIONICS_RATE_HZ * 2 / 5) // iterations
 
 #define GPS_TX GPIO_NUM_18
 #define GPS_RX GPIO_NUM_5
@@ -85,11 +106,15 @@ typedef enum {
 #define I2C_PORT I2C_NUM_0
 #define MAX_I2C_RECOVERIES 5
 
+#define MPU_INT_PIN GPIO_NUM_35 // data ready, push-pull active high
+#define IMU_RATE_HZ 1000
+#define IMU_BATCH_MAX (2 * IMU_RATE_HZ / AVIONICS_RATE_HZ) // samples taken per iteration
+
 #define BAT_R1 100000.0f
 #define BAT_R2 47000.0f
 #define BAT_MULTIPLIER ((BAT_R1 + BAT_R2) / BAT_R2)
 #define BAT_SENSE_PIN GPIO_NUM_36
-#define BAT_SAMPLING 25
+#define BAT_SAMPLING AVIONICS_RATE_HZ // iterations
 
 #define PARACHUTE_PIN GPIO_NUM_4
 #define LED_PIN GPIO_NUM_2
@@ -108,9 +133,32 @@ static adc_oneshot_unit_handle_t adc1_handle;
 static adc_cali_handle_t adc1_cali_handle;
 
 static QueueHandle_t flash_queue;
+
+// IMU samples taken by the avionics task this iteration
+static imu_sample_t imu_batch[IMU_BATCH_MAX];
+
+// raw mean of the last iteration with samples, logged as is
+static mpu6050_raw_motion_t imu_mean;
+
+// flash queue statistics, written by the avionics task
+static volatile uint32_t flash_dropped;
+static volatile uint32_t flash_queue_high_water;
 static QueueHandle_t lora_queue;
 static QueueHandle_t telecommand_queue;
 
+_Static_assert(PROFILE_STAGE_COUNT == FLASH_PROFILE_STAGES, "flight header profile out of sync");
+_Static_assert(IMU_RATE_HZ <= FLASH_FULL_RATE_HZ, "erase-ahead window sized for a slower full rate");
+
+// the profile since arming goes into the flight header
+static void store_loop_profile(void) {
+    loop_profile_stats_t stats;
+
+    for (uint32_t i = 0; i < PROFILE_STAGE_COUNT; i++) {
+        loop_profile_get_total(i, &stats);
+        flash_log_set_stage_profile(i, stats.mean_us, stats.p99_us, stats.max_us);
+    }
+}
+
 static void arm_systems(void) {
     if (flight_logic.should_arm == true){
         return;
@@ -118,6 +166,7 @@ static void arm_systems(void) {
 
     flight_logic.should_arm = true;
     flash_log_start_flight();
+    loop_profile_reset();
 }
 
 static void disarm_systems(void) {
@@ -126,6 +175,7 @@ static void disarm_systems(void) {
     }
 
     flight_logic.should_arm = false;
+    store_loop_profile();
     flash_log_finish_flight(flight_logic.state.ut - flight_logic.ut_0);
 }
 
@@ -164,6 +214,71 @@ static void avionics_abort(int code) {
 }
 
 
+// saturating, NAN ends up as 0
+static uint16_t to_fixed_u16(float value, float scale) {
+    if (isnan(value)) return TMTC_FIXED_INVALID;
+
+    // clamped before the cast: out of range float to integer conversions are undefined
+    float fixed = value * scale + 0.5f;
+
+    if (fixed < 1.0f) return 0;
+    if (fixed >= (float)(TMTC_FIXED_INVALID - 1)) return TMTC_FIXED_INVALID - 1;
+
+    return (uint16_t)fixed;
+}
+
+static void fill_flash_motion(flash_payload_t *payload, const mpu6050_raw_motion_t *motion) {
+    payload->accel.x = motion->accel.x;
+    payload->accel.y = motion->accel.y;
+    payload->accel.z = motion->accel.z;
+    payload->ang_vel.x = motion->gyro.x;
+    payload->ang_vel.y = motion->gyro.y;
+    payload->ang_vel.z = motion->gyro.z;
+}
+
+static void fill_flash_payload(flash_payload_t *payload, float battery_voltage) {
+    payload->ut = flight_logic.state.ut;
+    fill_flash_motion(payload, &imu_mean);
+    payload->pressure = flight_logic.state.pressure;
+    payload->temperature = flight_logic.state.temperature;
+    payload->lat_nmea = flight_logic.state.lat_nmea;
+    payload->lon_nmea = flight_logic.state.lon_nmea;
+    payload->satellites = flight_logic.state.satellites;
+    payload->v_bat = battery_voltage;
+    payload->phase = (uint8_t) flight_logic.state.phase;
+}
+
+static void queue_flash_payload(const flash_payload_t *payload) {
+    if (xQueueSend(flash_queue, payload, 0) != pdTRUE) {
+        // keep the newest sample, flash_task reports the drops
+        flash_payload_t discarded;
+        xQueueReceive(flash_queue, &discarded, 0);
+        xQueueSend(flash_queue, payload, 0);
+        flash_dropped++;
+    }
+
+    uint32_t waiting = uxQueueMessagesWaiting(flash_queue);
+    if (waiting > flash_queue_high_water) flash_queue_high_water = waiting;
+}
+
+// stage with the highest p99 over the last window
+static uint8_t slowest_stage(void) {
+    uint8_t slowest = 0;
+    uint32_t slowest_p99 = 0;
+
+    for (uint32_t i = 0; i < PROFILE_LOOP; i++) {
+        loop_profile_stats_t stats;
+        loop_profile_get_window(i, &stats);
+
+        if (stats.p99_us > slowest_p99) {
+            slowest = i;
+            slowest_p99 = stats.p99_us;
+        }
+    }
+
+    return slowest;
+}
+
 static void avionics_task(void *arg) {
     // lora
     uint32_t lora_counter = 0;
@@ -171,7 +286,7 @@ static void avionics_task(void *arg) {
     telecommand_payload_t tc_payload;
 
     // flash
-    uint32_t flash_counter = 0;
+    uint32_t last_flash_ut = 0;
     flash_payload_t flash_payload;
 
     // i2c sensors
@@ -194,19 +309,51 @@ static void avionics_task(void *arg) {
         "BMP280 initial reading failed"
     );
     AVIONICS_ERROR_CHECK(
-        mpu6050_get_motion(&mpu_dev, &flight_logic.state.accel, &flight_logic.state.ang_vel),
+        mpu6050_get_raw_motion(&mpu_dev, &imu_mean, NULL),
         ABORT_SENSOR_READING,
         "MPU6050 initial reading failed"
     );
+    mpu6050_convert_motion(&mpu_dev, &imu_mean, &flight_logic.state.accel, &flight_logic.state.ang_vel);
     flight_logic_init(&flight_logic);
 
     // frequency
-    TickType_t last_tick = xTaskGetTickCount();
-    const TickType_t interval = AVIONICS_INTERVAL;
+    uint32_t stats_counter = 0;
+
+    AVIONICS_ERROR_CHECK(
+        loop_timer_start(AVIONICS_RATE_HZ),
+        ABORT_LOOP_TIMER_INIT,
+        "Loop timer failed to start"
+    );
 
     // main loop
     while (1) {
-        vTaskDelayUntil(&last_tick, interval);
+        if (loop_timer_wait() != ESP_OK) {
+            ESP_LOGW(TAG, "Loop timer stalled");
+        }
+
+        loop_profile_begin();
+
+        if (++stats_counter >= AVIONICS_STATS_INTERVAL) {
+            stats_counter = 0;
+
+            loop_timer_stats_t loop_stats;
+            loop_timer_get_stats(&loop_stats);
+            loop_timer_reset_stats();
+
+            // deferred like the state line: the control loop never formats text
+            DLOG(LOOP_TIMING, loop_stats.rate_hz, loop_stats.min_jitter_us, loop_stats.avg_jitter_us, loop_stats.max_jitter_us, loop_stats.missed);
+
+            loop_profile_stats_t busy;
+            loop_profile_get_window(PROFILE_LOOP, &busy);
+
+            DLOG(LOOP_BUSY, busy.mean_us, busy.p99_us, busy.max_us, slowest_stage());
+
+            imu_fifo_stats_t imu_stats;
+            imu_fifo_get_stats(&imu_stats);
+            imu_fifo_reset_stats();
+
+            DLOG(IMU_STATS, imu_stats.samples, imu_stats.batches, imu_stats.max_batch, imu_stats.fifo_overflows, imu_stats.queue_dropped, imu_stats.int_timeouts, imu_stats.read_errors);
+        }
 
         // update ut
         flight_logic.state.ut = (uint32_t)(esp_timer_get_time() / 1000ULL);
@@ -224,9 +371,40 @@ static void avionics_task(void *arg) {
             i2c_ok = false;
         }
 
-        // MPU6050: read data
-        if (mpu6050_get_motion(&mpu_dev, &flight_logic.state.accel, &flight_logic.state.ang_vel) != ESP_OK) {
-            ESP_LOGW(TAG, "MPU6050: read failed");
+        loop_profile_mark(PROFILE_BMP280);
+
+        // MPU6050: the FIFO samples since the last iteration, their raw mean feeds the flight logic
+        uint32_t imu_count = 0;
+        int32_t accel_sum[3] = { 0 };
+        int32_t gyro_sum[3] = { 0 };
+
+        while (imu_count < IMU_BATCH_MAX && imu_fifo_receive(&imu_batch[imu_count])) {
+            const mpu6050_raw_motion_t *motion = &imu_batch[imu_count].motion;
+
+            accel_sum[0] += motion->accel.x;
+            accel_sum[1] += motion->accel.y;
+            accel_sum[2] += motion->accel.z;
+
+            gyro_sum[0] += motion->gyro.x;
+            gyro_sum[1] += motion->gyro.y;
+            gyro_sum[2] += motion->gyro.z;
+
+            imu_count++;
+        }
+
+        if (imu_count > 0) {
+            // the mean of int16 samples fits an int16, only it is converted to float
+            imu_mean.accel.x = (int16_t)(accel_sum[0] / (int32_t)imu_count);
+            imu_mean.accel.y = (int16_t)(accel_sum[1] / (int32_t)imu_count);
+            imu_mean.accel.z = (int16_t)(accel_sum[2] / (int32_t)imu_count);
+
+            imu_mean.gyro.x = (int16_t)(gyro_sum[0] / (int32_t)imu_count);
+            imu_mean.gyro.y = (int16_t)(gyro_sum[1] / (int32_t)imu_count);
+            imu_mean.gyro.z = (int16_t)(gyro_sum[2] / (int32_t)imu_count);
+
+            mpu6050_convert_motion(&mpu_dev, &imu_mean, &flight_logic.state.accel, &flight_logic.state.ang_vel);
+        } else {
+            ESP_LOGW(TAG, "MPU6050: no samples");
 
             flight_logic.state.accel.x = NAN;
             flight_logic.state.accel.y = NAN;
@@ -250,6 +428,9 @@ static void avionics_task(void *arg) {
             vTaskDelay(pdMS_TO_TICKS(50));
         }
 
+        // bus recovery included
+        loop_profile_mark(PROFILE_MPU6050);
+
         // GPS: read data
         gps_read(&gps_dev, &flight_logic.state.lat_nmea, &flight_logic.state.lon_nmea, &flight_logic.state.satellites, &utc_time, &utc_date);
 
@@ -258,6 +439,8 @@ static void avionics_task(void *arg) {
             flash_log_set_gps_data(utc_time, utc_date, flight_logic.state.lat_nmea, flight_logic.state.lon_nmea);
         }
 
+        loop_profile_mark(PROFILE_GPS);
+
         // BAT: read voltage
         if (battery_counter++ >= BAT_SAMPLING) {
             battery_counter = 0;
@@ -266,6 +449,8 @@ static void avionics_task(void *arg) {
             battery_voltage = (0.9f * battery_voltage) + (0.1f * current_vbat);
         }
 
+        loop_profile_mark(PROFILE_BATTERY);
+
         // consume telecommand
         {
             if (xQueueReceive(telecommand_queue, &tc_payload, 0) == pdTRUE) {
@@ -298,6 +483,8 @@ static void avionics_task(void *arg) {
             }
         }
 
+        loop_profile_mark(PROFILE_TELECOMMAND);
+
         // update flight logic
         flight_logic_update(&flight_logic);
 
@@ -305,21 +492,26 @@ static void avionics_task(void *arg) {
         gpio_set_level(PARACHUTE_PIN, flight_logic.trigger_parachute);
 
         if (flight_logic.trigger_shutdown) {
+            store_loop_profile();
             flash_log_finish_flight(flight_logic.state.ut - flight_logic.ut_0);
         }
 
-        // log values
-        ESP_LOGI(TAG, "phase: %d, v_bat: %.2f, altitude: %.6f, pressure: %.2f, |accel|: %.2f, sats: %d, lat: %d, lon: %d", flight_logic.state.phase, battery_voltage, flight_logic.altitude_baro, flight_logic.state.pressure, sqrtf(flight_logic.state.accel.x*flight_logic.state.accel.x + flight_logic.state.accel.y*flight_logic.state.accel.y + flight_logic.state.accel.z*flight_logic.state.accel.z), flight_logic.state.satellites, flight_logic.state.lat_nmea, flight_logic.state.lon_nmea);
+        loop_profile_mark(PROFILE_FLIGHT_LOGIC);
+
+        // log values: raw words only, dlog formats them on PRO_CPU
+        DLOG(AVIONICS_STATE, flight_logic.state.phase, battery_voltage, flight_logic.altitude_baro, flight_logic.state.pressure, sqrtf(flight_logic.state.accel.x*flight_logic.state.accel.x + flight_logic.state.accel.y*flight_logic.state.accel.y + flight_logic.state.accel.z*flight_logic.state.accel.z), flight_logic.state.satellites, flight_logic.state.lat_nmea, flight_logic.state.lon_nmea);
         // ESP_LOGI(TAG, "ut: %lu, gps_date: %lu, gps_time: %lu, satellites: %d", flight_logic.state.ut, utc_date, utc_time, flight_logic.state.satellites);
 
+        loop_profile_mark(PROFILE_LOG);
+
         // send data to telemetry
         {
             if (lora_counter++ >= LORA_SAMPLING) {
                 lora_counter = 0;
 
                 tm_payload.ut = flight_logic.state.ut;
-                tm_payload.accel_mag = sqrtf(flight_logic.state.accel.x*flight_logic.state.accel.x + flight_logic.state.accel.y*flight_logic.state.accel.y + flight_logic.state.accel.z*flight_logic.state.accel.z);
-                tm_payload.ang_vel_mag = sqrtf(flight_logic.state.ang_vel.x*flight_logic.state.ang_vel.x + flight_logic.state.ang_vel.y*flight_logic.state.ang_vel.y + flight_logic.state.ang_vel.z*flight_logic.state.ang_vel.z);
+                tm_payload.accel_mag = to_fixed_u16(sqrtf(flight_logic.state.accel.x*flight_logic.state.accel.x + flight_logic.state.accel.y*flight_logic.state.accel.y + flight_logic.state.accel.z*flight_logic.state.accel.z), TMTC_SCALE_ACCEL_MAG);
+                tm_payload.ang_vel_mag = to_fixed_u16(sqrtf(flight_logic.state.ang_vel.x*flight_logic.state.ang_vel.x + flight_logic.state.ang_vel.y*flight_logic.state.ang_vel.y + flight_logic.state.ang_vel.z*flight_logic.state.ang_vel.z), TMTC_SCALE_ANG_VEL_MAG);
                 tm_payload.pressure = flight_logic.state.pressure;
                 tm_payload.temperature = flight_logic.state.temperature;
                 tm_payload.altitude = flight_logic.altitude_baro;
@@ -329,44 +521,111 @@ static void avionics_task(void *arg) {
                 tm_payload.v_bat = battery_voltage;
                 tm_payload.phase = (uint8_t) flight_logic.state.phase;
 
+                loop_profile_stats_t busy;
+                loop_profile_get_window(PROFILE_LOOP, &busy);
+
+                uint32_t load = busy.p99_us * AVIONICS_RATE_HZ / 10000; // percent of the period
+                tm_payload.loop_load = load < 0xFF ? load : 0xFF;
+                tm_payload.loop_slowest = slowest_stage();
+
                 xQueueOverwrite(lora_queue, &tm_payload);
             }
 
-            // send data to flash
-            if (flight_logic.state.phase >= PHASE_PRE_FLIGHT) {
-                if (flash_counter++ >= FLASH_SAMPLING) {
-                    flash_counter = 0;
-
-                    flash_payload.ut = flight_logic.state.ut;
-                    flash_payload.accel = flight_logic.state.accel;
-                    flash_payload.ang_vel = flight_logic.state.ang_vel;
-                    flash_payload.pressure = flight_logic.state.pressure;
-                    flash_payload.temperature = flight_logic.state.temperature;
-                    flash_payload.lat_nmea = flight_logic.state.lat_nmea;
-                    flash_payload.lon_nmea = flight_logic.state.lon_nmea;
-                    flash_payload.satellites = flight_logic.state.satellites;
-                    flash_payload.v_bat = battery_voltage;
-                    flash_payload.phase = (uint8_t) flight_logic.state.phase;
-
-                    if (xQueueSend(flash_queue, &flash_payload, 0) != pdTRUE) {
-                        flash_payload_t discarded;
-                        xQueueReceive(flash_queue, &discarded, 0);
-                        xQueueSend(flash_queue, &flash_payload, 0);
-                        ESP_LOGW(TAG, "discard old flash sample: flash queue is full!");
+            // send data to flash: on the pad every IMU sample goes to the RAM history only,
+            // flash_task writes it ahead of the first live sample
+            if (flight_logic.state.phase == PHASE_PRE_FLIGHT) {
+                fill_flash_payload(&flash_payload, battery_voltage);
+
+                for (uint32_t i = 0; i < imu_count; i++) {
+                    flash_payload.ut = (uint32_t)(imu_batch[i].ut_us / 1000ULL);
+                    fill_flash_motion(&flash_payload, &imu_batch[i].motion);
+
+                    flash_log_history_push(&flash_payload);
+                }
+            } else if (flight_logic.state.phase > PHASE_PRE_FLIGHT) {
+                // the rate policy of the phase, recorded in the flight header
+                uint16_t interval = flash_log_phase_interval(flight_logic.state.phase);
+
+                if (interval == 0) {
+                    // full rate: every IMU sample at its own time, with the latest of the slower sensors
+                    fill_flash_payload(&flash_payload, battery_voltage);
+
+                    for (uint32_t i = 0; i < imu_count; i++) {
+                        flash_payload.ut = (uint32_t)(imu_batch[i].ut_us / 1000ULL);
+                        fill_flash_motion(&flash_payload, &imu_batch[i].motion);
+
+                        queue_flash_payload(&flash_payload);
                     }
+
+                    last_flash_ut = flight_logic.state.ut;
+                } else if (flight_logic.state.ut - last_flash_ut >= interval) {
+                    last_flash_ut = flight_logic.state.ut;
+
+                    fill_flash_payload(&flash_payload, battery_voltage);
+                    queue_flash_payload(&flash_payload);
                 }
             }
         }
+
+        loop_profile_mark(PROFILE_OUTPUT);
+        loop_profile_end();
     }
     vTaskDelete(NULL);
 }
 
+static void report_flash_stats(flash_log_stats_t *last_stats, uint32_t *last_dropped, TickType_t elapsed) {
+    flash_log_stats_t stats;
+    flash_log_get_stats(&stats);
+
+    uint32_t dropped = flash_dropped;
+    uint32_t elapsed_ms = pdTICKS_TO_MS(elapsed);
+
+    if (stats.samples != last_stats->samples && elapsed_ms > 0) {
+        ESP_LOGI(TAG, "flash: %" PRIu32 " samples/s, %" PRIu32 " B/s, queue high water %" PRIu32 "/%d, dropped %" PRIu32 ", overruns %" PRIu32,
+            (stats.samples - last_stats->samples) * 1000 / elapsed_ms,
+            (stats.bytes - last_stats->bytes) * 1000 / elapsed_ms,
+            flash_queue_high_water, FLASH_QUEUE_SIZE,
+            dropped, stats.overrun_pages);
+    }
+
+    if (dropped != *last_dropped) {
+        ESP_LOGW(TAG, "flash: %" PRIu32 " samples dropped, flash task is falling behind", dropped - *last_dropped);
+    }
+
+    w25q64_suspend_stats_t suspend;
+    w25q64_get_suspend_stats(&suspend);
+
+    if (suspend.suspends > 0 || suspend.blocked > 0) {
+        ESP_LOGI(TAG, "flash: %" PRIu32 " erase suspends (max %" PRIu32 " us), %" PRIu32 " ops blocked by an erase",
+            suspend.suspends, suspend.max_suspend_us, suspend.blocked);
+    }
+
+    *last_stats = stats;
+    *last_dropped = dropped;
+}
+
 static void flash_task(void *arg) {
     flash_payload_t payload;
+    flash_log_stats_t last_stats = { 0 };
+    uint32_t last_dropped = 0;
+    TickType_t last_report = xTaskGetTickCount();
 
     while (1) {
-        if (xQueueReceive(flash_queue, &payload, portMAX_DELAY)) {
+        if (xQueueReceive(flash_queue, &payload, FLASH_IDLE_TIMEOUT)) {
+            // no-op once the pre-trigger history is in
+            flash_log_history_flush();
             flash_log_append(&payload);
+
+            // keep the window topped up at rate too, one sector at a time while the queue can absorb the erase
+            if (uxQueueMessagesWaiting(flash_queue) <= FLASH_ERASE_QUEUE_MAX) flash_log_erase_ahead();
+        } else {
+            flash_log_erase_ahead();
+        }
+
+        TickType_t now = xTaskGetTickCount();
+        if (now - last_report >= FLASH_STATS_INTERVAL) {
+            report_flash_stats(&last_stats, &last_dropped, now - last_report);
+            last_report = now;
         }
     }
 
@@ -433,6 +692,199 @@ static void lora_task(void *arg) {
 }
 
 
+static bool send_flight_packet(const flash_packet_t *packet, uint32_t packet_addr, void *ctx) {
+    // blocks while the tx buffer is full: the line rate paces the packets
+    uart_write_bytes(UART_PORT_USB, (uint8_t *)packet, sizeof(flash_packet_t));
+
+    return true;
+}
+
+// go-back-N sender: chunks stay buffered until the host acknowledges them
+typedef struct {
+    uint8_t data[FLASH_BULK_WINDOW][FLASH_BULK_CHUNK_SIZE];
+    uint16_t size[FLASH_BULK_WINDOW];
+    uint32_t base; // oldest unacknowledged seq
+    uint32_t next; // seq of the chunk being filled
+    uint32_t fill;
+    uint32_t retries;
+    bool resent; // base already retransmitted on a duplicate ack
+    bool failed;
+} bulk_state_t;
+
+static bulk_state_t bulk;
+
+// compressed downloads: codec state and cost of the current transfer
+static struct {
+    flash_codec_state_t codec;
+    uint32_t raw_bytes;
+    uint32_t wire_bytes;
+    int64_t encode_us;
+} bulk_compress;
+
+static bool read_usb_command(uint32_t *id, int32_t *param, TickType_t timeout) {
+    TickType_t start = xTaskGetTickCount();
+    uint32_t magic = 0;
+    uint8_t byte;
+
+    while (1) {
+        TickType_t wait = portMAX_DELAY;
+
+        if (timeout != portMAX_DELAY) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= timeout) return false;
+            wait = timeout - elapsed;
+        }
+
+        if (uart_read_bytes(UART_PORT_USB, &byte, sizeof(byte), wait) <= 0) return false;
+
+        magic = (magic >> 8) | ((uint32_t)byte << 24); // little-endian
+        if (magic != FLASH_USB_MAGIC) continue;
+
+        if (uart_read_bytes(UART_PORT_USB, id, sizeof(*id), USB_RX_TIMEOUT) != sizeof(*id)) return false;
+        if (uart_read_bytes(UART_PORT_USB, param, sizeof(*param), USB_RX_TIMEOUT) != sizeof(*param)) return false;
+
+        return true;
+    }
+}
+
+static void bulk_send_chunk(uint32_t seq) {
+    uint32_t slot = seq % FLASH_BULK_WINDOW;
+
+    flash_bulk_frame_t frame = {
+        .magic = FLASH_BULK_MAGIC,
+        .seq = seq,
+        .size = bulk.size[slot],
+        .crc = crc16(bulk.data[slot], bulk.size[slot]),
+    };
+
+    uart_write_bytes(UART_PORT_USB, &frame, sizeof(frame));
+    if (frame.size > 0) uart_write_bytes(UART_PORT_USB, bulk.data[slot], frame.size);
+}
+
+static void bulk_resend(void) {
+    for (uint32_t seq = bulk.base; seq != bulk.next; seq++) bulk_send_chunk(seq);
+}
+
+// blocks until at most max_pending chunks are unacknowledged
+static void bulk_wait(uint32_t max_pending) {
+    uint32_t id;
+    int32_t param;
+
+    while (!bulk.failed && bulk.next - bulk.base > max_pending) {
+        if (!read_usb_command(&id, &param, BULK_ACK_TIMEOUT)) {
+            if (++bulk.retries > BULK_MAX_RETRIES) {
+                bulk.failed = true;
+                break;
+            }
+
+            bulk_resend();
+            continue;
+        }
+
+        if (id != CMD_BULK_ACK) continue;
+
+        // cumulative: param is the next seq the host expects
+        uint32_t ack = (uint32_t)param;
+
+        if (ack - bulk.base - 1 < bulk.next - bulk.base) {
+            bulk.base = ack;
+            bulk.retries = 0;
+            bulk.resent = false;
+        } else if (ack == bulk.base && !bulk.resent) {
+            // the host skipped a chunk: go back once, later duplicates come from the same gap
+            bulk.resent = true;
+            bulk_resend();
+        }
+    }
+}
+
+static void bulk_close_chunk(void) {
+    bulk.size[bulk.next % FLASH_BULK_WINDOW] = bulk.fill;
+    bulk_send_chunk(bulk.next);
+
+    bulk.next++;
+    bulk.fill = 0;
+}
+
+static void bulk_next_chunk(void) {
+    bulk_close_chunk();
+    bulk_wait(FLASH_BULK_WINDOW - 1);
+}
+
+static bool bulk_push(const uint8_t *data, size_t len) {
+    while (len > 0 && !bulk.failed) {
+        size_t n = FLASH_BULK_CHUNK_SIZE - bulk.fill;
+        if (n > len) n = len;
+
+        memcpy(bulk.data[bulk.next % FLASH_BULK_WINDOW] + bulk.fill, data, n);
+        bulk.fill += n;
+        data += n;
+        len -= n;
+
+        if (bulk.fill == FLASH_BULK_CHUNK_SIZE) bulk_next_chunk();
+    }
+
+    return !bulk.failed;
+}
+
+static void bulk_begin(void) {
+    memset(&bulk, 0, sizeof(bulk));
+    uart_flush_input(UART_PORT_USB);
+}
+
+static esp_err_t bulk_end(void) {
+    if (bulk.fill > 0) bulk_next_chunk();
+
+    // empty chunk: end of transfer
+    bulk_close_chunk();
+    bulk_wait(0);
+
+    return bulk.failed ? ESP_FAIL : ESP_OK;
+}
+
+static bool send_bulk_packet(const flash_packet_t *packet, uint32_t packet_addr, void *ctx) {
+    return bulk_push((const uint8_t *)packet, sizeof(flash_packet_t));
+}
+
+static bool send_bulk_compressed(const flash_packet_t *packet, uint32_t packet_addr, void *ctx) {
+    uint8_t sample[FLASH_CODEC_MAX_SAMPLE_SIZE];
+
+    int64_t start = esp_timer_get_time();
+
+    // every chunk starts with a key frame, so a retransmitted chunk decodes on its own
+    if (bulk.fill == 0) flash_codec_reset(&bulk_compress.codec);
+    size_t sample_size = flash_codec_encode(&bulk_compress.codec, &packet->payload, sample);
+
+    if (bulk.fill + sample_size > FLASH_BULK_CHUNK_SIZE) {
+        bulk_compress.encode_us += esp_timer_get_time() - start;
+        bulk_next_chunk();
+        start = esp_timer_get_time();
+
+        flash_codec_reset(&bulk_compress.codec);
+        sample_size = flash_codec_encode(&bulk_compress.codec, &packet->payload, sample);
+    }
+
+    bulk_compress.encode_us += esp_timer_get_time() - start;
+    bulk_compress.raw_bytes += sizeof(flash_packet_t);
+    bulk_compress.wire_bytes += sample_size;
+
+    return bulk_push(sample, sample_size);
+}
+
+static bool send_bulk_range(uint32_t addr, const uint8_t *data, size_t size, void *ctx) {
+    return bulk_push(data, size);
+}
+
+static void send_progress(uint32_t done, uint32_t total, void *ctx) {
+    flash_progress_t frame = {
+        .magic = FLASH_PROGRESS_MAGIC,
+        .done = done,
+        .total = total,
+    };
+
+    uart_write_bytes(UART_PORT_USB, &frame, sizeof(frame));
+}
+
 static void flash_interface_task(void *arg) {
     // init usb uart
     {
@@ -447,7 +899,7 @@ static void flash_interface_task(void *arg) {
 
         esp_err_t err = ESP_OK;
 
-        err |= uart_driver_install(UART_PORT_USB, 256, 256, 0, NULL, 0);
+        err |= uart_driver_install(UART_PORT_USB, 256, USB_TX_BUFFER_SIZE, 0, NULL, 0);
         err |= uart_param_config(UART_PORT_USB, &uart_config);
 
         err |= uart_set_pin(UART_PORT_USB, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
@@ -462,89 +914,192 @@ static void flash_interface_task(void *arg) {
         );
     }
 
-    uint8_t rx_byte;
-    uint32_t rx_magic = 0;
     uint32_t rx_id;
     int32_t rx_param;
 
+    // a new baud rate stays only once the host talks at it
+    bool baud_pending = false;
+    TickType_t baud_changed = 0;
+
     while (1) {
         // read usb uart port
-        if (uart_read_bytes(UART_PORT_USB, &rx_byte, sizeof(rx_byte), portMAX_DELAY) > 0) {
-            // receive usb bytes
-            rx_magic = (rx_magic >> 8) | ((uint32_t)rx_byte << 24); // little-endian
-
-            if (rx_magic == FLASH_USB_MAGIC) {
-                if (uart_read_bytes(UART_PORT_USB, &rx_id, sizeof(rx_id), pdMS_TO_TICKS(200)) == sizeof(rx_id)) {
-                    if (uart_read_bytes(UART_PORT_USB, &rx_param, sizeof(rx_param), pdMS_TO_TICKS(200)) == sizeof(rx_param)) {
-                        flash_header_t* headers;
-                        uint32_t headers_len;
-
-                        flash_header_t header;
-
-                        uint32_t header_addr;
-                        flash_packet_t packet;
-
-                        switch (rx_id) {
-                            case CMD_ACK:
-                                // send ack
-                                uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
-                                break;
-                            case CMD_CLEAR_FLIGHTS:
-                                if (flash_log_clear_flights() == ESP_OK) {
-                                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
-                                } else {
-                                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
-                                }
-                                break;
-                            case CMD_LIST_HEADERS:
-                                headers = flash_log_get_headers(&headers_len);
-
-                                if (headers_len != 0) {
-                                    // transmit headers
-                                    uart_write_bytes(UART_PORT_USB, (uint8_t *)headers, headers_len*sizeof(flash_header_t));
-                                }
-
-                                uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
-
-                                free(headers);
-                                break;
-                            case CMD_READ_HEADER: // flight_number = rx_param
-                                if (flash_log_get_header(rx_param, &header, NULL) == ESP_OK) {
-                                    uart_write_bytes(UART_PORT_USB, (uint8_t *)&header, sizeof(flash_header_t));
-                                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
-                                } else {
-                                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
-                                }
-
-                                break;
-                            case CMD_READ_FLIGHT: // flight_number = rx_param
-                                if (flash_log_get_header(rx_param, &header, &header_addr) == ESP_OK) {
-                                    for (uint32_t addr=header_addr+header.header_size; addr<header.next_header_addr; addr+=header.packet_size) {
-                                        if (flash_log_get_flight_packet(addr, header.packet_size, &packet) != ESP_OK) {
-                                            uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
-                                            break;
-                                        }
-
-                                        uart_write_bytes(UART_PORT_USB, (uint8_t *)&packet, header.packet_size);
-                                        vTaskDelay(pdMS_TO_TICKS(30));
-                                    }
-                                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
-                                } else {
-                                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
-                                }
-                                break;
-                            default:
-                                uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
-                                break;
-                        }
+        if (!read_usb_command(&rx_id, &rx_param, baud_pending ? USB_POLL_INTERVAL : portMAX_DELAY)) {
+            if (baud_pending && xTaskGetTickCount() - baud_changed >= USB_BAUD_CONFIRM_TIMEOUT) {
+                ESP_LOGW(TAG, "Baud rate not confirmed, back to %d", USB_BAUD_RATE);
 
-                    }
-                }
-                rx_magic = 0;
+                uart_set_baudrate(UART_PORT_USB, USB_BAUD_RATE);
+                uart_flush_input(UART_PORT_USB);
+                baud_pending = false;
             }
+            continue;
         }
 
-        vTaskDelay(pdMS_TO_TICKS(50));
+        baud_pending = false;
+
+        flash_header_t* headers;
+        uint32_t headers_len;
+
+        flash_header_t header;
+
+        uint32_t header_addr;
+
+        flash_range_t range;
+        flash_flight_range_t flight_range;
+        uint32_t flight_size, log_start, log_end;
+
+        switch (rx_id) {
+            case CMD_ACK:
+                // send ack
+                uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                break;
+            case CMD_CLEAR_FLIGHTS:
+                if (flash_log_clear_flights(send_progress, NULL) == ESP_OK) {
+                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+                break;
+            case CMD_LIST_HEADERS:
+                headers = flash_log_get_headers(&headers_len);
+
+                if (headers_len != 0) {
+                    // transmit headers
+                    uart_write_bytes(UART_PORT_USB, (uint8_t *)headers, headers_len*sizeof(flash_header_t));
+                }
+
+                uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+
+                free(headers);
+                break;
+            case CMD_READ_HEADER: // flight_number = rx_param
+                if (flash_log_get_header(rx_param, &header, NULL) == ESP_OK) {
+                    uart_write_bytes(UART_PORT_USB, (uint8_t *)&header, sizeof(flash_header_t));
+                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+
+                break;
+            case CMD_READ_FLIGHT: // flight_number = rx_param
+                if (flash_log_get_header(rx_param, &header, &header_addr) == ESP_OK) {
+                    if (flash_log_for_each_packet(&header, header_addr, send_flight_packet, &header) != ESP_OK) {
+                        uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                    } else {
+                        uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                    }
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+                break;
+            case CMD_SET_BAUD: // baud = rx_param
+                if (rx_param < USB_BAUD_RATE || rx_param > FLASH_USB_MAX_BAUD) {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                    break;
+                }
+
+                // acknowledge at the old rate, then switch once it is out
+                uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                uart_wait_tx_done(UART_PORT_USB, USB_RX_TIMEOUT);
+
+                if (uart_set_baudrate(UART_PORT_USB, rx_param) == ESP_OK) {
+                    uart_flush_input(UART_PORT_USB);
+                    baud_pending = true;
+                    baud_changed = xTaskGetTickCount();
+                }
+                break;
+            case CMD_BULK_READ_FLIGHT: // flight_number = rx_param
+                if (flash_log_get_header(rx_param, &header, &header_addr) != ESP_OK) {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                    break;
+                }
+
+                bulk_begin();
+
+                esp_err_t ret = flash_log_for_each_packet(&header, header_addr, send_bulk_packet, &header);
+                if (ret == ESP_OK) ret = bulk_end();
+
+                if (ret == ESP_OK) {
+                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+                break;
+            case CMD_GET_FLIGHT_RANGE: // flight_number = rx_param
+                if (flash_log_get_flight_range(rx_param, &header_addr, &flight_size) == ESP_OK) {
+                    flash_log_get_bounds(&log_start, &log_end);
+
+                    flight_range.header_addr = header_addr;
+                    flight_range.size = flight_size;
+                    flight_range.log_start = log_start;
+                    flight_range.log_end = log_end;
+
+                    uart_write_bytes(UART_PORT_USB, (uint8_t *)&flight_range, sizeof(flight_range));
+                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+                break;
+            case CMD_READ_RANGE:
+                if (uart_read_bytes(UART_PORT_USB, &range, sizeof(range), USB_RX_TIMEOUT) != sizeof(range)) {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                    break;
+                }
+
+                bulk_begin();
+
+                esp_err_t range_ret = flash_log_read_range(range.addr, range.size, send_bulk_range, NULL);
+                if (range_ret == ESP_OK) range_ret = bulk_end();
+
+                if (range_ret == ESP_OK) {
+                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+                break;
+            case CMD_BULK_READ_FLIGHT_COMPRESSED: // flight_number = rx_param
+                if (flash_log_get_header(rx_param, &header, &header_addr) != ESP_OK) {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                    break;
+                }
+
+                bulk_begin();
+                memset(&bulk_compress, 0, sizeof(bulk_compress));
+
+                esp_err_t compress_ret = flash_log_for_each_packet(&header, header_addr, send_bulk_compressed, &header);
+                if (compress_ret == ESP_OK) compress_ret = bulk_end();
+
+                if (compress_ret == ESP_OK) {
+                    // the console shares the port: the cost goes to the host in a frame, not the log
+                    flash_bulk_stats_t stats = {
+                        .magic = FLASH_BULK_STATS_MAGIC,
+                        .raw_bytes = bulk_compress.raw_bytes,
+                        .wire_bytes = bulk_compress.wire_bytes,
+                        .encode_us = (uint32_t)bulk_compress.encode_us,
+                        .chunks = bulk.next,
+                    };
+
+                    uart_write_bytes(UART_PORT_USB, &stats, sizeof(stats));
+                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+                break;
+            case CMD_DUMP_CHIP:
+                bulk_begin();
+
+                esp_err_t dump_ret = flash_log_read_range(0, w25q64_get_geometry()->capacity, send_bulk_range, NULL);
+                if (dump_ret == ESP_OK) dump_ret = bulk_end();
+
+                if (dump_ret == ESP_OK) {
+                    uart_write_bytes(UART_PORT_USB, &flash_ack, sizeof(flash_ack));
+                } else {
+                    uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                }
+                break;
+            default:
+                uart_write_bytes(UART_PORT_USB, &flash_nack, sizeof(flash_nack));
+                break;
+        }
     }
 
     vTaskDelete(NULL);
@@ -780,11 +1335,27 @@ void app_main(void) {
             ABORT_MPU6050_INIT,
             "MPU6050 failed to set accel range"
         );
+        // 184 Hz bandwidth: the FIFO samples at 1 kHz, no longer aliased by a slow poll
         AVIONICS_ERROR_CHECK(
-            mpu6050_set_dlpf_mode(&mpu_dev, MPU6050_DLPF_3),
+            mpu6050_set_dlpf_mode(&mpu_dev, MPU6050_DLPF_1),
             ABORT_MPU6050_INIT,
             "MPU6050 failed to set DLPF mode"
         );
+
+        // flash logs raw counts, the header records what they are worth
+        float accel_res, gyro_res;
+        AVIONICS_ERROR_CHECK(
+            mpu6050_get_motion_resolution(&mpu_dev, &accel_res, &gyro_res),
+            ABORT_MPU6050_INIT,
+            "MPU6050 failed to get resolution"
+        );
+        flash_log_set_imu_scale(accel_res, gyro_res);
+
+        AVIONICS_ERROR_CHECK(
+            imu_fifo_start(&mpu_dev, MPU_INT_PIN, IMU_RATE_HZ, 0), // PRO_CPU
+            ABORT_MPU6050_INIT,
+            "MPU6050 FIFO failed to start"
+        );
         ESP_LOGI(TAG, "MPU6050 initialized");
         vTaskDelay(pdMS_TO_TICKS(100));
     }
@@ -829,9 +1400,18 @@ void app_main(void) {
         ESP_LOGI(TAG, "GPS initialized");
     }
 
+    // deferred logging, off the avionics core
+    {
+        AVIONICS_ERROR_CHECK(
+            dlog_init(UART_PORT_USB, 0),
+            ABORT_DLOG_INIT,
+            "Deferred logging failed to init"
+        );
+    }
+
     // create xQueue
     {
-        flash_queue = xQueueCreate(32, sizeof(flash_payload_t));
+        flash_queue = xQueueCreate(FLASH_QUEUE_SIZE, sizeof(flash_payload_t));
         lora_queue = xQueueCreate(1, sizeof(lora_payload_t)); // mailbox
         telecommand_queue = xQueueCreate(8, sizeof(telecommand_payload_t));
     }
@@ -0,0 +1,311 @@
+// boot-time recovery of an unfinished flight on a flash image: the page binary search of solve_corrupted_log()
+// against the linear scans it replaced, on the fake chip through the real w25q64 driver
+//
+//   bench_flash_recovery              synthetic flights, fails if the methods disagree or a damaged flight ends wrong
+//   bench_flash_recovery image.bin    every unfinished flight of a chip dump
+
+// the statics under test
+#include "flash_log.c"
+
+#include "fake_spi_flash.h"
+
+#include "esp_timer.h"
+
+#include <stdio.h>
+
+// the v5 packet: float accel and ang_vel
+#define LEGACY_PACKET_SIZE (sizeof(flash_packet_t) + 12)
+
+typedef esp_err_t (*recovery_t)(flash_header_t *header, uint32_t header_addr);
+
+// the first recovery: one w25q64_read_data() per packet
+static esp_err_t solve_packet_reads(flash_header_t *header, uint32_t header_addr) {
+    uint8_t packet[FLASH_PAGE_SIZE];
+    uint32_t packet_addr = flash_log_first_packet_addr(header, header_addr);
+
+    while (ring_distance(header_addr, packet_addr) + header->packet_size < log_end - log_start) {
+        if (w25q64_read_data(packet_addr, packet, header->packet_size) != ESP_OK) return ESP_FAIL;
+
+        if (packet_is_empty(packet, header->packet_size)) {
+            if (header->format_version >= FLASH_PAGE_ALIGNED_VERSION) packet_addr = page_align(packet_addr);
+
+            header->next_header_addr = packet_addr;
+            return w25q64_write_data(header_addr + offsetof(flash_header_t, next_header_addr), (uint8_t *)&packet_addr, sizeof(packet_addr));
+        }
+
+        packet_addr = flash_log_next_packet_addr(header, packet_addr);
+    }
+
+    return ESP_FAIL;
+}
+
+// the same scan over streamed read windows, before the binary search
+static esp_err_t solve_window_scan(flash_header_t *header, uint32_t header_addr) {
+    uint32_t packet_addr = flash_log_first_packet_addr(header, header_addr);
+
+    window_reset();
+
+    while (ring_distance(header_addr, packet_addr) + header->packet_size < log_end - log_start) {
+        const uint8_t *packet = window_read(packet_addr, header->packet_size);
+        if (packet == NULL) return ESP_FAIL;
+
+        if (packet_is_empty(packet, header->packet_size)) {
+            if (header->format_version >= FLASH_PAGE_ALIGNED_VERSION) packet_addr = page_align(packet_addr);
+
+            header->next_header_addr = packet_addr;
+            return w25q64_write_data(header_addr + offsetof(flash_header_t, next_header_addr), (uint8_t *)&packet_addr, sizeof(packet_addr));
+        }
+
+        packet_addr = flash_log_next_packet_addr(header, packet_addr);
+    }
+
+    return ESP_FAIL;
+}
+
+static const struct {
+    const char *name;
+    recovery_t solve;
+} methods[] = {
+    { "packet reads", solve_packet_reads },
+    { "window scan", solve_window_scan },
+    { "binary search", solve_corrupted_log },
+};
+
+#define METHODS (sizeof(methods) / sizeof(methods[0]))
+
+// runs every method on the flight at header_addr, false if one fails or they disagree
+static bool bench_flight(uint32_t header_addr, uint32_t expected_end) {
+    uint8_t *memory = fake_flash_memory();
+    uint8_t pristine[FLASH_PAGE_SIZE];
+    uint32_t ends[METHODS];
+    bool ok = true;
+
+    memcpy(pristine, memory + header_addr, sizeof(pristine));
+
+    // every method ends with the same header program: its status polling would hide the scans
+    fake_flash_set_timing(0, 45000);
+
+    for (uint32_t m = 0; m < METHODS; m++) {
+        flash_header_t header;
+        fake_spi_stats_t stats;
+
+        // the previous method programmed next_header_addr
+        memcpy(memory + header_addr, pristine, sizeof(pristine));
+        memcpy(&header, pristine, sizeof(header));
+
+        fake_flash_reset_stats();
+        int64_t start = esp_timer_get_time();
+
+        esp_err_t ret = methods[m].solve(&header, header_addr);
+
+        int64_t host_us = esp_timer_get_time() - start;
+        fake_flash_get_stats(&stats);
+
+        ends[m] = ret == ESP_OK ? header.next_header_addr : 0xFFFFFFFF;
+        if (ret != ESP_OK || ends[m] != ends[0] || (expected_end != 0xFFFFFFFF && ends[m] != expected_end)) ok = false;
+
+        printf("  %-14s %9" PRIu32 " transactions %10" PRIu64 " bytes %10.2f ms bus %9.2f ms host  end 0x%06" PRIX32 "%s\n",
+            methods[m].name, stats.transactions, stats.bytes, stats.bus_us / 1000.0, host_us / 1000.0,
+            ends[m], ret == ESP_OK ? "" : " (failed)");
+    }
+
+    memcpy(memory + header_addr, pristine, sizeof(pristine));
+    return ok;
+}
+
+static void put_header(uint32_t header_addr, uint8_t version, uint32_t flight_number) {
+    flash_header_t header;
+    memset(&header, 0xFF, sizeof(header));
+
+    header.magic = FLASH_HEADER_MAGIC;
+    header.header_size = version >= FLASH_RAW_IMU_VERSION ? sizeof(flash_header_t) : offsetof(flash_header_t, page_programs);
+    header.packet_size = version >= FLASH_COMPRESSED_VERSION ? sizeof(flash_packet_t) : LEGACY_PACKET_SIZE;
+    header.format_version = version;
+    header.flight_number = flight_number;
+
+    memcpy(fake_flash_memory() + header_addr, &header, header.header_size);
+}
+
+// pages as the logger leaves them: packets or a block, then the trailer from v7 on
+static void put_page(uint32_t page_addr, uint8_t version, uint32_t flight_number, uint32_t seq) {
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+
+    if (version >= FLASH_COMPRESSED_VERSION) {
+        flash_block_header_t block = { .magic = FLASH_BLOCK_MAGIC, .size = 180, .count = 12, .reserved = 0xFF };
+
+        for (uint32_t i = 0; i < block.size; i++) page[sizeof(block) + i] = (uint8_t)(seq + i * 7);
+
+        block.crc = version >= FLASH_PAGE_TRAILER_VERSION ? 0xFFFF : crc16(page + sizeof(block), block.size);
+        memcpy(page, &block, sizeof(block));
+    } else {
+        uint32_t magic = FLASH_PACKET_MAGIC;
+
+        for (uint32_t offset = 0; offset + LEGACY_PACKET_SIZE <= FLASH_PAGE_SIZE; offset += LEGACY_PACKET_SIZE) {
+            memset(page + offset, (uint8_t)seq, LEGACY_PACKET_SIZE);
+            memcpy(page + offset, &magic, sizeof(magic));
+        }
+    }
+
+    if (version >= FLASH_PAGE_TRAILER_VERSION) {
+        flash_page_trailer_t trailer = { .seq = seq, .flight = (uint16_t)flight_number };
+        memcpy(page + FLASH_PAGE_DATA_SIZE, &trailer, sizeof(trailer));
+
+        trailer.crc = crc16(page, FLASH_PAGE_SIZE - sizeof(trailer.crc));
+        memcpy(page + FLASH_PAGE_SIZE - sizeof(trailer.crc), &trailer.crc, sizeof(trailer.crc));
+    }
+
+    memcpy(fake_flash_memory() + page_addr, page, sizeof(page));
+}
+
+static bool bench_synthetic(void) {
+    static const struct {
+        uint8_t version;
+        uint32_t pages;
+    } flights[] = {
+        { FLASH_FORMAT_VERSION, 16 },
+        { FLASH_FORMAT_VERSION, 1024 },
+        { FLASH_FORMAT_VERSION, 8192 },
+        { FLASH_FORMAT_VERSION, 30000 }, // most of the chip
+        { FLASH_PAGE_ALIGNED_VERSION, 30000 },
+    };
+
+    // half way through the ring, so long flights wrap around its end
+    const uint32_t header_addr = 0x400000;
+    bool ok = true;
+
+    for (uint32_t f = 0; f < sizeof(flights) / sizeof(flights[0]); f++) {
+        uint32_t flight_number = 40 + f;
+
+        fake_flash_reset();
+        put_header(header_addr, flights[f].version, flight_number);
+
+        for (uint32_t seq = 0; seq < flights[f].pages; seq++) {
+            put_page(ring_wrap(header_addr + (seq + 1) * FLASH_PAGE_SIZE), flights[f].version, flight_number, seq);
+        }
+
+        uint32_t end = ring_wrap(header_addr + (flights[f].pages + 1) * FLASH_PAGE_SIZE);
+
+        printf("v%u flight, %" PRIu32 " pages (%.1f MB), ends at 0x%06" PRIX32 "\n",
+            flights[f].version, flights[f].pages, flights[f].pages * FLASH_PAGE_SIZE / 1048576.0, end);
+
+        if (!bench_flight(header_addr, end)) ok = false;
+    }
+
+    return ok;
+}
+
+static uint32_t flight_page_addr(uint32_t header_addr, uint32_t idx) {
+    return ring_wrap(header_addr + (idx + 1) * FLASH_PAGE_SIZE);
+}
+
+static bool check_recovery(const char *name, uint32_t header_addr, uint32_t expected_end) {
+    flash_header_t header;
+    memcpy(&header, fake_flash_memory() + header_addr, sizeof(header));
+
+    esp_err_t ret = solve_corrupted_log(&header, header_addr);
+    bool ok = ret == ESP_OK && header.next_header_addr == expected_end;
+
+    printf("%-44s end 0x%06" PRIX32 ", expected 0x%06" PRIX32 "%s\n",
+        name, ret == ESP_OK ? header.next_header_addr : 0xFFFFFFFF, expected_end, ok ? "" : " (wrong)");
+
+    return ok;
+}
+
+// damage the linear scans never had to handle, binary search only
+static bool bench_damaged(void) {
+    const uint32_t header_addr = 0x400000;
+    const uint32_t flight_number = 60;
+    const uint32_t ring_pages = (log_end - log_start) / FLASH_PAGE_SIZE;
+    bool ok = true;
+
+    fake_flash_set_timing(0, 45000);
+
+    // pages that failed their program mid-flight, then a blank gap and stale pages of the previous flight
+    fake_flash_reset();
+    put_header(header_addr, FLASH_FORMAT_VERSION, flight_number);
+
+    for (uint32_t seq = 0; seq < 1000; seq++) {
+        put_page(flight_page_addr(header_addr, seq), FLASH_FORMAT_VERSION, flight_number, seq);
+        if (seq % 3 == 0) fake_flash_memory()[flight_page_addr(header_addr, seq) + 20] ^= 0x10;
+    }
+    for (uint32_t idx = 1016; idx < 20000; idx++) {
+        put_page(flight_page_addr(header_addr, idx), FLASH_FORMAT_VERSION, flight_number - 1, idx + 5000);
+    }
+
+    if (!check_recovery("bad trailers, gap, stale pages", header_addr, flight_page_addr(header_addr, 1000))) ok = false;
+
+    // pages of older formats right after the end, no gap
+    fake_flash_reset();
+    put_header(header_addr, FLASH_FORMAT_VERSION, flight_number);
+
+    for (uint32_t seq = 0; seq < 700; seq++) put_page(flight_page_addr(header_addr, seq), FLASH_FORMAT_VERSION, flight_number, seq);
+    for (uint32_t idx = 700; idx < 5000; idx++) put_page(flight_page_addr(header_addr, idx), FLASH_COMPRESSED_VERSION, 58, idx);
+    for (uint32_t idx = 5000; idx < 9000; idx++) put_page(flight_page_addr(header_addr, idx), FLASH_PAGE_ALIGNED_VERSION, 57, idx);
+
+    if (!check_recovery("stale v6 and v5 pages, no gap", header_addr, flight_page_addr(header_addr, 700))) ok = false;
+
+    // the only flight, written around the whole ring back to its own header
+    fake_flash_reset();
+    put_header(header_addr, FLASH_FORMAT_VERSION, flight_number);
+
+    for (uint32_t seq = 0; seq < ring_pages - 1; seq++) put_page(flight_page_addr(header_addr, seq), FLASH_FORMAT_VERSION, flight_number, seq);
+
+    if (!check_recovery("written up to the limit", header_addr, header_addr)) ok = false;
+
+    return ok;
+}
+
+static bool bench_image(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    fake_flash_reset();
+    size_t size = fread(fake_flash_memory(), 1, FAKE_FLASH_CAPACITY, file);
+    fclose(file);
+
+    printf("%s: %zu bytes\n", path, size);
+
+    // the oldest flight bounds the search, as at boot
+    if (flash_dir_load(log_end) != ESP_OK) printf("no flight directory\n");
+
+    bool ok = true;
+    uint32_t found = 0;
+
+    // headers start on a page from FLASH_PAGE_ALIGNED_VERSION on
+    for (uint32_t addr = log_start; addr < log_end; addr += FLASH_PAGE_SIZE) {
+        flash_header_t header;
+        memcpy(&header, fake_flash_memory() + addr, sizeof(header));
+
+        if (header.magic != FLASH_HEADER_MAGIC || header.status == 0x00 || header.next_header_addr != 0xFFFFFFFF) continue;
+        if (header.format_version < FLASH_PAGE_ALIGNED_VERSION || header.format_version > FLASH_FORMAT_VERSION) continue;
+
+        printf("v%u flight %" PRIu32 " at 0x%06" PRIX32 "\n", header.format_version, header.flight_number, addr);
+        if (!bench_flight(addr, 0xFFFFFFFF)) ok = false;
+        found++;
+    }
+
+    if (found == 0) printf("no unfinished flight\n");
+
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    fake_flash_reset();
+
+    if (w25q64_init(19, 22, 21, 23) != ESP_OK) {
+        fprintf(stderr, "w25q64_init failed\n");
+        return 1;
+    }
+
+    log_start = 0;
+    log_end = w25q64_get_geometry()->capacity - FLASH_DIR_SIZE;
+
+    bool ok = argc > 1 ? bench_image(argv[1]) : bench_synthetic() & bench_damaged();
+
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,282 @@
+// FreeRTOS and esp_timer on pthreads, enough to run the drivers' tasks, queues and locks on the host
+
+#define _GNU_SOURCE
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_err.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+struct queue_definition {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    uint8_t *items;
+    UBaseType_t item_size;
+    UBaseType_t length;
+    UBaseType_t head;
+    UBaseType_t count;
+
+    // recursive mutexes only
+    pthread_t holder;
+    UBaseType_t depth;
+};
+
+typedef struct {
+    TaskFunction_t task;
+    void *arg;
+} task_start_t;
+
+static pthread_mutex_t critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+int64_t esp_timer_get_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux) {
+    pthread_mutex_lock(&critical_lock);
+}
+
+void vPortExitCritical(portMUX_TYPE *mux) {
+    pthread_mutex_unlock(&critical_lock);
+}
+
+void vPortYield(void) {
+    sched_yield();
+}
+
+// tasks
+
+static void *task_entry(void *arg) {
+    task_start_t start = *(task_start_t *)arg;
+    free(arg);
+
+    start.task(start.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth, void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core_id) {
+    task_start_t *start = malloc(sizeof(task_start_t));
+    if (start == NULL) return pdFAIL;
+
+    start->task = task;
+    start->arg = arg;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, task_entry, start) != 0) {
+        free(start);
+        return pdFAIL;
+    }
+
+    pthread_detach(thread);
+    if (handle != NULL) *handle = (TaskHandle_t)thread;
+
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t handle) {
+    // only a task deleting itself
+    if (handle == NULL) pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    if (ticks == 0) {
+        sched_yield();
+        return;
+    }
+
+    uint64_t ns = (uint64_t)ticks * (1000000000 / configTICK_RATE_HZ);
+    struct timespec delay = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+
+    nanosleep(&delay, NULL);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return esp_timer_get_time() / (1000000 / configTICK_RATE_HZ);
+}
+
+// queues and semaphores
+
+static QueueHandle_t queue_create(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = calloc(1, sizeof(struct queue_definition));
+    if (queue == NULL) return NULL;
+
+    queue->items = calloc(length, item_size > 0 ? item_size : 1);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->item_size = item_size;
+    queue->length = length;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return queue;
+}
+
+// called with the queue mutex held: false once the deadline has passed
+static bool queue_wait(QueueHandle_t queue, TickType_t ticks_to_wait, const struct timespec *deadline) {
+    if (ticks_to_wait == 0) return false;
+
+    if (ticks_to_wait == portMAX_DELAY) {
+        pthread_cond_wait(&queue->changed, &queue->mutex);
+        return true;
+    }
+
+    return pthread_cond_timedwait(&queue->changed, &queue->mutex, deadline) == 0;
+}
+
+static struct timespec deadline_after(TickType_t ticks) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    if (ticks == portMAX_DELAY) return deadline;
+
+    uint64_t ns = deadline.tv_nsec + (uint64_t)ticks * (1000000000 / configTICK_RATE_HZ);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+
+    return deadline;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    return queue_create(length, item_size);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    struct timespec deadline = deadline_after(ticks_to_wait);
+
+    pthread_mutex_lock(&queue->mutex);
+
+    while (queue->count == queue->length) {
+        if (!queue_wait(queue, ticks_to_wait, &deadline)) {
+            pthread_mutex_unlock(&queue->mutex);
+            return pdFALSE;
+        }
+    }
+
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    if (queue->item_size > 0) memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait) {
+    struct timespec deadline = deadline_after(ticks_to_wait);
+
+    pthread_mutex_lock(&queue->mutex);
+
+    while (queue->count == 0) {
+        if (!queue_wait(queue, ticks_to_wait, &deadline)) {
+            pthread_mutex_unlock(&queue->mutex);
+            return pdFALSE;
+        }
+    }
+
+    if (queue->item_size > 0) memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+// created empty, as in FreeRTOS
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return queue_create(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    SemaphoreHandle_t semaphore = queue_create(max_count, 0);
+    if (semaphore != NULL) semaphore->count = initial_count;
+
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+    return xQueueReceive(semaphore, NULL, ticks_to_wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return xQueueSend(semaphore, NULL, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void) {
+    return queue_create(1, 0);
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks_to_wait) {
+    struct timespec deadline = deadline_after(ticks_to_wait);
+
+    pthread_mutex_lock(&mutex->mutex);
+
+    if (mutex->depth > 0 && pthread_equal(mutex->holder, pthread_self())) {
+        mutex->depth++;
+        pthread_mutex_unlock(&mutex->mutex);
+        return pdTRUE;
+    }
+
+    while (mutex->depth > 0) {
+        if (!queue_wait(mutex, ticks_to_wait, &deadline)) {
+            pthread_mutex_unlock(&mutex->mutex);
+            return pdFALSE;
+        }
+    }
+
+    mutex->holder = pthread_self();
+    mutex->depth = 1;
+
+    pthread_mutex_unlock(&mutex->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex) {
+    pthread_mutex_lock(&mutex->mutex);
+
+    if (mutex->depth == 0 || !pthread_equal(mutex->holder, pthread_self())) {
+        pthread_mutex_unlock(&mutex->mutex);
+        return pdFALSE;
+    }
+
+    if (--mutex->depth == 0) pthread_cond_broadcast(&mutex->changed);
+
+    pthread_mutex_unlock(&mutex->mutex);
+    return pdTRUE;
+}
@@ -0,0 +1,483 @@
+// the W25Q64 command set behind the ESP-IDF SPI master API: the real driver runs unchanged on top of it
+
+#define _GNU_SOURCE
+
+#include "fake_spi_flash.h"
+
+#include "driver/spi_master.h"
+#include "driver/gpio.h"
+#include "esp_timer.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define PAGE_SIZE 256
+#define SECTOR_SIZE 4096
+#define BLOCK32_SIZE (32 * 1024)
+#define BLOCK64_SIZE (64 * 1024)
+
+#define STATUS_BUSY 0x01
+#define STATUS_WEL 0x02
+
+#define MAX_DEVICES 4
+#define MAX_QUEUED 8
+
+struct spi_device_t {
+    spi_device_interface_config_t config;
+    spi_transaction_t *queue[MAX_QUEUED];
+    uint32_t head;
+    uint32_t count;
+};
+
+static struct spi_device_t devices[MAX_DEVICES];
+static uint32_t device_count;
+
+// the driver callbacks drive CS from inside a transaction
+static pthread_mutex_t chip_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static uint8_t memory[FAKE_FLASH_CAPACITY];
+
+static uint32_t page_program_us = 700;
+static uint32_t sector_erase_us = 45000;
+
+// chip state
+static bool write_enabled;
+static int64_t busy_until;
+static struct {
+    bool active;
+    bool suspended;
+    uint32_t address;
+    uint32_t size;
+    int64_t remaining_us;
+} erase;
+
+// command in progress, between CS low and CS high
+static struct {
+    bool selected;
+    bool dropped;
+    uint32_t bytes;
+    uint8_t cmd;
+    uint32_t address;
+    uint32_t address_left;
+    uint32_t dummy_left;
+    uint32_t data_pos;
+    uint8_t page[PAGE_SIZE];
+} frame;
+
+static uint32_t *programs;
+static uint32_t program_count;
+static uint32_t program_capacity;
+
+static fake_flash_event_t *events;
+static uint32_t event_count;
+static uint32_t event_capacity;
+
+static uint32_t violations;
+
+static uint32_t stat_transactions;
+static uint64_t stat_bytes;
+static uint64_t stat_bus_ns;
+
+static bool chip_busy(void) {
+    return esp_timer_get_time() < busy_until;
+}
+
+static void violation(const char *what) {
+    violations++;
+    fprintf(stderr, "fake_spi_flash: %s, command 0x%02X\n", what, frame.cmd);
+}
+
+static void log_program(uint32_t address) {
+    if (program_count == program_capacity) {
+        program_capacity = program_capacity > 0 ? program_capacity * 2 : 256;
+        programs = realloc(programs, program_capacity * sizeof(uint32_t));
+    }
+
+    programs[program_count++] = address;
+}
+
+static void log_event(fake_flash_event_type_t type, uint32_t address, int64_t now) {
+    if (event_count == event_capacity) {
+        event_capacity = event_capacity > 0 ? event_capacity * 2 : 256;
+        events = realloc(events, event_capacity * sizeof(fake_flash_event_t));
+    }
+
+    events[event_count++] = (fake_flash_event_t){
+        .type = type,
+        .address = address,
+        .time_us = now,
+        .erase_done_us = busy_until,
+    };
+}
+
+static void frame_begin(uint8_t cmd) {
+    frame.cmd = cmd;
+    frame.address = 0;
+    frame.address_left = 0;
+    frame.dummy_left = 0;
+    frame.data_pos = 0;
+    frame.dropped = false;
+
+    switch (cmd) {
+        case 0x0B: case 0x3B: case 0x5A:
+            frame.dummy_left = 1;
+            // fall through
+        case 0x03: case 0x02: case 0x20: case 0x52: case 0xD8:
+            frame.address_left = 3;
+            break;
+    }
+
+    // busy: only status reads and erase suspend get through
+    if (chip_busy() && cmd != 0x05 && cmd != 0x75) {
+        violation("command while busy");
+        frame.dropped = true;
+    }
+}
+
+// one byte clocked out on MOSI, returns the byte on MISO
+static uint8_t exchange(uint8_t mosi) {
+    static const uint8_t jedec_id[3] = { 0xEF, 0x40, 0x17 };
+
+    if (!frame.selected) {
+        violation("transfer with CS high");
+        return 0xFF;
+    }
+
+    if (frame.bytes++ == 0) {
+        frame_begin(mosi);
+        return 0xFF;
+    }
+
+    if (frame.dropped) return 0xFF;
+
+    if (frame.address_left > 0) {
+        frame.address = (frame.address << 8) | mosi;
+        frame.address_left--;
+        return 0xFF;
+    }
+
+    if (frame.dummy_left > 0) {
+        frame.dummy_left--;
+        return 0xFF;
+    }
+
+    switch (frame.cmd) {
+        case 0x05:
+            return (chip_busy() ? STATUS_BUSY : 0) | (write_enabled ? STATUS_WEL : 0);
+        case 0x9F:
+            return frame.data_pos < 3 ? jedec_id[frame.data_pos++] : 0xFF;
+        case 0x03: case 0x0B: case 0x3B:
+            return memory[(frame.address + frame.data_pos++) % FAKE_FLASH_CAPACITY];
+        case 0x02:
+            // past the end of the page the address wraps to its start
+            if (frame.data_pos == 0) memset(frame.page, 0xFF, PAGE_SIZE);
+            frame.page[(frame.address + frame.data_pos++) % PAGE_SIZE] = mosi;
+            return 0xFF;
+        default:
+            return 0xFF;
+    }
+}
+
+static void start_erase(uint32_t size, uint32_t duration_us) {
+    if (!write_enabled) {
+        violation("erase without write enable");
+        return;
+    }
+
+    if (erase.suspended) {
+        violation("erase while another one is suspended");
+        return;
+    }
+
+    uint32_t address = (frame.address % FAKE_FLASH_CAPACITY) & ~(size - 1);
+    memset(memory + address, 0xFF, size);
+
+    int64_t now = esp_timer_get_time();
+
+    erase.active = true;
+    erase.address = address;
+    erase.size = size;
+    busy_until = now + duration_us;
+    write_enabled = false;
+
+    log_event(FAKE_FLASH_ERASE, address, now);
+}
+
+// CS high: programs and erases start here
+static void frame_end(void) {
+    if (frame.bytes == 0 || frame.dropped) return;
+
+    int64_t now = esp_timer_get_time();
+
+    switch (frame.cmd) {
+        case 0x06:
+            write_enabled = true;
+            break;
+        case 0x02: {
+            if (!write_enabled) {
+                violation("page program without write enable");
+                break;
+            }
+
+            uint32_t page = (frame.address % FAKE_FLASH_CAPACITY) & ~(PAGE_SIZE - 1);
+
+            if (erase.suspended && page < erase.address + erase.size && erase.address < page + PAGE_SIZE) {
+                violation("page program inside the suspended erase");
+                break;
+            }
+
+            if (!erase.suspended) erase.active = false;
+
+            // programming only clears bits
+            for (uint32_t i = 0; i < PAGE_SIZE; i++) memory[page + i] &= frame.page[i];
+
+            log_program(frame.address);
+            busy_until = now + page_program_us;
+            write_enabled = false;
+
+            log_event(FAKE_FLASH_PROGRAM, page, now);
+            break;
+        }
+        case 0x20:
+            start_erase(SECTOR_SIZE, sector_erase_us);
+            break;
+        case 0x52:
+            start_erase(BLOCK32_SIZE, sector_erase_us * 3);
+            break;
+        case 0xD8:
+            start_erase(BLOCK64_SIZE, sector_erase_us * 4);
+            break;
+        case 0xC7:
+            start_erase(FAKE_FLASH_CAPACITY, sector_erase_us * 400);
+            break;
+        case 0x75:
+            if (erase.active && !erase.suspended && now < busy_until) {
+                erase.remaining_us = busy_until - now;
+                erase.suspended = true;
+                busy_until = now;
+
+                log_event(FAKE_FLASH_SUSPEND, erase.address, now);
+            }
+            break;
+        case 0x7A:
+            if (erase.suspended) {
+                erase.suspended = false;
+                busy_until = now + erase.remaining_us;
+
+                log_event(FAKE_FLASH_RESUME, erase.address, now);
+            }
+            break;
+    }
+}
+
+esp_err_t gpio_config(const gpio_config_t *config) {
+    return ESP_OK;
+}
+
+// the flash CS is the only output
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+    pthread_mutex_lock(&chip_lock);
+
+    if (level == 0 && !frame.selected) {
+        frame.selected = true;
+        frame.bytes = 0;
+    } else if (level != 0 && frame.selected) {
+        frame_end();
+        frame.selected = false;
+    }
+
+    pthread_mutex_unlock(&chip_lock);
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host_id, const spi_bus_config_t *bus_config, int dma_chan) {
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host_id, const spi_device_interface_config_t *dev_config, spi_device_handle_t *handle) {
+    if (device_count == MAX_DEVICES) return ESP_ERR_NO_MEM;
+
+    struct spi_device_t *device = &devices[device_count++];
+    memset(device, 0, sizeof(*device));
+    device->config = *dev_config;
+
+    *handle = device;
+    return ESP_OK;
+}
+
+// called with the chip lock held
+static void execute(struct spi_device_t *device, spi_transaction_t *t) {
+    const spi_device_interface_config_t *config = &device->config;
+    uint32_t phase_bytes = 0;
+
+    if (config->pre_cb != NULL) config->pre_cb(t);
+
+    if (config->command_bits > 0) {
+        exchange(t->cmd & 0xFF);
+        phase_bytes++;
+    }
+
+    for (uint32_t i = config->address_bits / 8; i > 0; i--) {
+        exchange((t->addr >> ((i - 1) * 8)) & 0xFF);
+        phase_bytes++;
+    }
+
+    for (uint32_t i = 0; i < config->dummy_bits / 8u; i++) {
+        exchange(0x00);
+        phase_bytes++;
+    }
+
+    const uint8_t *tx = t->tx_buffer;
+    uint8_t *rx = t->rx_buffer;
+    size_t data_bytes;
+
+    if (config->flags & SPI_DEVICE_HALFDUPLEX) {
+        // write phase, then read phase
+        size_t tx_bytes = tx != NULL ? t->length / 8 : 0;
+        size_t rx_bytes = rx != NULL ? (t->rxlength > 0 ? t->rxlength : t->length) / 8 : 0;
+
+        for (size_t i = 0; i < tx_bytes; i++) exchange(tx[i]);
+        for (size_t i = 0; i < rx_bytes; i++) rx[i] = exchange(0x00);
+
+        data_bytes = tx_bytes + rx_bytes;
+    } else {
+        data_bytes = t->length / 8;
+
+        for (size_t i = 0; i < data_bytes; i++) {
+            uint8_t miso = exchange(tx != NULL ? tx[i] : 0x00);
+            if (rx != NULL) rx[i] = miso;
+        }
+    }
+
+    if (config->post_cb != NULL) config->post_cb(t);
+
+    // dual output clocks the data phase on two lines
+    uint64_t data_bits = data_bytes * 8 / ((t->flags & SPI_TRANS_MODE_DIO) ? 2 : 1);
+
+    stat_transactions++;
+    stat_bytes += phase_bytes + data_bytes;
+    stat_bus_ns += (phase_bytes * 8 + data_bits) * 1000000000ULL / config->clock_speed_hz + FAKE_SPI_TRANS_OVERHEAD_US * 1000;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans_desc) {
+    pthread_mutex_lock(&chip_lock);
+
+    if (handle->count > 0) violation("polling transaction with queued ones pending");
+    execute(handle, trans_desc);
+
+    pthread_mutex_unlock(&chip_lock);
+    return ESP_OK;
+}
+
+// queued transactions run when their result is collected, like a DMA that only gets to them late
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans_desc, TickType_t ticks_to_wait) {
+    pthread_mutex_lock(&chip_lock);
+
+    uint32_t limit = handle->config.queue_size < MAX_QUEUED ? handle->config.queue_size : MAX_QUEUED;
+
+    if (handle->count == limit) {
+        pthread_mutex_unlock(&chip_lock);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    handle->queue[(handle->head + handle->count) % MAX_QUEUED] = trans_desc;
+    handle->count++;
+
+    pthread_mutex_unlock(&chip_lock);
+    return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **trans_desc, TickType_t ticks_to_wait) {
+    pthread_mutex_lock(&chip_lock);
+
+    if (handle->count == 0) {
+        pthread_mutex_unlock(&chip_lock);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    spi_transaction_t *t = handle->queue[handle->head];
+    handle->head = (handle->head + 1) % MAX_QUEUED;
+    handle->count--;
+
+    execute(handle, t);
+    *trans_desc = t;
+
+    pthread_mutex_unlock(&chip_lock);
+    return ESP_OK;
+}
+
+void fake_flash_reset(void) {
+    pthread_mutex_lock(&chip_lock);
+
+    memset(memory, 0xFF, sizeof(memory));
+    write_enabled = false;
+    busy_until = 0;
+    memset(&erase, 0, sizeof(erase));
+
+    page_program_us = 700;
+    sector_erase_us = 45000;
+
+    program_count = 0;
+    event_count = 0;
+    violations = 0;
+    stat_transactions = 0;
+    stat_bytes = 0;
+    stat_bus_ns = 0;
+
+    pthread_mutex_unlock(&chip_lock);
+}
+
+uint8_t *fake_flash_memory(void) {
+    return memory;
+}
+
+void fake_flash_set_timing(uint32_t program_us, uint32_t erase_us) {
+    pthread_mutex_lock(&chip_lock);
+    page_program_us = program_us;
+    sector_erase_us = erase_us;
+    pthread_mutex_unlock(&chip_lock);
+}
+
+void fake_flash_get_stats(fake_spi_stats_t *stats) {
+    pthread_mutex_lock(&chip_lock);
+    stats->transactions = stat_transactions;
+    stats->bytes = stat_bytes;
+    stats->bus_us = stat_bus_ns / 1000;
+    pthread_mutex_unlock(&chip_lock);
+}
+
+void fake_flash_reset_stats(void) {
+    pthread_mutex_lock(&chip_lock);
+    stat_transactions = 0;
+    stat_bytes = 0;
+    stat_bus_ns = 0;
+    pthread_mutex_unlock(&chip_lock);
+}
+
+uint32_t fake_flash_get_programs(uint32_t *addrs, uint32_t max) {
+    pthread_mutex_lock(&chip_lock);
+
+    uint32_t count = program_count;
+    if (count > 0) memcpy(addrs, programs, (count < max ? count : max) * sizeof(uint32_t));
+
+    pthread_mutex_unlock(&chip_lock);
+    return count;
+}
+
+uint32_t fake_flash_get_events(fake_flash_event_t *out, uint32_t max) {
+    pthread_mutex_lock(&chip_lock);
+
+    uint32_t count = event_count;
+    if (count > 0) memcpy(out, events, (count < max ? count : max) * sizeof(fake_flash_event_t));
+
+    pthread_mutex_unlock(&chip_lock);
+    return count;
+}
+
+uint32_t fake_flash_get_violations(void) {
+    pthread_mutex_lock(&chip_lock);
+    uint32_t count = violations;
+    pthread_mutex_unlock(&chip_lock);
+
+    return count;
+}
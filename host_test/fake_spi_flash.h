@@ -0,0 +1,75 @@
+#ifndef __FAKE_SPI_FLASH_H__
+#define __FAKE_SPI_FLASH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// a W25Q64 on the other end of the ESP-IDF SPI master and CS GPIO: JEDEC ID EF 40 17, no SFDP table
+#define FAKE_FLASH_CAPACITY (8 * 1024 * 1024)
+
+/**
+ * @brief Bus traffic since the last fake_flash_reset_stats().
+ *        bus_us models the ESP32 clocks, 10 MHz for regular transactions and 26 MHz for stream reads,
+ *        plus FAKE_SPI_TRANS_OVERHEAD_US of driver time per transaction.
+ */
+typedef struct {
+    uint32_t transactions;
+    uint64_t bytes; // command, address, dummy and data
+    uint64_t bus_us;
+} fake_spi_stats_t;
+
+// assumed cost of setting up one transaction in the ESP-IDF SPI master driver
+#define FAKE_SPI_TRANS_OVERHEAD_US 10
+
+/**
+ * @brief Erases the whole array, clears the stats and the program and event logs, restores the default timings.
+ */
+void fake_flash_reset(void);
+
+/**
+ * @brief The array itself, to load an image or check contents without going through the bus.
+ */
+uint8_t* fake_flash_memory(void);
+
+/**
+ * @brief Time the chip reports busy after a page program and a sector erase, datasheet typical by default.
+ */
+void fake_flash_set_timing(uint32_t page_program_us, uint32_t sector_erase_us);
+
+void fake_flash_get_stats(fake_spi_stats_t* stats);
+
+void fake_flash_reset_stats(void);
+
+/**
+ * @brief Addresses of the accepted page programs in the order the chip received them.
+ * @return number of programs, can exceed max
+ */
+uint32_t fake_flash_get_programs(uint32_t* addrs, uint32_t max);
+
+typedef enum {
+    FAKE_FLASH_ERASE,
+    FAKE_FLASH_SUSPEND,
+    FAKE_FLASH_RESUME,
+    FAKE_FLASH_PROGRAM,
+} fake_flash_event_type_t;
+
+typedef struct {
+    fake_flash_event_type_t type;
+    uint32_t address; // erase and program
+    int64_t time_us;
+    int64_t erase_done_us; // erase and resume: when the erase completes unless suspended again
+} fake_flash_event_t;
+
+/**
+ * @brief Erases, erase suspends and resumes, and page programs the chip accepted, in order.
+ * @return number of events, can exceed max
+ */
+uint32_t fake_flash_get_events(fake_flash_event_t* events, uint32_t max);
+
+/**
+ * @brief Commands the chip had to drop: programs or erases while busy or without write enable,
+ *        reads while busy, transfers with CS high.
+ */
+uint32_t fake_flash_get_violations(void);
+
+#endif /* __FAKE_SPI_FLASH_H__ */
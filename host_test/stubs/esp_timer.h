@@ -0,0 +1,9 @@
+#ifndef __ESP_TIMER_H__
+#define __ESP_TIMER_H__
+
+#include <stdint.h>
+
+// us from the host monotonic clock
+int64_t esp_timer_get_time(void);
+
+#endif /* __ESP_TIMER_H__ */
@@ -0,0 +1,8 @@
+#ifndef __SDKCONFIG_H__
+#define __SDKCONFIG_H__
+
+// host build: the options of the project sdkconfig the tested code reads
+
+#define CONFIG_FREERTOS_HZ 100
+
+#endif /* __SDKCONFIG_H__ */
@@ -0,0 +1,8 @@
+#ifndef __SOC_GPIO_NUM_H__
+#define __SOC_GPIO_NUM_H__
+
+typedef int gpio_num_t;
+
+#define GPIO_NUM_NC -1
+
+#endif /* __SOC_GPIO_NUM_H__ */
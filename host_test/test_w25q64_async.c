@@ -0,0 +1,265 @@
+// w25q64 asynchronous page writer against the fake chip: page order, both ping-pong buffers, flush
+
+#include "w25q64.h"
+#include "fake_spi_flash.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGE_BUFFERS 2
+#define PAGES 64
+
+// regions of the chip, one per test, all erased at start
+#define ORDER_ADDR 0x000000
+#define FLUSH_ADDR 0x010000
+#define SYNC_ADDR 0x020000
+#define ASYNC_ADDR 0x030000
+
+// producer time per page in the throughput test, about a page program
+#define FILL_US 700
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static uint8_t page_buffer[PAGE_BUFFERS][W25Q64_PAGE_SIZE];
+static SemaphoreHandle_t free_buffers;
+
+// completions in the order the writer task reported them
+#define MAX_DONE 1024
+static const uint8_t *done_page[MAX_DONE];
+static esp_err_t done_result[MAX_DONE];
+static volatile uint32_t done_count = 0;
+
+static uint32_t programs[MAX_DONE];
+
+static void page_written(const uint8_t *page, esp_err_t result, void *ctx) {
+    // only the writer task gets here
+    uint32_t n = done_count;
+
+    if (n < MAX_DONE) {
+        done_page[n] = page;
+        done_result[n] = result;
+    }
+
+    done_count = n + 1;
+    xSemaphoreGive(free_buffers);
+}
+
+static void fill_page(uint8_t *page, uint32_t seq) {
+    for (uint32_t i = 0; i < W25Q64_PAGE_SIZE; i++) page[i] = (uint8_t)(seq * 31 + i);
+}
+
+static bool page_matches(uint32_t addr, uint32_t seq) {
+    uint8_t expected[W25Q64_PAGE_SIZE];
+    fill_page(expected, seq);
+
+    return memcmp(fake_flash_memory() + addr, expected, W25Q64_PAGE_SIZE) == 0;
+}
+
+// the flash_log producer: fill the free buffer, queue it, move on to the other one
+static void write_pages_async(uint32_t addr, uint32_t pages, uint32_t fill_us) {
+    for (uint32_t seq = 0; seq < pages; seq++) {
+        uint8_t *page = page_buffer[seq % PAGE_BUFFERS];
+
+        CHECK(xSemaphoreTake(free_buffers, portMAX_DELAY) == pdTRUE);
+
+        if (fill_us > 0) usleep(fill_us);
+        fill_page(page, seq);
+
+        CHECK(w25q64_async_write_page(addr + seq * W25Q64_PAGE_SIZE, page, W25Q64_PAGE_SIZE, portMAX_DELAY) == ESP_OK);
+    }
+}
+
+static void test_page_order(void) {
+    uint32_t first_done = done_count;
+    uint32_t first_program = fake_flash_get_programs(programs, 0);
+
+    write_pages_async(ORDER_ADDR, PAGES, 0);
+    CHECK(w25q64_async_flush(pdMS_TO_TICKS(1000)) == ESP_OK);
+
+    // programs reach the chip in queue order
+    uint32_t count = fake_flash_get_programs(programs, MAX_DONE) - first_program;
+    CHECK(count == PAGES);
+
+    for (uint32_t seq = 0; seq < count && seq < PAGES; seq++) {
+        CHECK(programs[first_program + seq] == ORDER_ADDR + seq * W25Q64_PAGE_SIZE);
+        CHECK(page_matches(ORDER_ADDR + seq * W25Q64_PAGE_SIZE, seq));
+    }
+
+    // every page completes once, alternating between the two buffers
+    uint32_t per_buffer[PAGE_BUFFERS] = {0};
+
+    CHECK(done_count - first_done == PAGES);
+
+    for (uint32_t seq = 0; seq < done_count - first_done && seq < PAGES; seq++) {
+        CHECK(done_page[first_done + seq] == page_buffer[seq % PAGE_BUFFERS]);
+        CHECK(done_result[first_done + seq] == ESP_OK);
+
+        for (uint32_t i = 0; i < PAGE_BUFFERS; i++) {
+            if (done_page[first_done + seq] == page_buffer[i]) per_buffer[i]++;
+        }
+    }
+
+    for (uint32_t i = 0; i < PAGE_BUFFERS; i++) CHECK(per_buffer[i] == PAGES / PAGE_BUFFERS);
+
+    // read back through the driver
+    uint8_t page[W25Q64_PAGE_SIZE];
+    uint8_t expected[W25Q64_PAGE_SIZE];
+    fill_page(expected, PAGES - 1);
+
+    CHECK(w25q64_read_data(ORDER_ADDR + (PAGES - 1) * W25Q64_PAGE_SIZE, page, sizeof(page)) == ESP_OK);
+    CHECK(memcmp(page, expected, sizeof(page)) == 0);
+}
+
+static void test_flush(void) {
+    static uint8_t pages[4][W25Q64_PAGE_SIZE];
+
+    // nothing pending
+    CHECK(w25q64_async_flush(0) == ESP_OK);
+
+    // a page program far slower than a tick
+    fake_flash_set_timing(50000, 45000);
+
+    uint32_t first_done = done_count;
+    fill_page(pages[0], 0);
+
+    CHECK(w25q64_async_write_page(FLUSH_ADDR, pages[0], W25Q64_PAGE_SIZE, portMAX_DELAY) == ESP_OK);
+    CHECK(w25q64_async_flush(0) == ESP_ERR_TIMEOUT);
+    CHECK(w25q64_async_flush(1) == ESP_ERR_TIMEOUT);
+    CHECK(w25q64_async_flush(pdMS_TO_TICKS(1000)) == ESP_OK);
+    CHECK(done_count - first_done == 1);
+    CHECK(page_matches(FLUSH_ADDR, 0));
+
+    // the queue fills up: the writer holds one page and the queue two more
+    uint32_t accepted = 0;
+    esp_err_t ret = ESP_OK;
+
+    first_done = done_count;
+
+    while (accepted < 4) {
+        fill_page(pages[accepted], accepted + 1);
+
+        ret = w25q64_async_write_page(FLUSH_ADDR + (accepted + 1) * W25Q64_PAGE_SIZE, pages[accepted], W25Q64_PAGE_SIZE, 0);
+        if (ret != ESP_OK) break;
+
+        accepted++;
+    }
+
+    CHECK(ret == ESP_ERR_TIMEOUT);
+    CHECK(accepted >= 2 && accepted <= 3);
+
+    // the refused page is not waited for
+    CHECK(w25q64_async_flush(pdMS_TO_TICKS(1000)) == ESP_OK);
+    CHECK(done_count - first_done == accepted);
+
+    for (uint32_t i = 0; i < accepted; i++) CHECK(page_matches(FLUSH_ADDR + (i + 1) * W25Q64_PAGE_SIZE, i + 1));
+
+    // a program well under a tick: the flush wakes with the writer, not on the next tick
+    fake_flash_set_timing(3000, 45000);
+    fill_page(pages[0], 8);
+
+    CHECK(w25q64_async_write_page(FLUSH_ADDR + 8 * W25Q64_PAGE_SIZE, pages[0], W25Q64_PAGE_SIZE, portMAX_DELAY) == ESP_OK);
+
+    int64_t start = esp_timer_get_time();
+    CHECK(w25q64_async_flush(pdMS_TO_TICKS(1000)) == ESP_OK);
+    int64_t flush_us = esp_timer_get_time() - start;
+
+    CHECK(page_matches(FLUSH_ADDR + 8 * W25Q64_PAGE_SIZE, 8));
+    CHECK(flush_us < 1000000 / CONFIG_FREERTOS_HZ);
+
+    fake_flash_set_timing(700, 45000);
+}
+
+static void test_invalid_requests(void) {
+    uint8_t page[W25Q64_PAGE_SIZE] = {0};
+
+    CHECK(w25q64_async_init(page_written, NULL) == ESP_ERR_INVALID_STATE);
+
+    // a page program cannot cross into the next page
+    CHECK(w25q64_async_write_page(16, page, W25Q64_PAGE_SIZE, 0) == ESP_ERR_INVALID_SIZE);
+    CHECK(w25q64_async_write_page(0, page, 0, 0) == ESP_ERR_INVALID_ARG);
+    CHECK(w25q64_async_write_page(0, NULL, W25Q64_PAGE_SIZE, 0) == ESP_ERR_INVALID_ARG);
+
+    CHECK(w25q64_async_flush(0) == ESP_OK);
+}
+
+// the producer overlaps the next page with the program of the previous one,
+// best of a few rounds each so a host hiccup does not decide the comparison
+#define ROUNDS 3
+
+static void test_throughput(void) {
+    uint8_t page[W25Q64_PAGE_SIZE];
+    int64_t sync_us = INT64_MAX;
+    int64_t async_us = INT64_MAX;
+
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        uint32_t sync_addr = SYNC_ADDR + round * PAGES * W25Q64_PAGE_SIZE;
+        uint32_t async_addr = ASYNC_ADDR + round * PAGES * W25Q64_PAGE_SIZE;
+
+        int64_t start = esp_timer_get_time();
+
+        for (uint32_t seq = 0; seq < PAGES; seq++) {
+            usleep(FILL_US);
+            fill_page(page, seq);
+            CHECK(w25q64_write_data(sync_addr + seq * W25Q64_PAGE_SIZE, page, W25Q64_PAGE_SIZE) == ESP_OK);
+        }
+
+        int64_t elapsed = esp_timer_get_time() - start;
+        if (elapsed < sync_us) sync_us = elapsed;
+
+        start = esp_timer_get_time();
+        write_pages_async(async_addr, PAGES, FILL_US);
+        CHECK(w25q64_async_flush(pdMS_TO_TICKS(1000)) == ESP_OK);
+
+        elapsed = esp_timer_get_time() - start;
+        if (elapsed < async_us) async_us = elapsed;
+
+        for (uint32_t seq = 0; seq < PAGES; seq++) {
+            CHECK(page_matches(sync_addr + seq * W25Q64_PAGE_SIZE, seq));
+            CHECK(page_matches(async_addr + seq * W25Q64_PAGE_SIZE, seq));
+        }
+    }
+
+    printf("%d pages, %d us fill, 700 us program: sync %.0f pages/s, async %.0f pages/s\n",
+        PAGES, FILL_US, PAGES * 1e6 / sync_us, PAGES * 1e6 / async_us);
+
+    CHECK(async_us < sync_us);
+}
+
+int main(void) {
+    fake_flash_reset();
+
+    if (w25q64_init(19, 22, 21, 23) != ESP_OK) {
+        fprintf(stderr, "w25q64_init failed\n");
+        return 1;
+    }
+
+    CHECK(w25q64_get_geometry()->capacity == FAKE_FLASH_CAPACITY);
+
+    free_buffers = xSemaphoreCreateCounting(PAGE_BUFFERS, PAGE_BUFFERS);
+    CHECK(w25q64_async_init(page_written, NULL) == ESP_OK);
+
+    test_page_order();
+    test_flush();
+    test_invalid_requests();
+    test_throughput();
+
+    // the driver never sent the chip a command it had to drop
+    CHECK(fake_flash_get_violations() == 0);
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
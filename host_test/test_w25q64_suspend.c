@@ -0,0 +1,180 @@
+// w25q64 erase suspend against the fake chip: page programs run while a sector erase is in progress,
+// the ones outside it inside a suspend/resume pair, the ones inside it only once the erase is done
+
+#include "w25q64.h"
+#include "fake_spi_flash.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ERASE_ADDR 0x100000
+#define OUTSIDE_ADDR 0x110000
+#define INSIDE_ADDR (ERASE_ADDR + 4 * W25Q64_PAGE_SIZE)
+
+#define ERASE_US 200000 // long enough that every outside program lands inside it
+#define OUTSIDE_PAGES 8
+
+// between programs, well over the driver's minimum run time for a resumed erase
+#define PROGRAM_GAP_US 2000
+
+#define MAX_EVENTS 64
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static SemaphoreHandle_t erase_done;
+static esp_err_t erase_result;
+
+static void erase_task(void *arg) {
+    erase_result = w25q64_erase_sector(ERASE_ADDR);
+    xSemaphoreGive(erase_done);
+    vTaskDelete(NULL);
+}
+
+static void fill_page(uint8_t *page, uint32_t seq) {
+    for (uint32_t i = 0; i < W25Q64_PAGE_SIZE; i++) page[i] = (uint8_t)(seq * 31 + i);
+}
+
+static bool page_matches(uint32_t addr, uint32_t seq) {
+    uint8_t expected[W25Q64_PAGE_SIZE];
+    fill_page(expected, seq);
+
+    return memcmp(fake_flash_memory() + addr, expected, W25Q64_PAGE_SIZE) == 0;
+}
+
+static bool in_erase(uint32_t addr) {
+    return addr >= ERASE_ADDR && addr < ERASE_ADDR + W25Q64_SECTOR_SIZE;
+}
+
+static void test_programs_during_erase(void) {
+    uint8_t page[W25Q64_PAGE_SIZE];
+
+    // old data in the sector, so the erase shows
+    memset(fake_flash_memory() + ERASE_ADDR, 0x00, W25Q64_SECTOR_SIZE);
+    fake_flash_set_timing(700, ERASE_US);
+
+    CHECK(xTaskCreatePinnedToCore(erase_task, "erase", 4096, NULL, 5, NULL, 0) == pdPASS);
+
+    // let the erase command go out
+    fake_flash_event_t events[MAX_EVENTS];
+    while (fake_flash_get_events(events, MAX_EVENTS) == 0) usleep(100);
+
+    for (uint32_t seq = 0; seq < OUTSIDE_PAGES; seq++) {
+        usleep(PROGRAM_GAP_US);
+        fill_page(page, seq);
+        CHECK(w25q64_write_data(OUTSIDE_ADDR + seq * W25Q64_PAGE_SIZE, page, W25Q64_PAGE_SIZE) == ESP_OK);
+    }
+
+    // blocks until the erase is done
+    fill_page(page, OUTSIDE_PAGES);
+    CHECK(w25q64_write_data(INSIDE_ADDR, page, W25Q64_PAGE_SIZE) == ESP_OK);
+
+    CHECK(xSemaphoreTake(erase_done, pdMS_TO_TICKS(1000)) == pdTRUE);
+    CHECK(erase_result == ESP_OK);
+
+    // the chip saw the erase, then each outside program between a suspend and a resume
+    uint32_t count = fake_flash_get_events(events, MAX_EVENTS);
+    CHECK(count <= MAX_EVENTS);
+    if (count > MAX_EVENTS) count = MAX_EVENTS;
+
+    CHECK(count > 0 && events[0].type == FAKE_FLASH_ERASE && events[0].address == ERASE_ADDR);
+
+    bool suspended = false;
+    int64_t erase_done_us = events[0].erase_done_us;
+    uint32_t suspends = 0;
+    uint32_t outside = 0;
+    uint32_t inside = 0;
+
+    for (uint32_t i = 1; i < count; i++) {
+        const fake_flash_event_t *event = &events[i];
+
+        switch (event->type) {
+            case FAKE_FLASH_SUSPEND:
+                CHECK(!suspended);
+                suspended = true;
+                suspends++;
+                break;
+            case FAKE_FLASH_RESUME:
+                CHECK(suspended);
+                suspended = false;
+                erase_done_us = event->erase_done_us;
+                break;
+            case FAKE_FLASH_PROGRAM:
+                if (in_erase(event->address)) {
+                    // after the erase, with no suspend left open
+                    CHECK(!suspended);
+                    CHECK(event->time_us >= erase_done_us);
+                    inside++;
+                } else {
+                    // suspended, or the erase already finished
+                    CHECK(suspended || event->time_us >= erase_done_us);
+                    outside++;
+                }
+                break;
+            case FAKE_FLASH_ERASE:
+                CHECK(false);
+                break;
+        }
+    }
+
+    CHECK(!suspended);
+    CHECK(outside == OUTSIDE_PAGES);
+    CHECK(inside == 1);
+
+    // the erase lasts far longer than the outside programs, they all got in ahead of it
+    CHECK(suspends == OUTSIDE_PAGES);
+
+    // the inside page was the last program
+    CHECK(events[count - 1].type == FAKE_FLASH_PROGRAM && in_erase(events[count - 1].address));
+
+    for (uint32_t seq = 0; seq < OUTSIDE_PAGES; seq++) CHECK(page_matches(OUTSIDE_ADDR + seq * W25Q64_PAGE_SIZE, seq));
+    CHECK(page_matches(INSIDE_ADDR, OUTSIDE_PAGES));
+
+    // the rest of the sector was erased before the program
+    for (uint32_t offset = 0; offset < W25Q64_SECTOR_SIZE; offset++) {
+        uint32_t addr = ERASE_ADDR + offset;
+        if (addr >= INSIDE_ADDR && addr < INSIDE_ADDR + W25Q64_PAGE_SIZE) continue;
+
+        if (fake_flash_memory()[addr] != 0xFF) {
+            CHECK(fake_flash_memory()[addr] == 0xFF);
+            break;
+        }
+    }
+
+    w25q64_suspend_stats_t stats;
+    w25q64_get_suspend_stats(&stats);
+
+    CHECK(stats.suspends == suspends);
+    CHECK(stats.blocked == 1);
+}
+
+int main(void) {
+    fake_flash_reset();
+
+    if (w25q64_init(19, 22, 21, 23) != ESP_OK) {
+        fprintf(stderr, "w25q64_init failed\n");
+        return 1;
+    }
+
+    erase_done = xSemaphoreCreateBinary();
+
+    test_programs_during_erase();
+
+    // the driver never sent the chip a command it had to drop
+    CHECK(fake_flash_get_violations() == 0);
+
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
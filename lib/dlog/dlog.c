@@ -0,0 +1,202 @@
+#include "dlog.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart_vfs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "crc.h"
+
+static const char *TAG = "dlog";
+
+#define DLOG_TASK_STACK 3072
+#define DLOG_TASK_PRIORITY 2
+#define DLOG_FLUSH_INTERVAL pdMS_TO_TICKS(20)
+#define DLOG_UART_TX_BUFFER 4096
+#define DLOG_LINE_SIZE 192
+
+_Static_assert((DLOG_RING_SIZE & (DLOG_RING_SIZE - 1)) == 0, "ring size must be a power of two");
+
+typedef struct {
+    uint16_t id;
+    uint8_t nargs;
+    uint32_t ut;
+    uint32_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+// single producer, single consumer: head is only written by the producer, tail by the formatter task
+static dlog_record_t ring[DLOG_RING_SIZE];
+static atomic_uint_fast32_t head;
+static atomic_uint_fast32_t tail;
+static atomic_uint_fast32_t dropped;
+
+static uart_port_t dlog_port;
+
+bool dlog_write(dlog_id_t id, const uint32_t *args, uint32_t nargs) {
+    uint32_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    uint32_t t = atomic_load_explicit(&tail, memory_order_acquire);
+
+    if (h - t == DLOG_RING_SIZE || nargs > DLOG_MAX_ARGS) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    dlog_record_t *record = &ring[h & (DLOG_RING_SIZE - 1)];
+    record->id = id;
+    record->nargs = nargs;
+    record->ut = (uint32_t)(esp_timer_get_time() / 1000ULL);
+    memcpy(record->args, args, nargs * sizeof(uint32_t));
+
+    // the record is complete before the consumer can see it
+    atomic_store_explicit(&head, h + 1, memory_order_release);
+    return true;
+}
+
+uint32_t dlog_get_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+#if DLOG_BINARY
+
+static void dlog_emit(const dlog_record_t *record) {
+    uint8_t frame[sizeof(dlog_frame_header_t) + DLOG_MAX_ARGS * sizeof(uint32_t) + sizeof(uint16_t)];
+
+    dlog_frame_header_t header = {
+        .sync = DLOG_SYNC,
+        .id = record->id,
+        .ut = record->ut,
+        .nargs = record->nargs,
+    };
+
+    size_t n = 0;
+    memcpy(frame, &header, sizeof(header));
+    n += sizeof(header);
+    memcpy(frame + n, record->args, record->nargs * sizeof(uint32_t));
+    n += record->nargs * sizeof(uint32_t);
+
+    uint16_t crc = crc16(frame, n);
+    memcpy(frame + n, &crc, sizeof(crc));
+    n += sizeof(crc);
+
+    // one write per frame: the driver never interleaves it with console text
+    uart_write_bytes(dlog_port, frame, n);
+}
+
+#else
+
+static const char *const formats[DLOG_FORMAT_COUNT] = {
+#define DLOG_FORMAT_STRING(name, nargs, fmt) fmt,
+    DLOG_FORMATS(DLOG_FORMAT_STRING)
+#undef DLOG_FORMAT_STRING
+};
+
+// printf of one conversion at a time, each argument taken from its word
+static void dlog_emit(const dlog_record_t *record) {
+    char line[DLOG_LINE_SIZE];
+    size_t len = 0;
+    uint32_t arg = 0;
+    const char *p = record->id < DLOG_FORMAT_COUNT ? formats[record->id] : "dlog: unknown format";
+
+    while (*p != '\0' && len < sizeof(line) - 1) {
+        if (*p != '%' || p[1] == '%') {
+            line[len++] = *p;
+            p += (*p == '%') ? 2 : 1;
+            continue;
+        }
+
+        // copy the conversion: flags, width, precision, length, type
+        char spec[16];
+        size_t spec_len = 0;
+        bool is_long = false;
+
+        spec[spec_len++] = *p++;
+        while (*p != '\0' && strchr("-+ #0123456789.hlzjt", *p) != NULL && spec_len < sizeof(spec) - 2) {
+            if (*p == 'l') is_long = true;
+            spec[spec_len++] = *p++;
+        }
+        if (*p == '\0') break;
+
+        char type = *p++;
+        spec[spec_len++] = type;
+        spec[spec_len] = '\0';
+
+        uint32_t word = arg < record->nargs ? record->args[arg] : 0;
+        arg++;
+
+        int written;
+        if (strchr("fFeEgGaA", type) != NULL) {
+            union { uint32_t u; float f; } value = { .u = word };
+            written = snprintf(line + len, sizeof(line) - len, spec, (double)value.f);
+        } else if (strchr("di", type) != NULL) {
+            written = is_long ? snprintf(line + len, sizeof(line) - len, spec, (long)(int32_t)word) : snprintf(line + len, sizeof(line) - len, spec, (int)(int32_t)word);
+        } else {
+            written = is_long ? snprintf(line + len, sizeof(line) - len, spec, (unsigned long)word) : snprintf(line + len, sizeof(line) - len, spec, (unsigned int)word);
+        }
+
+        if (written < 0) break;
+        len += (size_t)written < sizeof(line) - len ? (size_t)written : sizeof(line) - 1 - len;
+    }
+
+    line[len] = '\0';
+    ESP_LOGI(TAG, "(%lu) %s", record->ut, line);
+}
+
+#endif
+
+static void dlog_task(void *arg) {
+    uint32_t reported_dropped = 0;
+
+    while (1) {
+        uint32_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+        uint32_t h = atomic_load_explicit(&head, memory_order_acquire);
+
+        while (t != h) {
+            dlog_emit(&ring[t & (DLOG_RING_SIZE - 1)]);
+            t++;
+
+            // hand the slot back only once it has been read
+            atomic_store_explicit(&tail, t, memory_order_release);
+        }
+
+        uint32_t now_dropped = dlog_get_dropped();
+        if (now_dropped != reported_dropped) {
+            dlog_record_t record = {
+                .id = DLOG_ID_DLOG_DROPPED,
+                .nargs = 1,
+                .ut = (uint32_t)(esp_timer_get_time() / 1000ULL),
+                .args = { now_dropped - reported_dropped },
+            };
+            dlog_emit(&record);
+            reported_dropped = now_dropped;
+        }
+
+        vTaskDelay(DLOG_FLUSH_INTERVAL);
+    }
+
+    vTaskDelete(NULL);
+}
+
+esp_err_t dlog_init(uart_port_t port, int core) {
+    dlog_port = port;
+
+#if DLOG_BINARY
+    // frames and console text share the port through the driver, one write at a time
+    if (!uart_is_driver_installed(port)) {
+        esp_err_t ret = uart_driver_install(port, 256, DLOG_UART_TX_BUFFER, 0, NULL, 0);
+        if (ret != ESP_OK) return ret;
+    }
+    uart_vfs_dev_use_driver(port);
+#endif
+
+    if (xTaskCreatePinnedToCore(dlog_task, "dlog", DLOG_TASK_STACK, NULL, DLOG_TASK_PRIORITY, NULL, core) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Deferred logging on core %d (%s)", core, DLOG_BINARY ? "binary frames" : "text");
+    return ESP_OK;
+}
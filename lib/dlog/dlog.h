@@ -0,0 +1,92 @@
+#ifndef __DLOG_H__
+#define __DLOG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+
+#include "dlog_formats.h"
+
+// 1: the formatter task writes binary frames for tools/LogDecoder, 0: it formats text on the device
+#ifndef DLOG_BINARY
+#define DLOG_BINARY 1
+#endif
+
+#define DLOG_SYNC 0xD10C
+#define DLOG_MAX_ARGS 8
+#define DLOG_RING_SIZE 64 // records, power of two
+
+typedef enum {
+#define DLOG_ID(name, nargs, fmt) DLOG_ID_##name,
+    DLOG_FORMATS(DLOG_ID)
+#undef DLOG_ID
+    DLOG_FORMAT_COUNT,
+} dlog_id_t;
+
+enum {
+#define DLOG_NARGS_OF(name, nargs, fmt) DLOG_NARGS_##name = nargs,
+    DLOG_FORMATS(DLOG_NARGS_OF)
+#undef DLOG_NARGS_OF
+};
+
+// binary frame: header, nargs little endian words, crc16 of both
+typedef struct __attribute__((packed)) {
+    uint16_t sync; // DLOG_SYNC
+    uint16_t id; // dlog_id_t
+    uint32_t ut; // ms
+    uint8_t nargs;
+} dlog_frame_header_t;
+
+/**
+ * @brief Starts the formatter task. Binary frames go out of port, which then carries the console too.
+ */
+esp_err_t dlog_init(uart_port_t port, int core);
+
+/**
+ * @brief Queues a record without formatting it. Lock-free, for a single producer task:
+ *        a full ring drops the record and counts it.
+ */
+bool dlog_write(dlog_id_t id, const uint32_t *args, uint32_t nargs);
+
+/**
+ * @brief Records dropped on a full ring since boot.
+ */
+uint32_t dlog_get_dropped(void);
+
+// arguments as 32 bit words, floats keep their bits
+static inline uint32_t dlog_float_word(float value) {
+    union { float f; uint32_t u; } word = { .f = value };
+    return word.u;
+}
+
+static inline uint32_t dlog_int_word(int32_t value) {
+    return (uint32_t)value;
+}
+
+#define DLOG_ARG(x) _Generic((x), float: dlog_float_word, double: dlog_float_word, default: dlog_int_word)(x)
+
+#define DLOG_COUNT(...) DLOG_COUNT_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define DLOG_COUNT_(a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+
+#define DLOG_MAP_1(x) DLOG_ARG(x)
+#define DLOG_MAP_2(x, ...) DLOG_ARG(x), DLOG_MAP_1(__VA_ARGS__)
+#define DLOG_MAP_3(x, ...) DLOG_ARG(x), DLOG_MAP_2(__VA_ARGS__)
+#define DLOG_MAP_4(x, ...) DLOG_ARG(x), DLOG_MAP_3(__VA_ARGS__)
+#define DLOG_MAP_5(x, ...) DLOG_ARG(x), DLOG_MAP_4(__VA_ARGS__)
+#define DLOG_MAP_6(x, ...) DLOG_ARG(x), DLOG_MAP_5(__VA_ARGS__)
+#define DLOG_MAP_7(x, ...) DLOG_ARG(x), DLOG_MAP_6(__VA_ARGS__)
+#define DLOG_MAP_8(x, ...) DLOG_ARG(x), DLOG_MAP_7(__VA_ARGS__)
+#define DLOG_MAP__(n, ...) DLOG_MAP_##n(__VA_ARGS__)
+#define DLOG_MAP_(n, ...) DLOG_MAP__(n, __VA_ARGS__)
+
+/**
+ * @brief Deferred log: DLOG(AVIONICS_STATE, a, b, ...) with a format from dlog_formats.h.
+ */
+#define DLOG(name, ...) do { \
+    _Static_assert(DLOG_COUNT(__VA_ARGS__) == DLOG_NARGS_##name, "wrong argument count for " #name); \
+    const uint32_t __dlog_args[] = { DLOG_MAP_(DLOG_COUNT(__VA_ARGS__), __VA_ARGS__) }; \
+    dlog_write(DLOG_ID_##name, __dlog_args, DLOG_COUNT(__VA_ARGS__)); \
+} while (0)
+
+#endif
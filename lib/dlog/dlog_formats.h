@@ -0,0 +1,14 @@
+#ifndef __DLOG_FORMATS_H__
+#define __DLOG_FORMATS_H__
+
+// X(name, argument count, printf format), the id of a format is its position: append only.
+// arguments are numbers, stored as 32 bit words (doubles as floats), never strings.
+// tools/LogDecoder reads this list to turn binary frames back into text
+#define DLOG_FORMATS(X) \
+    X(DLOG_DROPPED, 1, "dlog: %lu records dropped") \
+    X(AVIONICS_STATE, 8, "phase: %d, v_bat: %.2f, altitude: %.6f, pressure: %.2f, |accel|: %.2f, sats: %d, lat: %ld, lon: %ld") \
+    X(LOOP_TIMING, 5, "loop: %lu Hz, jitter %ld/%lu/%ld us (min/avg/max), %lu periods missed") \
+    X(LOOP_BUSY, 4, "loop: busy %lu/%lu/%lu us (mean/p99/max), slowest stage %d") \
+    X(IMU_STATS, 7, "imu: %lu samples in %lu batches (max %lu), %lu overflows, %lu dropped, %lu without INT, %lu read errors")
+
+#endif
@@ -0,0 +1,199 @@
+#include "flash_codec.h"
+
+#include <math.h>
+#include <string.h>
+
+enum {
+    FIELD_UT,
+    FIELD_ACCEL_X, FIELD_ACCEL_Y, FIELD_ACCEL_Z,
+    FIELD_ANG_VEL_X, FIELD_ANG_VEL_Y, FIELD_ANG_VEL_Z,
+    FIELD_PRESSURE,
+    FIELD_TEMPERATURE,
+    FIELD_LAT,
+    FIELD_LON,
+    FIELD_SATELLITES,
+    FIELD_V_BAT,
+    FIELD_PHASE,
+};
+
+_Static_assert(FIELD_PHASE + 1 == FLASH_CODEC_FIELDS, "codec fields out of sync");
+
+static inline int32_t quantize(float value, float scale) {
+    return (int32_t)lroundf(value * scale);
+}
+
+static inline uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static size_t put_varint(uint8_t *out, uint32_t value) {
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+
+    return n;
+}
+
+static esp_err_t get_varint(const uint8_t *in, size_t len, size_t *offset, uint32_t *value) {
+    *value = 0;
+
+    for (uint32_t shift = 0; shift < 35; shift += 7) {
+        if (*offset >= len) return ESP_ERR_INVALID_SIZE;
+
+        uint8_t byte = in[(*offset)++];
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0) return ESP_OK;
+    }
+
+    return ESP_ERR_INVALID_RESPONSE;
+}
+
+static void to_fields(const flash_payload_t *payload, int32_t *fields) {
+    fields[FIELD_UT] = (int32_t)payload->ut;
+    fields[FIELD_ACCEL_X] = payload->accel.x;
+    fields[FIELD_ACCEL_Y] = payload->accel.y;
+    fields[FIELD_ACCEL_Z] = payload->accel.z;
+    fields[FIELD_ANG_VEL_X] = payload->ang_vel.x;
+    fields[FIELD_ANG_VEL_Y] = payload->ang_vel.y;
+    fields[FIELD_ANG_VEL_Z] = payload->ang_vel.z;
+    fields[FIELD_PRESSURE] = quantize(payload->pressure, FLASH_CODEC_SCALE_PRESSURE);
+    fields[FIELD_TEMPERATURE] = quantize(payload->temperature, FLASH_CODEC_SCALE_TEMPERATURE);
+    fields[FIELD_LAT] = payload->lat_nmea;
+    fields[FIELD_LON] = payload->lon_nmea;
+    fields[FIELD_SATELLITES] = payload->satellites;
+    fields[FIELD_V_BAT] = quantize(payload->v_bat, FLASH_CODEC_SCALE_V_BAT);
+    fields[FIELD_PHASE] = payload->phase;
+}
+
+// accel and ang_vel fields are int16 counts from FLASH_RAW_IMU_VERSION on, see flash_codec_decode_legacy for older flights
+static void from_fields(const int32_t *fields, flash_payload_t *payload) {
+    payload->ut = (uint32_t)fields[FIELD_UT];
+    payload->accel.x = (int16_t)fields[FIELD_ACCEL_X];
+    payload->accel.y = (int16_t)fields[FIELD_ACCEL_Y];
+    payload->accel.z = (int16_t)fields[FIELD_ACCEL_Z];
+    payload->ang_vel.x = (int16_t)fields[FIELD_ANG_VEL_X];
+    payload->ang_vel.y = (int16_t)fields[FIELD_ANG_VEL_Y];
+    payload->ang_vel.z = (int16_t)fields[FIELD_ANG_VEL_Z];
+    payload->pressure = fields[FIELD_PRESSURE] / FLASH_CODEC_SCALE_PRESSURE;
+    payload->temperature = fields[FIELD_TEMPERATURE] / FLASH_CODEC_SCALE_TEMPERATURE;
+    payload->lat_nmea = fields[FIELD_LAT];
+    payload->lon_nmea = fields[FIELD_LON];
+    payload->satellites = (uint8_t)fields[FIELD_SATELLITES];
+    payload->v_bat = fields[FIELD_V_BAT] / FLASH_CODEC_SCALE_V_BAT;
+    payload->phase = (uint8_t)fields[FIELD_PHASE];
+}
+
+void flash_codec_reset(flash_codec_state_t *state) {
+    memset(state, 0, sizeof(flash_codec_state_t));
+}
+
+size_t flash_codec_encode(flash_codec_state_t *state, const flash_payload_t *payload, uint8_t *out) {
+    int32_t fields[FLASH_CODEC_FIELDS];
+    int32_t residuals[FLASH_CODEC_FIELDS];
+    uint16_t mask = 0;
+
+    to_fields(payload, fields);
+
+    for (uint32_t i = 0; i < FLASH_CODEC_FIELDS; i++) {
+        // wrapping arithmetic: deltas of any int32 pair round-trip
+        residuals[i] = (int32_t)((uint32_t)fields[i] - (uint32_t)state->last[i]);
+    }
+
+    // ut advances by a near constant step: store the change of the step, the key frame stores ut itself
+    if (state->samples > 0) {
+        int32_t ut_delta = residuals[FIELD_UT];
+        residuals[FIELD_UT] = (int32_t)((uint32_t)ut_delta - (uint32_t)state->last_ut_delta);
+        state->last_ut_delta = ut_delta;
+    }
+    state->samples++;
+
+    for (uint32_t i = 0; i < FLASH_CODEC_FIELDS; i++) {
+        if (residuals[i] != 0) mask |= 1 << i;
+        state->last[i] = fields[i];
+    }
+
+    size_t n = 0;
+    out[n++] = (uint8_t)mask;
+    out[n++] = (uint8_t)(mask >> 8);
+
+    for (uint32_t i = 0; i < FLASH_CODEC_FIELDS; i++) {
+        if (mask & (1 << i)) n += put_varint(out + n, zigzag(residuals[i]));
+    }
+
+    return n;
+}
+
+static esp_err_t decode_fields(flash_codec_state_t *state, const uint8_t *in, size_t len, size_t *used) {
+    if (len < 2) return ESP_ERR_INVALID_SIZE;
+
+    uint16_t mask = in[0] | (in[1] << 8);
+    size_t offset = 2;
+
+    for (uint32_t i = 0; i < FLASH_CODEC_FIELDS; i++) {
+        int32_t residual = 0;
+
+        if (mask & (1 << i)) {
+            uint32_t value;
+            esp_err_t ret = get_varint(in, len, &offset, &value);
+            if (ret != ESP_OK) return ret;
+
+            residual = unzigzag(value);
+        }
+
+        if (i == FIELD_UT && state->samples > 0) {
+            state->last_ut_delta = (int32_t)((uint32_t)state->last_ut_delta + (uint32_t)residual);
+            residual = state->last_ut_delta;
+        }
+
+        state->last[i] = (int32_t)((uint32_t)state->last[i] + (uint32_t)residual);
+    }
+
+    state->samples++;
+
+    *used = offset;
+    return ESP_OK;
+}
+
+esp_err_t flash_codec_decode(flash_codec_state_t *state, const uint8_t *in, size_t len, size_t *used, flash_payload_t *payload) {
+    esp_err_t ret = decode_fields(state, in, len, used);
+    if (ret != ESP_OK) return ret;
+
+    from_fields(state->last, payload);
+    return ESP_OK;
+}
+
+esp_err_t flash_codec_decode_legacy(flash_codec_state_t *state, const uint8_t *in, size_t len, size_t *used, flash_payload_t *payload) {
+    esp_err_t ret = decode_fields(state, in, len, used);
+    if (ret != ESP_OK) return ret;
+
+    const int32_t *fields = state->last;
+    from_fields(fields, payload);
+
+    payload->accel.x = flash_codec_to_count(fields[FIELD_ACCEL_X] / FLASH_CODEC_SCALE_ACCEL, FLASH_LEGACY_ACCEL_SCALE);
+    payload->accel.y = flash_codec_to_count(fields[FIELD_ACCEL_Y] / FLASH_CODEC_SCALE_ACCEL, FLASH_LEGACY_ACCEL_SCALE);
+    payload->accel.z = flash_codec_to_count(fields[FIELD_ACCEL_Z] / FLASH_CODEC_SCALE_ACCEL, FLASH_LEGACY_ACCEL_SCALE);
+    payload->ang_vel.x = flash_codec_to_count(fields[FIELD_ANG_VEL_X] / FLASH_CODEC_SCALE_ANG_VEL, FLASH_LEGACY_ANG_VEL_SCALE);
+    payload->ang_vel.y = flash_codec_to_count(fields[FIELD_ANG_VEL_Y] / FLASH_CODEC_SCALE_ANG_VEL, FLASH_LEGACY_ANG_VEL_SCALE);
+    payload->ang_vel.z = flash_codec_to_count(fields[FIELD_ANG_VEL_Z] / FLASH_CODEC_SCALE_ANG_VEL, FLASH_LEGACY_ANG_VEL_SCALE);
+
+    return ESP_OK;
+}
+
+int16_t flash_codec_to_count(float value, float scale) {
+    if (isnan(value)) return 0;
+
+    float count = roundf(value / scale);
+
+    if (count >= INT16_MAX) return INT16_MAX;
+    if (count <= INT16_MIN) return INT16_MIN;
+    return (int16_t)count;
+}
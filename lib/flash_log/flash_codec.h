@@ -0,0 +1,69 @@
+#ifndef __FLASH_CODEC_H__
+#define __FLASH_CODEC_H__
+
+#include <unistd.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "flash_log.h"
+
+#define FLASH_BLOCK_MAGIC 0x4642 // "FB"
+
+// fixed-point scales of the float payload fields, FLASH_CODEC_SCALE_<field>
+#define FLASH_CODEC_SCALE_PRESSURE 100.0f
+#define FLASH_CODEC_SCALE_TEMPERATURE 100.0f
+#define FLASH_CODEC_SCALE_V_BAT 1000.0f
+
+// accel and ang_vel are stored as raw counts since FLASH_RAW_IMU_VERSION, older flights used these scales
+#define FLASH_CODEC_SCALE_ACCEL 1000.0f
+#define FLASH_CODEC_SCALE_ANG_VEL 100.0f
+
+// flash_payload_t fields, in declaration order
+#define FLASH_CODEC_FIELDS 14
+
+// change mask + one varint per field
+#define FLASH_CODEC_MAX_SAMPLE_SIZE (2 + FLASH_CODEC_FIELDS * 5)
+
+// every page of a compressed flight holds one block, decodable on its own
+typedef struct __attribute__((packed)) {
+    uint16_t magic; // FLASH_BLOCK_MAGIC
+    uint16_t size; // encoded bytes after the block header
+    uint8_t count; // samples in the block
+    uint8_t reserved;
+    uint16_t crc; // crc16 of the encoded bytes, 0xFFFF once the page trailer covers them
+} flash_block_header_t;
+
+typedef struct {
+    int32_t last[FLASH_CODEC_FIELDS];
+    int32_t last_ut_delta;
+    uint32_t samples; // in the current block
+} flash_codec_state_t;
+
+/**
+ * @brief Starts a new block: the next sample is encoded against zero, as a key frame.
+ */
+void flash_codec_reset(flash_codec_state_t *state);
+
+/**
+ * @brief Encodes one sample as a change mask plus zigzag varint deltas.
+ * @return Bytes written to out, at most FLASH_CODEC_MAX_SAMPLE_SIZE.
+ */
+size_t flash_codec_encode(flash_codec_state_t *state, const flash_payload_t *payload, uint8_t *out);
+
+/**
+ * @brief Decodes one sample from at most len bytes of in.
+ */
+esp_err_t flash_codec_decode(flash_codec_state_t *state, const uint8_t *in, size_t len, size_t *used, flash_payload_t *payload);
+
+/**
+ * @brief Decodes one sample of a flight older than FLASH_RAW_IMU_VERSION, whose accel and ang_vel are in the
+ *        codec's fixed point, converting them to counts at FLASH_LEGACY_ACCEL_SCALE and FLASH_LEGACY_ANG_VEL_SCALE.
+ */
+esp_err_t flash_codec_decode_legacy(flash_codec_state_t *state, const uint8_t *in, size_t len, size_t *used, flash_payload_t *payload);
+
+/**
+ * @brief Converts a value to counts of scale, saturated to int16_t. NaN gives 0.
+ */
+int16_t flash_codec_to_count(float value, float scale);
+
+#endif
@@ -0,0 +1,284 @@
+#include "flash_dir.h"
+
+#include "esp_log.h"
+
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "crc.h"
+#include "w25q64.h"
+
+static const char *TAG = "flash_dir";
+
+#define FLASH_DIR_BASE 0x03 // first entry of a compacted half
+
+_Static_assert(sizeof(flash_dir_entry_t) == 32, "directory entries must tile pages");
+_Static_assert(W25Q64_READ_CHUNK_SIZE % sizeof(flash_dir_entry_t) == 0, "stream chunks must hold whole entries");
+
+static uint32_t dir_addr;
+static uint32_t active_half;
+static uint32_t write_idx; // next free entry in the active half
+static uint32_t next_seq;
+static uint32_t next_flight_number;
+
+// ring of cached flights, oldest first
+static flash_dir_entry_t cache[FLASH_DIR_MAX_FLIGHTS];
+static uint32_t cache_first;
+static uint32_t cache_count;
+
+static inline uint32_t half_addr(uint32_t half) {
+    return dir_addr + half * FLASH_DIR_HALF_SIZE;
+}
+
+static inline flash_dir_entry_t *cache_at(uint32_t idx) {
+    return &cache[(cache_first + idx) % FLASH_DIR_MAX_FLIGHTS];
+}
+
+static void cache_pop_oldest(void) {
+    cache_first = (cache_first + 1) % FLASH_DIR_MAX_FLIGHTS;
+    cache_count--;
+}
+
+static flash_dir_entry_t *cache_find(uint32_t flight_number) {
+    if (cache_count == 0) return NULL;
+
+    // flight numbers are consecutive unless a flight was lost, so this almost always hits
+    uint32_t idx = flight_number - cache_at(0)->flight_number;
+    if (idx < cache_count && cache_at(idx)->flight_number == flight_number) return cache_at(idx);
+
+    for (uint32_t i = 0; i < cache_count; i++) {
+        if (cache_at(i)->flight_number == flight_number) return cache_at(i);
+    }
+
+    return NULL;
+}
+
+static void cache_apply(const flash_dir_entry_t *entry) {
+    if (entry->status == FLASH_DIR_BASE) {
+        // everything older than the base was dropped before the half was compacted
+        while (cache_count > 0 && cache_at(0)->flight_number < entry->flight_number) cache_pop_oldest();
+        if (entry->flight_number > next_flight_number) next_flight_number = entry->flight_number;
+        return;
+    }
+
+    if (entry->flight_number >= next_flight_number) next_flight_number = entry->flight_number + 1;
+
+    if (entry->status == FLASH_DIR_RECLAIMED) {
+        while (cache_count > 0 && cache_at(0)->flight_number <= entry->flight_number) cache_pop_oldest();
+        return;
+    }
+
+    flash_dir_entry_t *cached = cache_find(entry->flight_number);
+    if (cached != NULL) {
+        *cached = *entry;
+        return;
+    }
+
+    // stale entry for a flight that was already dropped
+    if (cache_count > 0 && entry->flight_number < cache_at(cache_count - 1)->flight_number) return;
+
+    if (cache_count == FLASH_DIR_MAX_FLIGHTS) {
+        // flash_log reclaims before this, only a directory written without that limit gets here
+        ESP_LOGW(TAG, "Cache full, forgetting flight %" PRIu32, cache_at(0)->flight_number);
+        cache_pop_oldest();
+    }
+
+    *cache_at(cache_count) = *entry;
+    cache_count++;
+}
+
+static inline uint16_t entry_crc(const flash_dir_entry_t *entry) {
+    return crc16((const uint8_t *)entry, offsetof(flash_dir_entry_t, crc));
+}
+
+static bool entry_is_blank(const flash_dir_entry_t *entry) {
+    const uint8_t *p = (const uint8_t *)entry;
+
+    for (size_t i = 0; i < sizeof(flash_dir_entry_t); i++) {
+        if (p[i] != 0xFF) return false;
+    }
+
+    return true;
+}
+
+static inline bool entry_is_valid(const flash_dir_entry_t *entry) {
+    return entry->magic == FLASH_DIR_MAGIC && entry->crc == entry_crc(entry);
+}
+
+static esp_err_t read_base(uint32_t half, flash_dir_entry_t *base) {
+    if (w25q64_read_data(half_addr(half), (uint8_t *)base, sizeof(*base)) != ESP_OK) return ESP_FAIL;
+
+    if (!entry_is_valid(base) || base->status != FLASH_DIR_BASE) return ESP_ERR_NOT_FOUND;
+
+    return ESP_OK;
+}
+
+typedef struct {
+    uint32_t idx;
+    uint32_t end_idx; // past the last written entry
+} half_scan_t;
+
+static bool apply_entries(uint32_t address, const uint8_t *data, size_t size, void *ctx) {
+    half_scan_t *scan = ctx;
+
+    for (size_t offset = 0; offset < size; offset += sizeof(flash_dir_entry_t)) {
+        flash_dir_entry_t entry;
+        memcpy(&entry, data + offset, sizeof(entry));
+
+        // entries are appended in order: the first blank one ends the half
+        if (entry_is_blank(&entry)) return false;
+
+        scan->idx++;
+        scan->end_idx = scan->idx;
+
+        // torn by a power loss, the slot stays used
+        if (!entry_is_valid(&entry)) continue;
+
+        cache_apply(&entry);
+        if (entry.seq >= next_seq) next_seq = entry.seq + 1;
+    }
+
+    return true;
+}
+
+static esp_err_t load_half(uint32_t half, uint32_t *end_idx) {
+    half_scan_t scan = { 0 };
+
+    if (w25q64_read_stream_cb(half_addr(half), FLASH_DIR_HALF_SIZE, apply_entries, &scan) != ESP_OK) return ESP_FAIL;
+
+    *end_idx = scan.end_idx;
+    return ESP_OK;
+}
+
+static esp_err_t write_entry(flash_dir_entry_t *entry) {
+    entry->magic = FLASH_DIR_MAGIC;
+    entry->seq = next_seq++;
+    entry->reserved = 0xFFFF;
+    entry->crc = entry_crc(entry);
+
+    esp_err_t ret = w25q64_write_data(half_addr(active_half) + write_idx * sizeof(flash_dir_entry_t), (uint8_t *)entry, sizeof(*entry));
+
+    // a failed slot is skipped, never rewritten
+    write_idx++;
+
+    return ret;
+}
+
+esp_err_t flash_dir_load(uint32_t addr) {
+    flash_dir_entry_t base[2];
+    bool valid[2];
+
+    dir_addr = addr;
+    cache_first = 0;
+    cache_count = 0;
+    next_seq = 0;
+    next_flight_number = 1;
+
+    for (uint32_t half = 0; half < 2; half++) {
+        esp_err_t ret = read_base(half, &base[half]);
+        if (ret == ESP_FAIL) return ESP_FAIL;
+
+        valid[half] = ret == ESP_OK;
+    }
+
+    if (!valid[0] && !valid[1]) {
+        // nothing to load, the next put compacts into half 0
+        active_half = 1;
+        write_idx = FLASH_DIR_ENTRIES_PER_HALF;
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    active_half = (valid[0] && (!valid[1] || base[0].seq > base[1].seq)) ? 0 : 1;
+
+    uint32_t end_idx;
+
+    // a compaction interrupted by a power loss leaves the newest half short: replay the older one first
+    uint32_t other_half = 1 - active_half;
+    if (valid[other_half] && load_half(other_half, &end_idx) != ESP_OK) return ESP_FAIL;
+
+    if (load_half(active_half, &end_idx) != ESP_OK) return ESP_FAIL;
+    write_idx = end_idx;
+
+    ESP_LOGI(TAG, "Loaded %" PRIu32 " flights from half %" PRIu32 " (%" PRIu32 " entries used)", cache_count, active_half, write_idx);
+
+    return ESP_OK;
+}
+
+static esp_err_t flash_dir_compact(void) {
+    uint32_t target_half = 1 - active_half;
+
+    for (uint32_t offset = 0; offset < FLASH_DIR_HALF_SIZE; offset += W25Q64_SECTOR_SIZE) {
+        if (w25q64_erase_sector(half_addr(target_half) + offset) != ESP_OK) return ESP_FAIL;
+    }
+
+    active_half = target_half;
+    write_idx = 0;
+
+    flash_dir_entry_t base;
+    memset(&base, 0xFF, sizeof(base));
+    base.status = FLASH_DIR_BASE;
+    base.flight_number = cache_count > 0 ? cache_at(0)->flight_number : next_flight_number;
+
+    if (write_entry(&base) != ESP_OK) return ESP_FAIL;
+
+    for (uint32_t i = 0; i < cache_count; i++) {
+        flash_dir_entry_t entry = *cache_at(i);
+
+        if (write_entry(&entry) != ESP_OK) return ESP_FAIL;
+        *cache_at(i) = entry;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t flash_dir_put(flash_dir_entry_t *entry) {
+    cache_apply(entry);
+
+    // the compacted half already holds the new state
+    if (write_idx >= FLASH_DIR_ENTRIES_PER_HALF) return flash_dir_compact();
+
+    return write_entry(entry);
+}
+
+esp_err_t flash_dir_drop_oldest(void) {
+    if (cache_count == 0) return ESP_OK;
+
+    flash_dir_entry_t entry = *cache_at(0);
+    entry.status = FLASH_DIR_RECLAIMED;
+
+    return flash_dir_put(&entry);
+}
+
+esp_err_t flash_dir_reset(void) {
+    for (uint32_t offset = 0; offset < FLASH_DIR_HALF_SIZE; offset += W25Q64_SECTOR_SIZE) {
+        if (w25q64_erase_sector(half_addr(1) + offset) != ESP_OK) return ESP_FAIL;
+    }
+
+    cache_first = 0;
+    cache_count = 0;
+    next_seq = 0;
+    next_flight_number = 1;
+
+    // leave a valid empty directory behind, compacted into half 0
+    active_half = 1;
+
+    return flash_dir_compact();
+}
+
+uint32_t flash_dir_count(void) {
+    return cache_count;
+}
+
+uint32_t flash_dir_next_flight_number(void) {
+    return next_flight_number;
+}
+
+const flash_dir_entry_t* flash_dir_at(uint32_t idx) {
+    if (idx >= cache_count) return NULL;
+    return cache_at(idx);
+}
+
+const flash_dir_entry_t* flash_dir_find(uint32_t flight_number) {
+    return cache_find(flight_number);
+}
@@ -0,0 +1,82 @@
+#ifndef __FLASH_DIR_H__
+#define __FLASH_DIR_H__
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define FLASH_DIR_MAGIC 0x4644 // "FD"
+
+// the directory is two halves at the end of the chip, written alternately
+#define FLASH_DIR_HALF_SIZE (2 * 4096)
+#define FLASH_DIR_SIZE (2 * FLASH_DIR_HALF_SIZE)
+
+// flights kept in the RAM cache, half a directory half so a compaction leaves room to append;
+// flash_log reclaims the oldest flight before starting one more
+#define FLASH_DIR_MAX_FLIGHTS (FLASH_DIR_ENTRIES_PER_HALF / 2)
+
+#define FLASH_DIR_IN_PROGRESS 0x01
+#define FLASH_DIR_COMPLETED 0x00
+#define FLASH_DIR_RECLAIMED 0x02
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic; // FLASH_DIR_MAGIC
+    uint8_t status; // FLASH_DIR_*
+    uint8_t format_version;
+    uint32_t seq; // later entries for the same flight win
+
+    uint32_t flight_number;
+    uint32_t header_addr;
+    uint32_t end_addr; // next_header_addr, 0xFFFFFFFF while in progress
+
+    // summary
+    uint32_t duration; // ms
+    uint32_t timestamp;
+
+    uint16_t reserved;
+    uint16_t crc; // crc16 of the bytes above
+} flash_dir_entry_t;
+
+#define FLASH_DIR_ENTRIES_PER_HALF (FLASH_DIR_HALF_SIZE / sizeof(flash_dir_entry_t))
+
+/**
+ * @brief Loads the newest directory half into the RAM cache.
+ * @return ESP_ERR_NOT_FOUND if neither half holds a valid entry.
+ */
+esp_err_t flash_dir_load(uint32_t dir_addr);
+
+/**
+ * @brief Appends the entry and updates the cache, compacting into the other half when full.
+ *        Flight numbers must not go backwards.
+ */
+esp_err_t flash_dir_put(flash_dir_entry_t *entry);
+
+/**
+ * @brief Drops the oldest flight from the directory.
+ */
+esp_err_t flash_dir_drop_oldest(void);
+
+/**
+ * @brief Empties the directory, leaving a valid empty half behind.
+ */
+esp_err_t flash_dir_reset(void);
+
+uint32_t flash_dir_count(void);
+
+/**
+ * @brief Number for the next flight, never reused while the directory lives.
+ */
+uint32_t flash_dir_next_flight_number(void);
+
+/**
+ * @brief Cached flight by age, 0 is the oldest.
+ */
+const flash_dir_entry_t* flash_dir_at(uint32_t idx);
+
+/**
+ * @brief Cached flight by number in constant time, NULL if unknown.
+ */
+const flash_dir_entry_t* flash_dir_find(uint32_t flight_number);
+
+#endif
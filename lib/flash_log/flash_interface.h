@@ -4,6 +4,15 @@
 #include <stdint.h>
 
 #define FLASH_USB_MAGIC 0x46555342 // "FUSB"
+#define FLASH_BULK_MAGIC 0x46424C4B // "FBLK"
+#define FLASH_PROGRESS_MAGIC 0x4650524F // "FPRO"
+#define FLASH_BULK_STATS_MAGIC 0x46425354 // "FBST"
+
+// bulk transfers: chunks in flight before an acknowledgement is required
+#define FLASH_BULK_CHUNK_SIZE 2048
+#define FLASH_BULK_WINDOW 4
+
+#define FLASH_USB_MAX_BAUD 3000000
 
 const uint32_t flash_ack  = 0x4641434B; // "FACK"
 const uint32_t flash_nack = 0x4E41434B; // "NACK"
@@ -14,6 +23,48 @@ typedef enum {
     CMD_LIST_HEADERS,
     CMD_READ_HEADER,
     CMD_READ_FLIGHT,
+    CMD_SET_BAUD, // baud = param, confirmed by a CMD_ACK at the new rate
+    CMD_BULK_READ_FLIGHT, // flight_number = param
+    CMD_BULK_ACK, // next expected chunk seq = param
+    CMD_GET_FLIGHT_RANGE, // flight_number = param, answered with a flash_flight_range_t
+    CMD_READ_RANGE, // followed by a flash_range_t, answered in bulk frames
+    CMD_DUMP_CHIP, // whole chip image, answered in bulk frames
+    CMD_BULK_READ_FLIGHT_COMPRESSED, // flight_number = param, each chunk is a run of flash_codec samples from a key frame, flash_bulk_stats_t before the ACK
 } flash_cmd_t;
 
+// streamed while a long command runs, before its ACK
+typedef struct __attribute__((packed)) {
+    uint32_t magic; // FLASH_PROGRESS_MAGIC
+    uint32_t done;
+    uint32_t total;
+} flash_progress_t;
+
+// cost of a compressed download, sent once its last chunk is acknowledged, before the ACK
+typedef struct __attribute__((packed)) {
+    uint32_t magic; // FLASH_BULK_STATS_MAGIC
+    uint32_t raw_bytes; // flash_packet_t bytes encoded
+    uint32_t wire_bytes;
+    uint32_t encode_us;
+    uint32_t chunks;
+} flash_bulk_stats_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t addr;
+    uint32_t size;
+} flash_range_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t header_addr;
+    uint32_t size; // header included
+    uint32_t log_start; // the flight continues here past log_end
+    uint32_t log_end;
+} flash_flight_range_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic; // FLASH_BULK_MAGIC
+    uint32_t seq;
+    uint16_t size; // payload bytes, 0 ends the transfer
+    uint16_t crc; // crc16 of the payload
+} flash_bulk_frame_t;
+
 #endif
\ No newline at end of file
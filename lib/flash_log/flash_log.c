@@ -2,20 +2,41 @@
 
 #include "esp_log.h"
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
+#include <math.h>
 #include <stdint.h>
 #include <inttypes.h>
 
 #include "w25q64.h"
+#include "flash_dir.h"
+#include "flash_codec.h"
+#include "crc.h"
 
 static const char *TAG = "flash_log";
 
+_Static_assert(sizeof(flash_header_t) <= FLASH_PAGE_SIZE, "the header owns the first page of a flight");
+
 static bool initialized = false;
 static bool writting = false;
 static bool has_gps_data = false;
 
-static flash_packet_t page_buffer[PACKETS_PER_PAGE];
-static uint32_t buffer_offset;
+// serializes the logger state between the avionics and flash tasks
+static SemaphoreHandle_t log_lock;
+
+#define PAGE_BUFFERS 2
+#define FLUSH_TIMEOUT pdMS_TO_TICKS(1000)
+
+// ping-pong page buffers: one is filled while the other is being programmed
+static uint8_t page_buffer[PAGE_BUFFERS][FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+static uint32_t active_buffer;
+static uint32_t buffer_offset; // bytes, past the block header
+static uint32_t block_count; // samples in the active block
+static uint32_t page_seq; // pages queued in the current flight
+static flash_codec_state_t codec;
+static SemaphoreHandle_t free_buffers;
+static volatile uint32_t write_errors;
 
 static flash_header_t last_header;
 
@@ -24,8 +45,124 @@ static uint32_t current_header_addr;
 
 static uint32_t current_packet_addr;
 
+static uint32_t page_programs_start;
+
+// summary of the current flight, copied into its header when it finishes:
+// the header is already programmed, so its summary bytes must stay erased until then
+static struct {
+    uint32_t samples;
+    float ground_pressure;
+    float min_pressure;
+    uint32_t max_accel_sq; // counts
+    float min_v_bat;
+    uint32_t phase_ut[FLASH_SUMMARY_PHASES];
+} summary;
+
+// the log is a ring over [log_start, log_end): the oldest flights are reclaimed when it fills up
+// the flight directory sits right after it, at the end of the chip: log_end follows the discovered capacity
+static uint32_t log_start = 0;
+static uint32_t log_end;
+
+// sectors from the frontier up to erased_until are known to be erased
+static uint32_t erased_until;
+static uint32_t overrun_pages;
+
+static uint32_t samples_appended;
+
+static float imu_accel_scale = NAN;
+static float imu_ang_vel_scale = NAN;
+
+// logging rate policy by flight phase: full rate around liftoff and apogee, 1 Hz under the parachute
+static const uint16_t phase_interval_ms[FLASH_SUMMARY_PHASES] = {
+    1000, // standby
+    0,    // pre-flight, held in the history
+    0,    // ascent
+    0,    // parachute deploy
+    1000, // descent
+    1000, // shutdown
+    1000,
+    1000,
+};
+
+// pre-trigger history: full-rate samples kept in RAM on the pad, appended once the flight starts
+static flash_payload_t history[FLASH_HISTORY_SAMPLES];
+static uint32_t history_first;
+static uint32_t history_count;
+static portMUX_TYPE history_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t pages_queued;
+static uint32_t bytes_queued;
+
+// flight reads go through one large streaming read instead of one transaction per packet
+#define READ_WINDOW_SIZE W25Q64_READ_CHUNK_SIZE
+
+static uint8_t read_window[READ_WINDOW_SIZE] __attribute__((aligned(4)));
+static uint32_t read_window_addr;
+static bool read_window_valid = false;
+
+static inline uint32_t page_align(uint32_t addr) {
+    return (addr + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+}
+
+static inline uint32_t sector_align(uint32_t addr) {
+    return (addr + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+}
+
+static inline uint32_t ring_wrap(uint32_t addr) {
+    return addr >= log_end ? log_start + (addr - log_end) : addr;
+}
+
+// bytes from one ring address to another, going forward
+static inline uint32_t ring_distance(uint32_t from, uint32_t to) {
+    return to >= from ? to - from : (log_end - from) + (to - log_start);
+}
+
+static inline bool has_flights(void) {
+    return flash_dir_count() > 0;
+}
+
+// header of the oldest flight
+static inline uint32_t tail_addr(void) {
+    return flash_dir_at(0)->header_addr;
+}
+
+static inline void lock_take(void) {
+    xSemaphoreTakeRecursive(log_lock, portMAX_DELAY);
+}
+
+static inline void lock_give(void) {
+    xSemaphoreGiveRecursive(log_lock);
+}
+
+// address where the next log data goes
+static uint32_t frontier(void) {
+    if (writting) return current_packet_addr;
+
+    // flights start on a sector boundary so reclaiming one never touches its neighbours
+    return ring_wrap(sector_align(last_header.next_header_addr));
+}
+
+static inline void window_reset(void) {
+    read_window_valid = false;
+}
+
+// returns size bytes at addr from the read window, refilling it when they fall outside
+static const uint8_t *window_read(uint32_t addr, size_t size) {
+    if (size > READ_WINDOW_SIZE) return NULL;
 
-static bool packet_is_empty(uint8_t *pkt, uint32_t len) {
+    if (!read_window_valid || addr < read_window_addr || addr + size > read_window_addr + READ_WINDOW_SIZE) {
+        if (w25q64_read_stream(addr, read_window, READ_WINDOW_SIZE) != ESP_OK) {
+            read_window_valid = false;
+            return NULL;
+        }
+
+        read_window_addr = addr;
+        read_window_valid = true;
+    }
+
+    return read_window + (addr - read_window_addr);
+}
+
+static bool packet_is_empty(const uint8_t *pkt, uint32_t len) {
     const uint8_t *p = (const uint8_t *)pkt;
 
     for (size_t i = 0; i < len; i++) {
@@ -37,263 +174,828 @@ static bool packet_is_empty(uint8_t *pkt, uint32_t len) {
     return true;
 }
 
+static void page_written(const uint8_t *page, esp_err_t result, void *ctx) {
+    if (result != ESP_OK) write_errors++;
+
+    xSemaphoreGive(free_buffers);
+}
+
+static inline void block_reset(void) {
+    // the whole page is programmed, trailer included
+    memset(page_buffer[active_buffer], 0xFF, FLASH_PAGE_SIZE);
+    buffer_offset = sizeof(flash_block_header_t);
+    block_count = 0;
+
+    // every block starts from a key frame so it decodes on its own
+    flash_codec_reset(&codec);
+}
+
 static esp_err_t flush_buffer(void) {
-    if (buffer_offset == 0) return ESP_OK;
+    if (block_count == 0) return ESP_OK;
 
-    uint32_t bytes_to_write = buffer_offset * sizeof(flash_packet_t);
+    if (ring_distance(current_packet_addr, erased_until) < FLASH_PAGE_SIZE) {
+        // ran out of pre-erased sectors: drop the page instead of programming dirty flash
+        overrun_pages++;
+        block_reset();
+        return ESP_ERR_NO_MEM;
+    }
 
-    esp_err_t ret = w25q64_write_data(current_packet_addr, (uint8_t *)page_buffer, bytes_to_write);
+    uint8_t *page = page_buffer[active_buffer];
+    flash_block_header_t block = {
+        .magic = FLASH_BLOCK_MAGIC,
+        .size = buffer_offset - sizeof(flash_block_header_t),
+        .count = block_count,
+        .reserved = 0xFF,
+        .crc = 0xFFFF,
+    };
+    memcpy(page, &block, sizeof(block));
+
+    flash_page_trailer_t trailer = {
+        .seq = page_seq,
+        .flight = (uint16_t)current_header.flight_number,
+    };
+    memcpy(page + FLASH_PAGE_DATA_SIZE, &trailer, sizeof(trailer));
+
+    trailer.crc = crc16(page, FLASH_PAGE_SIZE - sizeof(trailer.crc));
+    memcpy(page + FLASH_PAGE_SIZE - sizeof(trailer.crc), &trailer.crc, sizeof(trailer.crc));
+
+    // current_packet_addr is page aligned: one flush = one page program
+    esp_err_t ret = w25q64_async_write_page(current_packet_addr, page, FLASH_PAGE_SIZE, FLUSH_TIMEOUT);
+
+    if (ret == ESP_OK) {
+        current_packet_addr = ring_wrap(current_packet_addr + FLASH_PAGE_SIZE);
+        page_seq++;
+        pages_queued++;
+        bytes_queued += FLASH_PAGE_SIZE;
+    } else {
+        // never queued, no completion will release it
+        xSemaphoreGive(free_buffers);
+    }
 
-    if (ret == ESP_OK) current_packet_addr += bytes_to_write;
+    // switch buffers, waiting only if the previous page is still being programmed
+    active_buffer = (active_buffer + 1) % PAGE_BUFFERS;
+    xSemaphoreTake(free_buffers, portMAX_DELAY);
 
-    buffer_offset = 0;
+    block_reset();
 
     return ret;
 }
 
-static esp_err_t solve_corrupted_log(flash_header_t *corrupted_header, uint32_t corrupted_header_addr) {
-    if (corrupted_header->status == 0x00 || corrupted_header->next_header_addr != 0xFFFFFFFF) return ESP_OK;
+static void summary_reset(void) {
+    summary.samples = 0;
+    summary.max_accel_sq = 0;
+    summary.min_v_bat = INFINITY;
 
-    if (corrupted_header->header_size != sizeof(flash_header_t)) {
-        ESP_LOGW(TAG, "treating a log with different header size than current: %d vs %d", corrupted_header->header_size, sizeof(flash_header_t));
+    for (uint32_t i = 0; i < FLASH_SUMMARY_PHASES; i++) summary.phase_ut[i] = 0xFFFFFFFF;
+}
+
+static void summary_update(const flash_payload_t *payload) {
+    // altitude is relative to the first sample, logged on the pad
+    if (summary.samples == 0) {
+        summary.ground_pressure = payload->pressure;
+        summary.min_pressure = payload->pressure;
+    } else if (payload->pressure < summary.min_pressure) {
+        summary.min_pressure = payload->pressure;
     }
 
-    uint8_t *packet = (uint8_t *)malloc(corrupted_header->packet_size);
-    uint32_t packet_addr = corrupted_header_addr + corrupted_header->header_size;
+    summary.samples++;
 
-    while (1) {
-        if (w25q64_read_data(packet_addr, packet, corrupted_header->packet_size) != ESP_OK) {
-            free(packet);
-            return ESP_FAIL;
+    // 3 * 32768^2 still fits in 32 bits
+    int32_t x = payload->accel.x, y = payload->accel.y, z = payload->accel.z;
+    uint32_t accel_sq = (uint32_t)(x*x) + (uint32_t)(y*y) + (uint32_t)(z*z);
+    if (accel_sq > summary.max_accel_sq) summary.max_accel_sq = accel_sq;
+
+    if (payload->v_bat < summary.min_v_bat) summary.min_v_bat = payload->v_bat;
+
+    if (payload->phase < FLASH_SUMMARY_PHASES && summary.phase_ut[payload->phase] == 0xFFFFFFFF) {
+        summary.phase_ut[payload->phase] = payload->ut;
+    }
+}
+
+static void summary_to_header(flash_header_t *header) {
+    header->samples = summary.samples;
+    header->max_accel = sqrtf((float)summary.max_accel_sq) * header->accel_scale;
+    header->min_v_bat = summary.samples > 0 ? summary.min_v_bat : 0.0f;
+
+    // altitude only grows as pressure drops: the lowest pressure gives the apogee
+    header->max_altitude = 0.0f;
+    if (summary.samples > 0 && summary.ground_pressure > 0.0f) {
+        header->max_altitude = 44330.f*(1.f - powf(summary.min_pressure/summary.ground_pressure, .1903f));
+    }
+
+    memcpy(header->phase_ut, summary.phase_ut, sizeof(header->phase_ut));
+}
+
+static esp_err_t read_header(uint32_t *header_addr, flash_header_t *header) {
+    // a flight following an older format log starts on the next page or sector boundary
+    const uint32_t candidates[] = { *header_addr, page_align(*header_addr), sector_align(*header_addr) };
+
+    for (uint32_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        if (i > 0 && candidates[i] == candidates[i - 1]) continue;
+
+        uint32_t addr = ring_wrap(candidates[i]);
+
+        if (w25q64_read_data(addr, (uint8_t *)header, sizeof(flash_header_t)) != ESP_OK) return ESP_FAIL;
+        if (header->magic != FLASH_HEADER_MAGIC) continue;
+
+        if (header->header_size < sizeof(flash_header_t)) {
+            // older format: fields past header_size belong to the first packet
+            memset((uint8_t *)header + header->header_size, 0xFF, sizeof(flash_header_t) - header->header_size);
         }
 
-        if (packet_is_empty(packet, corrupted_header->packet_size)) {
-            free(packet);
-            corrupted_header->next_header_addr = packet_addr;
-            if (w25q64_write_data(corrupted_header_addr + offsetof(flash_header_t, next_header_addr), (uint8_t *)&packet_addr, sizeof(packet_addr)) != ESP_OK) return ESP_FAIL;
-            return ESP_OK;
+        if (header->format_version < FLASH_RAW_IMU_VERSION) {
+            // what flash_log_for_each_packet converts its accel and ang_vel to
+            header->accel_scale = FLASH_LEGACY_ACCEL_SCALE;
+            header->ang_vel_scale = FLASH_LEGACY_ANG_VEL_SCALE;
         }
 
-        packet_addr += corrupted_header->packet_size;
+        *header_addr = addr;
+        return ESP_OK;
     }
+
+    return ESP_ERR_NOT_FOUND;
 }
 
-static esp_err_t get_last_header(flash_header_t *last_header) {
-    flash_header_t search_header;
-    search_header.next_header_addr = 0;
+typedef struct {
+    uint32_t addr;
+    uint32_t flight_number;
+    bool started;
+    bool done;
+} flight_iter_t;
+
+static void flight_iter_init(flight_iter_t *iter, uint32_t addr, bool found) {
+    iter->addr = addr;
+    iter->flight_number = 0;
+    iter->started = false;
+    iter->done = !found;
+}
 
-    // initial values
-    memset(last_header, 0xFF, sizeof(flash_header_t));
-    last_header->next_header_addr = 0;
-    last_header->flight_number = 0;
+// walks the flights from the oldest one, stopping at the first gap or when flight numbers stop increasing
+static esp_err_t flight_iter_next(flight_iter_t *iter, flash_header_t *header, uint32_t *header_addr) {
+    if (iter->done) return ESP_ERR_NOT_FOUND;
 
-    while (1) {
-        uint32_t prev_header_addr = search_header.next_header_addr;
+    esp_err_t ret = read_header(&iter->addr, header);
+    if (ret == ESP_OK && iter->started && header->flight_number <= iter->flight_number) ret = ESP_ERR_NOT_FOUND;
 
-        if (w25q64_read_data(search_header.next_header_addr, (uint8_t *)&search_header, sizeof(flash_header_t)) != ESP_OK) return ESP_FAIL;
+    if (ret != ESP_OK) {
+        iter->done = true;
+        return ret;
+    }
+
+    *header_addr = iter->addr;
+    iter->flight_number = header->flight_number;
+    iter->started = true;
 
-        if (search_header.magic == FLASH_HEADER_MAGIC) {
-            if (search_header.status != 0x00 && search_header.next_header_addr == 0xFFFFFFFF) {
-                // corrupted flight log
-                ESP_LOGI(TAG, "Corrupted log found, solving...");
+    if (header->next_header_addr == 0xFFFFFFFF) {
+        // an unfinished flight is always the newest one
+        iter->done = true;
+    } else {
+        iter->addr = ring_wrap(header->next_header_addr);
+    }
 
-                if (solve_corrupted_log(&search_header, prev_header_addr) != ESP_OK) return ESP_FAIL;
+    return ESP_OK;
+}
 
-                *last_header = search_header;
+// the oldest flight is the lowest numbered header found on a sector boundary
+static esp_err_t find_tail(uint32_t *tail, bool *found) {
+    flash_header_t header;
+    uint32_t tail_flight_number = 0;
 
-                return ESP_OK;
-            } else {
-                // not corrupted flight log
-            }
+    *found = false;
+
+    for (uint32_t addr = log_start; addr < log_end; addr += FLASH_SECTOR_SIZE) {
+        if (w25q64_read_data(addr, (uint8_t *)&header, offsetof(flash_header_t, duration)) != ESP_OK) return ESP_FAIL;
+
+        if (header.magic != FLASH_HEADER_MAGIC) continue;
+
+        if (!*found || header.flight_number < tail_flight_number) {
+            *tail = addr;
+            tail_flight_number = header.flight_number;
+            *found = true;
+        }
+    }
+
+    return ESP_OK;
+}
+
+static bool page_trailer_valid(const uint8_t *page, uint32_t flight_number, uint32_t seq) {
+    flash_page_trailer_t trailer;
+    memcpy(&trailer, page + FLASH_PAGE_DATA_SIZE, sizeof(trailer));
+
+    return trailer.seq == seq &&
+        trailer.flight == (uint16_t)flight_number &&
+        trailer.crc == crc16(page, FLASH_PAGE_SIZE - sizeof(trailer.crc));
+}
+
+// the first bytes of a programmed page are never blank: v5 pages start with a packet magic, v6 with a block header
+#define PAGE_PROBE_SIZE 8
+
+// a programmed page left by an older flight: another format's layout, or a valid trailer that is not this page's
+static bool page_is_stale(const uint8_t *page, uint32_t flight_number, uint32_t seq) {
+    flash_block_header_t block;
+    memcpy(&block, page, sizeof(block));
+
+    // the trailer covers the block from FLASH_PAGE_TRAILER_VERSION on, its own crc stays blank
+    if (block.magic != FLASH_BLOCK_MAGIC || block.crc != 0xFFFF) return true;
+
+    flash_page_trailer_t trailer;
+    memcpy(&trailer, page + FLASH_PAGE_DATA_SIZE, sizeof(trailer));
+
+    if (trailer.crc != crc16(page, FLASH_PAGE_SIZE - sizeof(trailer.crc))) return false;
+
+    return trailer.seq != seq || trailer.flight != (uint16_t)flight_number;
+}
+
+// whether the page at index seq of the flight was programmed by it
+static esp_err_t page_is_written(const flash_header_t *header, uint32_t page_addr, uint32_t seq, bool *written) {
+    static uint8_t page[FLASH_PAGE_SIZE];
+
+    bool trailer = header->format_version >= FLASH_PAGE_TRAILER_VERSION;
+    if (w25q64_read_data(page_addr, page, trailer ? FLASH_PAGE_SIZE : PAGE_PROBE_SIZE) != ESP_OK) return ESP_FAIL;
+
+    // programmed vs blank keeps the search monotonic: a page that fails its trailer crc mid-flight
+    // (a failed program) still counts, the trailer only tells stale pages past the end apart
+    *written = !packet_is_empty(page, PAGE_PROBE_SIZE) && !(trailer && page_is_stale(page, header->flight_number, seq));
+    return ESP_OK;
+}
+
+// pages are programmed in order, so the written ones are a prefix of the flight:
+// binary search for the first page past it, one read per step
+static esp_err_t find_first_blank_page(const flash_header_t *header, uint32_t first_page_addr, uint32_t max_pages, uint32_t *blank_page_addr) {
+    uint32_t lo = 0;
+    uint32_t hi = max_pages;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        bool written;
+
+        if (page_is_written(header, ring_wrap(first_page_addr + mid * FLASH_PAGE_SIZE), mid, &written) != ESP_OK) return ESP_FAIL;
+
+        if (!written) {
+            hi = mid;
         } else {
-            return ESP_OK;
+            lo = mid + 1;
         }
+    }
+
+    // written all the way to the limit: the flight ends there
+    if (lo == max_pages) ESP_LOGW(TAG, "flight %" PRIu32 " fills the log up to its limit", header->flight_number);
+
+    *blank_page_addr = ring_wrap(first_page_addr + lo * FLASH_PAGE_SIZE);
+    return ESP_OK;
+}
+
+static esp_err_t solve_corrupted_log(flash_header_t *corrupted_header, uint32_t corrupted_header_addr) {
+    if (corrupted_header->status == 0x00 || corrupted_header->next_header_addr != 0xFFFFFFFF) return ESP_OK;
 
-        memcpy(last_header, &search_header, sizeof(flash_header_t)); // last_header = search_header
+    if (corrupted_header->header_size != sizeof(flash_header_t)) {
+        ESP_LOGW(TAG, "treating a log with different header size than current: %d vs %d", corrupted_header->header_size, sizeof(flash_header_t));
+    }
+
+    uint32_t packet_addr = flash_log_first_packet_addr(corrupted_header, corrupted_header_addr);
+
+    if (corrupted_header->format_version >= FLASH_PAGE_ALIGNED_VERSION) {
+        // the flight can grow up to the oldest flight, or around the whole ring if it is the only one
+        uint32_t limit = (has_flights() && tail_addr() != corrupted_header_addr) ? tail_addr() : corrupted_header_addr;
+        uint32_t max_pages = ring_distance(packet_addr, limit) / FLASH_PAGE_SIZE;
+        if (max_pages == 0) max_pages = (log_end - log_start) / FLASH_PAGE_SIZE - 1;
+
+        esp_err_t ret = find_first_blank_page(corrupted_header, packet_addr, max_pages, &packet_addr);
+        if (ret != ESP_OK) return ESP_FAIL;
+    } else {
+        // older formats pack packets across pages: scan them in order
+        window_reset();
+
+        while (1) {
+            // the log is a ring: give up once the whole of it has been scanned
+            if (ring_distance(corrupted_header_addr, packet_addr) + corrupted_header->packet_size >= log_end - log_start) return ESP_FAIL;
+
+            const uint8_t *packet = window_read(packet_addr, corrupted_header->packet_size);
+            if (packet == NULL) return ESP_FAIL;
+
+            if (packet_is_empty(packet, corrupted_header->packet_size)) break;
+
+            packet_addr = flash_log_next_packet_addr(corrupted_header, packet_addr);
+        }
     }
 
+    corrupted_header->next_header_addr = packet_addr;
+    if (w25q64_write_data(corrupted_header_addr + offsetof(flash_header_t, next_header_addr), (uint8_t *)&packet_addr, sizeof(packet_addr)) != ESP_OK) return ESP_FAIL;
+
+    ESP_LOGI(TAG, "Recovered flight %" PRIu32 ", ends at 0x%06" PRIX32, corrupted_header->flight_number, packet_addr);
+
     return ESP_OK;
 }
 
+static esp_err_t reclaim_oldest_flight(void) {
+    // never reclaim the flight being written
+    if (writting && tail_addr() == current_header_addr) return ESP_ERR_NO_MEM;
 
-flash_header_t* flash_log_get_headers(uint32_t* len) {
+    ESP_LOGI(TAG, "Reclaiming flight %" PRIu32, flash_dir_at(0)->flight_number);
+
+    return flash_dir_drop_oldest();
+}
+
+// the directory cache holds FLASH_DIR_MAX_FLIGHTS: make room for one more flight by reclaiming the oldest ones
+static esp_err_t reserve_dir_entry(void) {
+    while (flash_dir_count() >= FLASH_DIR_MAX_FLIGHTS) {
+        esp_err_t ret = reclaim_oldest_flight();
+        if (ret != ESP_OK) return ret;
+    }
+
+    return ESP_OK;
+}
+
+static void dir_entry_from_header(flash_dir_entry_t *entry, const flash_header_t *header, uint32_t header_addr) {
+    memset(entry, 0xFF, sizeof(flash_dir_entry_t));
+
+    entry->status = header->status == 0x00 ? FLASH_DIR_COMPLETED : FLASH_DIR_IN_PROGRESS;
+    entry->format_version = header->format_version;
+    entry->flight_number = header->flight_number;
+    entry->header_addr = header_addr;
+    entry->end_addr = header->next_header_addr;
+    entry->duration = header->duration;
+    entry->timestamp = header->timestamp;
+}
+
+// a flight interrupted by a power loss still has no end address
+static esp_err_t solve_flight(flash_header_t *header, uint32_t header_addr) {
+    if (header->status == 0x00 || header->next_header_addr != 0xFFFFFFFF) return ESP_OK;
+
+    // corrupted flight log
+    ESP_LOGI(TAG, "Corrupted log found, solving...");
+
+    return solve_corrupted_log(header, header_addr);
+}
+
+// walks the header chain once for logs written before the directory existed
+static esp_err_t rebuild_directory(void) {
+    flight_iter_t iter;
     flash_header_t search_header;
-    uint32_t search_header_addr = 0;
+    uint32_t search_header_addr;
+    flash_dir_entry_t entry;
+    uint32_t tail = log_start;
+    bool found;
 
-    uint32_t headers_idx = 0;
-    uint32_t headers_allocated = 32;
+    if (find_tail(&tail, &found) != ESP_OK) return ESP_FAIL;
 
-    flash_header_t* headers = malloc(headers_allocated * sizeof(flash_header_t));
+    flight_iter_init(&iter, tail, found);
 
     while (1) {
-        w25q64_read_data(search_header_addr, (uint8_t *)&search_header, sizeof(flash_header_t));
+        esp_err_t ret = flight_iter_next(&iter, &search_header, &search_header_addr);
 
-        if (search_header.magic == FLASH_HEADER_MAGIC) {
-            // check if we need to allocate more space
-            if (headers_idx >= headers_allocated) {
-                headers_allocated += 32;
-                headers = realloc(headers, headers_allocated * sizeof(flash_header_t));
-            }
+        // an empty log still gets a directory, so the next boot skips this scan
+        if (ret == ESP_ERR_NOT_FOUND) return has_flights() ? ESP_OK : flash_dir_reset();
+        if (ret != ESP_OK) return ESP_FAIL;
 
-            // its a valid header
-            uint32_t header_size = search_header.header_size;
-            if (header_size > sizeof(flash_header_t)) {
-                // different version header
-                header_size = sizeof(flash_header_t);
-            }
-            else if (header_size == 0) {
-                // invalid header size
-                headers_idx = 0;
-                break;
-            }
+        if (solve_flight(&search_header, search_header_addr) != ESP_OK) return ESP_FAIL;
+
+        dir_entry_from_header(&entry, &search_header, search_header_addr);
+        if (reserve_dir_entry() != ESP_OK || flash_dir_put(&entry) != ESP_OK) return ESP_FAIL;
+    }
+}
 
-            memcpy(&headers[headers_idx], &search_header, header_size);
-            headers_idx++;
+static esp_err_t load_flights(void) {
+    esp_err_t ret = flash_dir_load(log_end);
 
-            search_header_addr = search_header.next_header_addr;
-        } else {
-            break;
+    if (ret == ESP_ERR_NOT_FOUND) {
+        ESP_LOGI(TAG, "No flight directory, rebuilding from headers...");
+        ret = rebuild_directory();
+    }
+    if (ret != ESP_OK) return ESP_FAIL;
+
+    // initial values
+    memset(&last_header, 0xFF, sizeof(flash_header_t));
+    last_header.next_header_addr = log_start;
+    last_header.flight_number = 0;
+
+    if (has_flights()) {
+        const flash_dir_entry_t *newest = flash_dir_at(flash_dir_count() - 1);
+        uint32_t header_addr = newest->header_addr;
+
+        ret = read_header(&header_addr, &last_header);
+        if (ret == ESP_FAIL) return ESP_FAIL;
+
+        if (ret == ESP_ERR_NOT_FOUND) {
+            // the header never made it to flash: keep the flight as an empty one
+            flash_dir_entry_t entry = *newest;
+            entry.status = FLASH_DIR_COMPLETED;
+            entry.end_addr = entry.header_addr;
+            if (flash_dir_put(&entry) != ESP_OK) return ESP_FAIL;
+
+            last_header.next_header_addr = entry.header_addr;
+        } else if (newest->status != FLASH_DIR_COMPLETED) {
+            if (solve_flight(&last_header, header_addr) != ESP_OK) return ESP_FAIL;
+
+            flash_dir_entry_t entry;
+            dir_entry_from_header(&entry, &last_header, header_addr);
+            entry.status = FLASH_DIR_COMPLETED;
+            if (flash_dir_put(&entry) != ESP_OK) return ESP_FAIL;
         }
     }
 
-    // resize headers
-    if (headers_idx == 0 && headers_allocated > headers_idx) {
-        headers = realloc(headers, headers_idx * sizeof(flash_header_t));
+    // nothing past the newest flight is known to be erased yet
+    erased_until = frontier();
+
+    return ESP_OK;
+}
+
+static bool sector_blank_sink(uint32_t address, const uint8_t *data, size_t size, void *ctx) {
+    bool *blank = ctx;
+
+    if (!packet_is_empty(data, size)) {
+        *blank = false;
+        return false;
     }
 
-    *len = headers_idx;
-    return headers;
+    return true;
 }
 
-esp_err_t flash_log_get_header(uint32_t flight_number, flash_header_t* flash_header, uint32_t* flash_header_addr) {
+
+flash_header_t* flash_log_get_headers(uint32_t* len) {
     flash_header_t search_header;
-    uint32_t search_header_addr = 0;
+    uint32_t search_header_addr;
 
-    while (1) {
-        w25q64_read_data(search_header_addr, (uint8_t *)&search_header, sizeof(flash_header_t));
+    uint32_t headers_idx = 0;
+    uint32_t flights = flash_dir_count();
 
-        if (search_header.magic == FLASH_HEADER_MAGIC) {
-            // its a valid header
-            if (flight_number == search_header.flight_number) {
-                *flash_header = search_header;
+    flash_header_t* headers = malloc((flights > 0 ? flights : 1) * sizeof(flash_header_t));
 
-                if (flash_header_addr != NULL) {
-                    *flash_header_addr = search_header_addr;
-                }
-                return ESP_OK;
-            }
+    for (uint32_t i = 0; i < flights; i++) {
+        search_header_addr = flash_dir_at(i)->header_addr;
 
-            search_header_addr = search_header.next_header_addr;
-        } else {
+        if (read_header(&search_header_addr, &search_header) != ESP_OK) continue;
+
+        // its a valid header
+        if (search_header.header_size == 0) {
+            // invalid header size
+            headers_idx = 0;
             break;
         }
+
+        memcpy(&headers[headers_idx], &search_header, sizeof(flash_header_t));
+        headers_idx++;
     }
-    return ESP_FAIL;
+
+    *len = headers_idx;
+    return headers;
+}
+
+esp_err_t flash_log_get_header(uint32_t flight_number, flash_header_t* flash_header, uint32_t* flash_header_addr) {
+    const flash_dir_entry_t *entry = flash_dir_find(flight_number);
+    if (entry == NULL) return ESP_FAIL;
+
+    uint32_t search_header_addr = entry->header_addr;
+    if (read_header(&search_header_addr, flash_header) != ESP_OK) return ESP_FAIL;
+
+    if (flash_header_addr != NULL) {
+        *flash_header_addr = search_header_addr;
+    }
+    return ESP_OK;
 }
 
 void flash_log_list_flights(void) {
     flash_header_t search_header;
-    uint32_t search_header_addr = 0;
+    uint32_t search_header_addr;
 
-    while (1) {
-        w25q64_read_data(search_header_addr, (uint8_t *)&search_header, sizeof(flash_header_t));
+    for (uint32_t i = 0; i < flash_dir_count(); i++) {
+        search_header_addr = flash_dir_at(i)->header_addr;
 
-        if (search_header.magic == FLASH_HEADER_MAGIC) {
+        if (read_header(&search_header_addr, &search_header) == ESP_OK) {
             // its a valid header
             ESP_LOGI(TAG, "Flight number: %d", search_header.flight_number);
             ESP_LOGI(TAG, "Status: %d", search_header.status);
             ESP_LOGI(TAG, "timestamp: %d", search_header.timestamp);
             ESP_LOGI(TAG, "Format version: %d", search_header.format_version);
             ESP_LOGI(TAG, "Next header address: %d", search_header.next_header_addr);
+            if (search_header.page_programs != 0xFFFFFFFF) {
+                ESP_LOGI(TAG, "Page programs: %" PRIu32, search_header.page_programs);
+            }
+            if (search_header.samples != 0xFFFFFFFF) {
+                ESP_LOGI(TAG, "Samples: %" PRIu32, search_header.samples);
+                ESP_LOGI(TAG, "Max altitude: %.1f m", search_header.max_altitude);
+                ESP_LOGI(TAG, "Max |accel|: %.2f", search_header.max_accel);
+                ESP_LOGI(TAG, "Min battery: %.2f V", search_header.min_v_bat);
+            }
             ESP_LOGI(TAG, "------------------------");
-
-            search_header_addr = search_header.next_header_addr;
-        } else {
-            break;
         }
     }
 }
 
+static bool print_packet(const flash_packet_t *packet, uint32_t packet_addr, void *ctx) {
+    const flash_header_t *header = ctx;
+
+    if (packet->magic != FLASH_PACKET_MAGIC) return true;
+
+    float accel_scale = header->accel_scale;
+    float ang_vel_scale = header->ang_vel_scale;
+
+    ESP_LOGI(TAG, "Address:     0x%06" PRIX32, packet_addr);
+
+    ESP_LOGI(TAG, "ut:          %" PRIu32, packet->payload.ut);
+    ESP_LOGI(TAG, "phase:       %" PRIu8, packet->payload.phase);
+
+    ESP_LOGI(TAG, "accel:       X=%.2f  Y=%.2f  Z=%.2f", packet->payload.accel.x * accel_scale, packet->payload.accel.y * accel_scale, packet->payload.accel.z * accel_scale);
+    ESP_LOGI(TAG, "ang_vel:     X=%.2f  Y=%.2f  Z=%.2f", packet->payload.ang_vel.x * ang_vel_scale, packet->payload.ang_vel.y * ang_vel_scale, packet->payload.ang_vel.z * ang_vel_scale);
+
+    ESP_LOGI(TAG, "pressure:    %.2f", packet->payload.pressure);
+    ESP_LOGI(TAG, "temperature: %.2f", packet->payload.temperature);
+
+    ESP_LOGI(TAG, "lat:         %" PRId32, packet->payload.lat_nmea);
+    ESP_LOGI(TAG, "lon:         %" PRId32, packet->payload.lon_nmea);
+    ESP_LOGI(TAG, "satellites:  %" PRId8, packet->payload.satellites);
+
+    ESP_LOGI(TAG, "battery:     %.2f V", packet->payload.v_bat);
+
+    ESP_LOGI(TAG, "------------------");
+
+    return true;
+}
+
 esp_err_t flash_log_read_flight(uint32_t flight_number) {
     flash_header_t search_header;
-    uint32_t search_header_addr = 0;
+    uint32_t search_header_addr;
+
+    if (flash_log_get_header(flight_number, &search_header, &search_header_addr) != ESP_OK) return ESP_FAIL;
+
+    ESP_LOGI(TAG, "---Reading packet---");
+    ESP_LOGI(TAG, "Flight number: %d", search_header.flight_number);
+    ESP_LOGI(TAG, "Status: %d", search_header.status);
+    ESP_LOGI(TAG, "timestamp: %d", search_header.timestamp);
+    ESP_LOGI(TAG, "Format version: %d", search_header.format_version);
+    ESP_LOGI(TAG, "Next header address: %d", search_header.next_header_addr);
+    ESP_LOGI(TAG, "========================");
+
+    if (search_header.status == 0xFF || search_header.next_header_addr == 0xFFFFFFFF) {
+        ESP_LOGI(TAG, "Flight log is corrupted");
+        return ESP_FAIL;
+    }
+
+    return flash_log_for_each_packet(&search_header, search_header_addr, print_packet, &search_header);
+}
+
+esp_err_t flash_log_get_flight_packet(uint32_t flash_packet_addr, uint32_t flash_packet_size, flash_packet_t* flash_packet) {
+    return w25q64_read_data(flash_packet_addr, (uint8_t *)flash_packet, flash_packet_size);
+}
+
+// uncompressed flights, before FLASH_COMPRESSED_VERSION: accel and ang_vel as floats
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t ut;
+
+    vector3f_t accel;
+    vector3f_t ang_vel;
+    float pressure;
+    float temperature;
+
+    int32_t lat_nmea, lon_nmea;
+    uint8_t satellites;
+
+    float v_bat;
+
+    uint8_t phase;
+} flash_legacy_packet_t;
+
+_Static_assert(sizeof(flash_legacy_packet_t) == sizeof(flash_packet_t) + 12, "legacy packets hold float accel and ang_vel");
 
+static void legacy_to_packet(const flash_legacy_packet_t *legacy, flash_packet_t *packet) {
+    packet->magic = legacy->magic;
+    packet->payload.ut = legacy->ut;
+
+    packet->payload.accel.x = flash_codec_to_count(legacy->accel.x, FLASH_LEGACY_ACCEL_SCALE);
+    packet->payload.accel.y = flash_codec_to_count(legacy->accel.y, FLASH_LEGACY_ACCEL_SCALE);
+    packet->payload.accel.z = flash_codec_to_count(legacy->accel.z, FLASH_LEGACY_ACCEL_SCALE);
+    packet->payload.ang_vel.x = flash_codec_to_count(legacy->ang_vel.x, FLASH_LEGACY_ANG_VEL_SCALE);
+    packet->payload.ang_vel.y = flash_codec_to_count(legacy->ang_vel.y, FLASH_LEGACY_ANG_VEL_SCALE);
+    packet->payload.ang_vel.z = flash_codec_to_count(legacy->ang_vel.z, FLASH_LEGACY_ANG_VEL_SCALE);
+
+    packet->payload.pressure = legacy->pressure;
+    packet->payload.temperature = legacy->temperature;
+    packet->payload.lat_nmea = legacy->lat_nmea;
+    packet->payload.lon_nmea = legacy->lon_nmea;
+    packet->payload.satellites = legacy->satellites;
+    packet->payload.v_bat = legacy->v_bat;
+    packet->payload.phase = legacy->phase;
+}
+
+static esp_err_t for_each_block(const flash_header_t* flash_header, uint32_t flash_header_addr, flash_log_packet_sink_t sink, void* ctx) {
     flash_packet_t packet;
+    flash_block_header_t block;
+    uint32_t flight_size = ring_distance(flash_header_addr, flash_header->next_header_addr);
+
+    bool has_trailer = flash_header->format_version >= FLASH_PAGE_TRAILER_VERSION;
+    bool legacy = flash_header->format_version < FLASH_RAW_IMU_VERSION;
+    uint32_t seq = 0;
+
+    for (uint32_t addr = flash_log_first_packet_addr(flash_header, flash_header_addr);
+         ring_distance(flash_header_addr, addr) + FLASH_PAGE_SIZE <= flight_size;
+         addr = flash_log_next_packet_addr(flash_header, addr), seq++) {
+        const uint8_t *page = window_read(addr, FLASH_PAGE_SIZE);
+        if (page == NULL) return ESP_FAIL;
+
+        // a damaged page costs only its own samples
+        if (has_trailer && !page_trailer_valid(page, flash_header->flight_number, seq)) {
+            ESP_LOGW(TAG, "Corrupted page at 0x%06" PRIX32 ", skipping", addr);
+            continue;
+        }
 
-    while (1) {
-        w25q64_read_data(search_header_addr, (uint8_t *)&search_header, sizeof(flash_header_t));
+        memcpy(&block, page, sizeof(block));
+        if (block.magic != FLASH_BLOCK_MAGIC) continue;
 
-        if (search_header.magic == FLASH_HEADER_MAGIC) {
-            // its a valid header
-            if (flight_number == search_header.flight_number) {
-                // its the flight we're looking for
-                ESP_LOGI(TAG, "---Reading packet---");
-                ESP_LOGI(TAG, "Flight number: %d", search_header.flight_number);
-                ESP_LOGI(TAG, "Status: %d", search_header.status);
-                ESP_LOGI(TAG, "timestamp: %d", search_header.timestamp);
-                ESP_LOGI(TAG, "Format version: %d", search_header.format_version);
-                ESP_LOGI(TAG, "Next header address: %d", search_header.next_header_addr);
-                ESP_LOGI(TAG, "========================");
-
-                if (search_header.status == 0xFF || search_header.next_header_addr == 0xFFFFFFFF) {
-                    ESP_LOGI(TAG, "Flight log is corrupted");
-                    return ESP_FAIL;
-                }
-
-                for (uint32_t addr = search_header_addr + sizeof(flash_header_t); addr < search_header.next_header_addr; addr+=sizeof(flash_packet_t)) {
-                    w25q64_read_data(addr, (uint8_t *)&packet, sizeof(flash_packet_t));
-
-                    if (packet.magic == FLASH_PACKET_MAGIC) {
-                        ESP_LOGI(TAG, "Address:     0x%06" PRIX32, addr);
-
-                        ESP_LOGI(TAG, "ut:          %" PRIu32, packet.payload.ut);
-                        ESP_LOGI(TAG, "phase:       %" PRIu8, packet.payload.phase);
-
-                        ESP_LOGI(TAG, "accel:       X=%.2f  Y=%.2f  Z=%.2f", packet.payload.accel.x, packet.payload.accel.y, packet.payload.accel.z);
-                        ESP_LOGI(TAG, "ang_vel:     X=%.2f  Y=%.2f  Z=%.2f", packet.payload.ang_vel.x, packet.payload.ang_vel.y, packet.payload.ang_vel.z);
-
-                        ESP_LOGI(TAG, "pressure:    %.2f", packet.payload.pressure);
-                        ESP_LOGI(TAG, "temperature: %.2f", packet.payload.temperature);
-
-                        ESP_LOGI(TAG, "lat:         %" PRId32, packet.payload.lat_nmea);
-                        ESP_LOGI(TAG, "lon:         %" PRId32, packet.payload.lon_nmea);
-                        ESP_LOGI(TAG, "satellites:  %" PRId8, packet.payload.satellites);
-
-                        ESP_LOGI(TAG, "battery:     %.2f V", packet.payload.v_bat);
-
-                        ESP_LOGI(TAG, "------------------");
-                    }
-                }
-                return ESP_OK;
-            }
+        const uint8_t *data = page + sizeof(block);
+        uint32_t data_size = (has_trailer ? FLASH_PAGE_DATA_SIZE : FLASH_PAGE_SIZE) - sizeof(block);
 
-            search_header_addr = search_header.next_header_addr;
-        } else {
-            break;
+        if (block.size > data_size || (!has_trailer && crc16(data, block.size) != block.crc)) {
+            ESP_LOGW(TAG, "Corrupted block at 0x%06" PRIX32 ", skipping", addr);
+            continue;
+        }
+
+        flash_codec_state_t state;
+        flash_codec_reset(&state);
+
+        size_t offset = 0;
+        for (uint32_t i = 0; i < block.count; i++) {
+            size_t used;
+            esp_err_t ret = legacy ? flash_codec_decode_legacy(&state, data + offset, block.size - offset, &used, &packet.payload)
+                                   : flash_codec_decode(&state, data + offset, block.size - offset, &used, &packet.payload);
+            if (ret != ESP_OK) break;
+            offset += used;
+
+            packet.magic = FLASH_PACKET_MAGIC;
+            if (!sink(&packet, addr, ctx)) return ESP_OK;
         }
     }
-    return ESP_FAIL;
+
+    return ESP_OK;
 }
 
-esp_err_t flash_log_get_flight_packet(uint32_t flash_packet_addr, uint32_t flash_packet_size, flash_packet_t* flash_packet) {
-    return w25q64_read_data(flash_packet_addr, (uint8_t *)flash_packet, flash_packet_size);
+esp_err_t flash_log_for_each_packet(const flash_header_t* flash_header, uint32_t flash_header_addr, flash_log_packet_sink_t sink, void* ctx) {
+    flash_legacy_packet_t legacy;
+    flash_packet_t packet;
+    size_t copy_size = flash_header->packet_size < sizeof(legacy) ? flash_header->packet_size : sizeof(legacy);
+
+    if (flash_header->next_header_addr == 0xFFFFFFFF) return ESP_ERR_INVALID_STATE;
+
+    window_reset();
+
+    if (flash_header->format_version >= FLASH_COMPRESSED_VERSION) return for_each_block(flash_header, flash_header_addr, sink, ctx);
+
+    // bounds are ring distances from the header: a flight may wrap past the end of the log
+    uint32_t flight_size = ring_distance(flash_header_addr, flash_header->next_header_addr);
+
+    for (uint32_t addr = flash_log_first_packet_addr(flash_header, flash_header_addr);
+         ring_distance(flash_header_addr, addr) + flash_header->packet_size <= flight_size;
+         addr = flash_log_next_packet_addr(flash_header, addr)) {
+        const uint8_t *data = window_read(addr, flash_header->packet_size);
+        if (data == NULL) return ESP_FAIL;
+
+        memset(&legacy, 0xFF, sizeof(legacy));
+        memcpy(&legacy, data, copy_size);
+
+        legacy_to_packet(&legacy, &packet);
+
+        if (!sink(&packet, addr, ctx)) break;
+    }
+
+    return ESP_OK;
+}
+
+uint32_t flash_log_first_packet_addr(const flash_header_t* flash_header, uint32_t flash_header_addr) {
+    if (flash_header->format_version < FLASH_PAGE_ALIGNED_VERSION) {
+        // packets follow the header back to back
+        return ring_wrap(flash_header_addr + flash_header->header_size);
+    }
+
+    // the header owns the whole first page
+    return ring_wrap(flash_header_addr + FLASH_PAGE_SIZE);
+}
+
+uint32_t flash_log_next_packet_addr(const flash_header_t* flash_header, uint32_t flash_packet_addr) {
+    // compressed flights hold one block per page
+    if (flash_header->format_version >= FLASH_COMPRESSED_VERSION) return ring_wrap((flash_packet_addr & ~(FLASH_PAGE_SIZE - 1)) + FLASH_PAGE_SIZE);
+
+    uint32_t next_addr = flash_packet_addr + flash_header->packet_size;
+
+    if (flash_header->format_version < FLASH_PAGE_ALIGNED_VERSION) return ring_wrap(next_addr);
+
+    // packets never straddle a page: skip the unused page tail
+    if ((next_addr % FLASH_PAGE_SIZE) + flash_header->packet_size > FLASH_PAGE_SIZE) {
+        next_addr = page_align(next_addr);
+    }
+
+    return ring_wrap(next_addr);
 }
 
 
 
+esp_err_t flash_log_get_flight_range(uint32_t flight_number, uint32_t* addr, uint32_t* size) {
+    flash_header_t header;
+    uint32_t header_addr;
+
+    if (flash_log_get_header(flight_number, &header, &header_addr) != ESP_OK) return ESP_FAIL;
+    if (header.next_header_addr == 0xFFFFFFFF) return ESP_ERR_INVALID_STATE;
+
+    *addr = header_addr;
+    *size = ring_distance(header_addr, header.next_header_addr);
+    return ESP_OK;
+}
+
+void flash_log_get_bounds(uint32_t* start, uint32_t* end) {
+    *start = log_start;
+    *end = log_end;
+}
+
+esp_err_t flash_log_read_range(uint32_t addr, uint32_t size, flash_log_range_sink_t sink, void* ctx) {
+    uint32_t capacity = w25q64_get_geometry()->capacity;
+    if (size == 0 || addr >= capacity || size > capacity - addr) return ESP_ERR_INVALID_ARG;
+
+    return w25q64_read_stream_cb(addr, size, sink, ctx);
+}
+
 esp_err_t flash_log_init(void) {
-    // update last header
-    if (get_last_header(&last_header) != ESP_OK) return ESP_FAIL;
+    // the active buffer is owned by the producer, the others are free
+    free_buffers = xSemaphoreCreateCounting(PAGE_BUFFERS, PAGE_BUFFERS - 1);
+    if (free_buffers == NULL) return ESP_ERR_NO_MEM;
+
+    log_lock = xSemaphoreCreateRecursiveMutex();
+    if (log_lock == NULL) return ESP_ERR_NO_MEM;
+
+    if (w25q64_async_init(page_written, NULL) != ESP_OK) return ESP_FAIL;
+
+    log_end = w25q64_get_geometry()->capacity - FLASH_DIR_SIZE;
+
+    // find the oldest flight and update last header
+    if (load_flights() != ESP_OK) return ESP_FAIL;
     initialized = true;
     return ESP_OK;
 }
 
+esp_err_t flash_log_erase_ahead(void) {
+    if (!initialized) return ESP_FAIL;
+
+    lock_take();
+
+    uint32_t front = frontier();
+    uint32_t sector_addr = erased_until;
+
+    if (ring_distance(front, sector_addr) >= FLASH_ERASE_AHEAD_SECTORS * FLASH_SECTOR_SIZE) {
+        lock_give();
+        return ESP_OK;
+    }
+
+    // the sector ahead still holds the oldest flights: reclaim them first
+    while (has_flights() && ring_distance(front, sector_addr) + FLASH_SECTOR_SIZE > ring_distance(front, tail_addr())) {
+        esp_err_t ret = reclaim_oldest_flight();
+        if (ret != ESP_OK) {
+            lock_give();
+            return ret;
+        }
+    }
+
+    // most sectors of a fresh chip are already blank, skip the erase for those
+    bool blank = true;
+    esp_err_t ret = w25q64_read_stream_cb(sector_addr, FLASH_SECTOR_SIZE, sector_blank_sink, &blank);
+
+    if (ret == ESP_OK && !blank) ret = w25q64_erase_sector(sector_addr);
+    if (ret == ESP_OK) erased_until = ring_wrap(sector_addr + FLASH_SECTOR_SIZE);
+
+    lock_give();
+    return ret;
+}
+
+uint32_t flash_log_get_erased_ahead(void) {
+    return ring_distance(frontier(), erased_until);
+}
+
+uint32_t flash_log_get_overrun_pages(void) {
+    return overrun_pages;
+}
+
+void flash_log_get_stats(flash_log_stats_t *stats) {
+    stats->samples = samples_appended;
+    stats->pages = pages_queued;
+    stats->bytes = bytes_queued;
+    stats->overrun_pages = overrun_pages;
+    stats->write_errors = write_errors;
+}
+
 esp_err_t flash_log_start_flight(void) {
     if (!initialized || writting) return ESP_FAIL;
 
+    lock_take();
+
+    current_header_addr = frontier();
+
+    // the header sector must be erased before anything is written
+    while (ring_distance(current_header_addr, erased_until) < FLASH_SECTOR_SIZE) {
+        if (flash_log_erase_ahead() != ESP_OK) {
+            lock_give();
+            return ESP_FAIL;
+        }
+    }
+
     // clear buffer
-    memset(page_buffer, 0xFF, sizeof(page_buffer));
-    buffer_offset = 0;
+    block_reset();
 
     // set current header values
     memset(&current_header, 0xFF, sizeof(current_header));
@@ -301,28 +1003,145 @@ esp_err_t flash_log_start_flight(void) {
     current_header.header_size = sizeof(flash_header_t);
     current_header.packet_size = sizeof(flash_packet_t);
     current_header.format_version = FLASH_FORMAT_VERSION;
-    current_header.flight_number = last_header.flight_number+1;
-
-    current_header_addr = last_header.next_header_addr;
-    current_packet_addr = current_header_addr + sizeof(flash_header_t);
+    current_header.flight_number = flash_dir_next_flight_number();
+    memcpy(current_header.phase_interval_ms, phase_interval_ms, sizeof(current_header.phase_interval_ms));
+    current_header.accel_scale = imu_accel_scale;
+    current_header.ang_vel_scale = imu_ang_vel_scale;
+
+    current_packet_addr = flash_log_first_packet_addr(&current_header, current_header_addr);
+
+    page_programs_start = w25q64_get_page_program_count();
+    overrun_pages = 0;
+    page_seq = 0;
+    summary_reset();
+
+    // samples held for an earlier arming belong to no flight
+    portENTER_CRITICAL(&history_mux);
+    history_first = 0;
+    history_count = 0;
+    portEXIT_CRITICAL(&history_mux);
+
+    // the directory learns about the flight first, so a power loss never leaves an unknown header
+    flash_dir_entry_t entry;
+    dir_entry_from_header(&entry, &current_header, current_header_addr);
+
+    if (reserve_dir_entry() != ESP_OK || flash_dir_put(&entry) != ESP_OK) {
+        lock_give();
+        return ESP_FAIL;
+    }
 
     writting = true;
 
     // write header
-    return w25q64_write_data(current_header_addr, (uint8_t *)&current_header, sizeof(flash_header_t));
+    esp_err_t ret = w25q64_write_data(current_header_addr, (uint8_t *)&current_header, sizeof(flash_header_t));
+
+    lock_give();
+    return ret;
 }
 
 esp_err_t flash_log_append(flash_payload_t *payload) {
     if (!initialized || !writting) return ESP_FAIL;
 
-    page_buffer[buffer_offset].magic = FLASH_PACKET_MAGIC;
-    page_buffer[buffer_offset].payload = *payload;
+    lock_take();
+
+    // the flight may have been finished from another task since the check above
+    if (!writting) {
+        lock_give();
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret = ESP_OK;
+    uint8_t sample[FLASH_CODEC_MAX_SAMPLE_SIZE];
+    size_t sample_size = flash_codec_encode(&codec, payload, sample);
+
+    if (buffer_offset + sample_size > FLASH_PAGE_DATA_SIZE) {
+        // the block is full: close it and encode the sample again as the next key frame
+        ret = flush_buffer();
+        sample_size = flash_codec_encode(&codec, payload, sample);
+    }
+
+    memcpy(page_buffer[active_buffer] + buffer_offset, sample, sample_size);
+    buffer_offset += sample_size;
+    block_count++;
+    samples_appended++;
+    summary_update(payload);
+
+    lock_give();
+    return ret;
+}
+
+static inline uint16_t saturate_u16(uint32_t value) {
+    return value < 0xFFFF ? value : 0xFFFE;
+}
+
+esp_err_t flash_log_set_stage_profile(uint32_t stage, uint32_t mean_us, uint32_t p99_us, uint32_t max_us) {
+    if (!initialized || !writting) return ESP_FAIL;
+    if (stage >= FLASH_PROFILE_STAGES) return ESP_ERR_INVALID_ARG;
+
+    lock_take();
+
+    if (!writting) {
+        lock_give();
+        return ESP_FAIL;
+    }
+
+    current_header.stage_mean_us[stage] = saturate_u16(mean_us);
+    current_header.stage_p99_us[stage] = saturate_u16(p99_us);
+    current_header.stage_max_us[stage] = max_us;
+
+    lock_give();
+    return ESP_OK;
+}
+
+void flash_log_set_imu_scale(float accel_scale, float ang_vel_scale) {
+    imu_accel_scale = accel_scale;
+    imu_ang_vel_scale = ang_vel_scale;
+}
+
+uint16_t flash_log_phase_interval(uint8_t phase) {
+    return phase < FLASH_SUMMARY_PHASES ? phase_interval_ms[phase] : 0;
+}
+
+void flash_log_history_push(const flash_payload_t *payload) {
+    portENTER_CRITICAL(&history_mux);
+
+    if (history_count == FLASH_HISTORY_SAMPLES) {
+        history_first = (history_first + 1) % FLASH_HISTORY_SAMPLES;
+        history_count--;
+    }
+
+    history[(history_first + history_count) % FLASH_HISTORY_SAMPLES] = *payload;
+    history_count++;
+
+    portEXIT_CRITICAL(&history_mux);
+}
+
+esp_err_t flash_log_history_flush(void) {
+    esp_err_t ret = ESP_OK;
+    uint32_t flushed = 0;
+    flash_payload_t payload;
+
+    while (1) {
+        portENTER_CRITICAL(&history_mux);
+
+        if (history_count == 0) {
+            portEXIT_CRITICAL(&history_mux);
+            break;
+        }
+
+        payload = history[history_first];
+        history_first = (history_first + 1) % FLASH_HISTORY_SAMPLES;
+        history_count--;
+
+        portEXIT_CRITICAL(&history_mux);
 
-    buffer_offset++;
+        if (flash_log_append(&payload) != ESP_OK) ret = ESP_FAIL;
+        flushed++;
+    }
 
-    if (buffer_offset < PACKETS_PER_PAGE) return ESP_OK;
+    if (flushed > 0) ESP_LOGI(TAG, "Logged %" PRIu32 " pre-trigger samples", flushed);
 
-    return flush_buffer();
+    return ret;
 }
 
 esp_err_t flash_log_set_gps_data(uint32_t utc_time, uint32_t utc_date, int32_t lat_nmea, int32_t lon_nmea) {
@@ -357,57 +1176,125 @@ esp_err_t flash_log_set_gps_data(uint32_t utc_time, uint32_t utc_date, int32_t l
 esp_err_t flash_log_finish_flight(uint32_t duration) {
     if (!initialized || !writting) return ESP_FAIL;
 
-    writting = false;
+    lock_take();
 
     // write remaining data
     flush_buffer();
 
+    writting = false;
+
+    if (w25q64_async_flush(FLUSH_TIMEOUT) != ESP_OK) {
+        ESP_LOGW(TAG, "Timeout waiting for pending page programs");
+    }
+
+    if (write_errors != 0) {
+        ESP_LOGW(TAG, "%" PRIu32 " page programs failed", write_errors);
+        write_errors = 0;
+    }
+
+    if (overrun_pages != 0) {
+        ESP_LOGW(TAG, "%" PRIu32 " pages dropped: erase-ahead fell behind", overrun_pages);
+    }
+
     // write header information
     current_header.status = 0x00;
     current_header.next_header_addr = current_packet_addr;
     current_header.duration = duration;
-    if (w25q64_write_data(current_header_addr, (uint8_t *)&current_header, sizeof(current_header)) != ESP_OK) return ESP_FAIL;
+    current_header.page_programs = w25q64_get_page_program_count() - page_programs_start;
+    summary_to_header(&current_header);
 
-    // update last header
-    last_header = current_header;
+    ESP_LOGI(TAG, "Flight %" PRIu32 " finished: %" PRIu32 " page programs", current_header.flight_number, current_header.page_programs);
 
-    return ESP_OK;
+    w25q64_op_stats_t program_stats;
+    if (w25q64_get_op_stats(W25Q64_OP_PAGE_PROGRAM, &program_stats) == ESP_OK) {
+        ESP_LOGI(TAG, "Page program latency: min %" PRIu32 " us, avg %" PRIu32 " us, max %" PRIu32 " us", program_stats.min_us, program_stats.avg_us, program_stats.max_us);
+    }
+
+    esp_err_t ret = w25q64_write_data(current_header_addr, (uint8_t *)&current_header, sizeof(current_header));
+
+    if (ret == ESP_OK) {
+        flash_dir_entry_t entry;
+        dir_entry_from_header(&entry, &current_header, current_header_addr);
+        ret = flash_dir_put(&entry);
+
+        // update last header
+        last_header = current_header;
+    }
+
+    lock_give();
+    return ret;
 }
 
 
 
-esp_err_t flash_log_clear_flights(void) {
-    // clear all flights
-    flash_header_t search_header;
-    uint32_t search_header_addr = 0;
+typedef struct {
+    flash_log_progress_t progress;
+    void *ctx;
+    uint32_t done; // bytes of the earlier segments
+    uint32_t total;
+} clear_progress_t;
 
-    while (1) {
-        if (w25q64_read_data(search_header_addr, (uint8_t *)&search_header, sizeof(flash_header_t)) != ESP_OK) return ESP_FAIL;
+static void clear_progress(uint32_t erased, uint32_t total, void *ctx) {
+    clear_progress_t *clear = ctx;
+    clear->progress(clear->done + erased, clear->total, clear->ctx);
+}
 
-        if (search_header.magic != FLASH_HEADER_MAGIC) {
-            break;
-        }
+esp_err_t flash_log_clear_flights(flash_log_progress_t progress, void* ctx) {
+    if (writting) return ESP_FAIL;
 
-        search_header_addr = search_header.next_header_addr;
-    }
+    lock_take();
+
+    // clear everything from the oldest flight to the end of the newest one
+    if (has_flights()) {
+        uint32_t clear_addr = tail_addr() & ~(W25Q64_SECTOR_SIZE - 1);
+        uint32_t size = ring_distance(clear_addr, frontier());
+
+        // a full ring ends where it starts
+        if (size == 0) size = log_end - log_start;
 
-    // clear until search_header_addr
-    uint32_t last_sector_addr = (search_header_addr + W25Q64_SECTOR_SIZE - 1) & ~(W25Q64_SECTOR_SIZE - 1);
-    for (uint32_t clear_addr=0; clear_addr<last_sector_addr; clear_addr+=W25Q64_SECTOR_SIZE) {
-        if (w25q64_erase_sector(clear_addr) != ESP_OK) return ESP_FAIL;
+        clear_progress_t clear = { .progress = progress, .ctx = ctx, .done = 0, .total = size };
+
+        // the span wraps at most once, each part goes through the block erase fast path
+        while (size > 0) {
+            uint32_t part = clear_addr + size > log_end ? log_end - clear_addr : size;
+
+            if (w25q64_erase_range(clear_addr, part, progress != NULL ? clear_progress : NULL, &clear) != ESP_OK) {
+                lock_give();
+                return ESP_FAIL;
+            }
+
+            clear.done += part;
+            size -= part;
+            clear_addr = ring_wrap(clear_addr + part);
+        }
     }
 
-    return ESP_OK;
+    esp_err_t ret = flash_dir_reset();
+    if (ret == ESP_OK) ret = load_flights();
+
+    lock_give();
+    return ret;
 }
 
 esp_err_t flash_log_clear(uint32_t last_sector_idx) {
+    if (writting) return ESP_FAIL;
+
+    lock_take();
+
+    esp_err_t ret = ESP_OK;
+
     if (last_sector_idx == 0) {
-        return w25q64_erase_chip();
+        ret = w25q64_erase_chip();
     }
 
-    for (uint32_t sector_idx=0; sector_idx<last_sector_idx; sector_idx+=1) {
-        if (w25q64_erase_sector(sector_idx*W25Q64_SECTOR_SIZE) != ESP_OK) return ESP_FAIL;
+    if (last_sector_idx > 0) {
+        ret = w25q64_erase_range(0, last_sector_idx*W25Q64_SECTOR_SIZE, NULL, NULL);
     }
 
-    return ESP_OK;
+    // flights past the cleared sectors are forgotten along with the directory
+    if (ret == ESP_OK) ret = flash_dir_reset();
+    if (ret == ESP_OK) ret = load_flights();
+
+    lock_give();
+    return ret;
 }
\ No newline at end of file
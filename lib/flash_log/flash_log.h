@@ -2,6 +2,7 @@
 #define __FLASH_LOG_H__
 
 #include <unistd.h>
+#include <stdbool.h>
 #include "esp_err.h"
 
 #include "math_helper.h"
@@ -9,11 +10,46 @@
 #define FLASH_HEADER_MAGIC 0x46484452 // "FHDR"
 #define FLASH_PACKET_MAGIC 0x46504143 // "FPAC"
 
-#define FLASH_FORMAT_VERSION 4
+#define FLASH_FORMAT_VERSION 8
+
+// from this version on, headers and packet pages start on FLASH_PAGE_SIZE boundaries
+#define FLASH_PAGE_ALIGNED_VERSION 5
+
+// from this version on, each packet page is one compressed block (see flash_codec.h)
+#define FLASH_COMPRESSED_VERSION 6
+
+// from this version on, each packet page ends with a flash_page_trailer_t
+#define FLASH_PAGE_TRAILER_VERSION 7
+
+// from this version on, accel and ang_vel are raw sensor counts, scaled by the header's accel_scale and ang_vel_scale
+#define FLASH_RAW_IMU_VERSION 8
+
+// older flights are decoded to counts at these scales, the header reads back with them
+#define FLASH_LEGACY_ACCEL_SCALE (1.0f / 1000.0f) // g per count, +-32 g
+#define FLASH_LEGACY_ANG_VEL_SCALE (1.0f / 16.4f) // deg/s per count, +-1998 deg/s
 
 #define FLASH_PAGE_SIZE 256
-#define PACKETS_PER_PAGE (FLASH_PAGE_SIZE / sizeof(flash_packet_t))
-#define BYTES_PER_PAGE (PACKETS_PER_PAGE * sizeof(flash_packet_t))
+#define FLASH_SECTOR_SIZE 4096
+
+// flight phases with a transition time in the summary, indexed by flash_payload_t.phase
+#define FLASH_SUMMARY_PHASES 8
+
+// full-rate logging the erase-ahead window must hold on its own, liftoff to apogee at the IMU rate:
+// about 16 bytes per compressed sample, block and page trailer included
+#define FLASH_FULL_RATE_MAX_S 20
+#define FLASH_FULL_RATE_HZ 1000
+#define FLASH_FULL_RATE_SAMPLE_BYTES 16
+
+// sectors kept erased ahead of the write position, 79 (316 KB)
+#define FLASH_ERASE_AHEAD_SECTORS \
+    ((FLASH_FULL_RATE_MAX_S * FLASH_FULL_RATE_HZ * FLASH_FULL_RATE_SAMPLE_BYTES + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE)
+
+// avionics loop stages profiled per flight, see loop_profile.h
+#define FLASH_PROFILE_STAGES 9
+
+// pre-trigger history held in RAM while armed, every IMU sample: 1 s at FLASH_FULL_RATE_HZ is 38 KB
+#define FLASH_HISTORY_MS 1000
+#define FLASH_HISTORY_SAMPLES (FLASH_HISTORY_MS * FLASH_FULL_RATE_HZ / 1000)
 
 typedef struct __attribute__((packed)) {
     // identify
@@ -31,13 +67,43 @@ typedef struct __attribute__((packed)) {
     uint32_t duration; // ms
     uint32_t timestamp;
     int32_t lat_nmea, lon_nmea;
+
+    // write statistics
+    uint32_t page_programs;
+
+    // flight summary, accumulated while logging
+    uint32_t samples;
+    float max_altitude; // m above the first sample, barometric
+    float max_accel; // |accel|
+    float min_v_bat;
+    uint32_t phase_ut[FLASH_SUMMARY_PHASES]; // first ut in each phase, 0xFFFFFFFF if never reached
+
+    // logging rate policy of the flight, written with the header
+    uint16_t phase_interval_ms[FLASH_SUMMARY_PHASES]; // minimum ut step between samples, 0 = every sample
+
+    // avionics loop profile over the flight, 0xFFFF... if not recorded
+    uint16_t stage_mean_us[FLASH_PROFILE_STAGES]; // saturated at 0xFFFE
+    uint16_t stage_p99_us[FLASH_PROFILE_STAGES];
+    uint32_t stage_max_us[FLASH_PROFILE_STAGES];
+
+    // resolution of the raw IMU fields, written with the header
+    float accel_scale; // g per count
+    float ang_vel_scale; // deg/s per count
 } flash_header_t;
 
+typedef struct __attribute__((packed)) {
+    uint32_t seq; // page index within the flight
+    uint16_t flight; // low bits of the flight number
+    uint16_t crc; // crc16 of the page up to this field
+} flash_page_trailer_t;
+
+#define FLASH_PAGE_DATA_SIZE (FLASH_PAGE_SIZE - sizeof(flash_page_trailer_t))
+
 typedef struct __attribute__((packed)) {
     uint32_t ut;
 
-    vector3f_t accel;
-    vector3f_t ang_vel;
+    vector3s_t accel; // raw counts, see flash_header_t.accel_scale
+    vector3s_t ang_vel; // raw counts, see flash_header_t.ang_vel_scale
     float pressure;
     float temperature;
 
@@ -55,6 +121,29 @@ typedef struct __attribute__((packed)) {
     flash_payload_t payload;
 } flash_packet_t;
 
+typedef struct {
+    uint32_t samples; // appended since boot
+    uint32_t pages; // page programs queued
+    uint32_t bytes; // bytes queued for programming
+    uint32_t overrun_pages;
+    uint32_t write_errors;
+} flash_log_stats_t;
+
+/**
+ * @brief Receives each packet of a flight in order. Return false to stop.
+ */
+typedef bool (*flash_log_packet_sink_t)(const flash_packet_t* flash_packet, uint32_t flash_packet_addr, void* ctx);
+
+/**
+ * @brief Reports the progress of a long operation, done out of total bytes.
+ */
+typedef void (*flash_log_progress_t)(uint32_t done, uint32_t total, void* ctx);
+
+/**
+ * @brief Receives raw chip bytes in order. Return false to stop.
+ */
+typedef bool (*flash_log_range_sink_t)(uint32_t addr, const uint8_t* data, size_t size, void* ctx);
+
 
 flash_header_t* flash_log_get_headers(uint32_t* len);
 
@@ -68,6 +157,32 @@ esp_err_t flash_log_get_flight(uint32_t flight_number);
 
 esp_err_t flash_log_get_flight_packet(uint32_t flash_packet_addr, uint32_t flash_packet_size, flash_packet_t* flash_packet);
 
+/**
+ * @brief Decodes the packets of a finished flight into sink, in flash_packet_t layout.
+ *        Flights older than FLASH_RAW_IMU_VERSION get their accel and ang_vel converted to counts, saturated,
+ *        at FLASH_LEGACY_ACCEL_SCALE and FLASH_LEGACY_ANG_VEL_SCALE.
+ */
+esp_err_t flash_log_for_each_packet(const flash_header_t* flash_header, uint32_t flash_header_addr, flash_log_packet_sink_t sink, void* ctx);
+
+uint32_t flash_log_first_packet_addr(const flash_header_t* flash_header, uint32_t flash_header_addr);
+
+uint32_t flash_log_next_packet_addr(const flash_header_t* flash_header, uint32_t flash_packet_addr);
+
+/**
+ * @brief Chip bytes of a finished flight, header included. Past the end of the log they continue at its start.
+ */
+esp_err_t flash_log_get_flight_range(uint32_t flight_number, uint32_t* addr, uint32_t* size);
+
+/**
+ * @brief The log ring, [start, end). The flight directory follows it.
+ */
+void flash_log_get_bounds(uint32_t* start, uint32_t* end);
+
+/**
+ * @brief Streams the raw chip bytes of [addr, addr + size), no ring wrapping.
+ */
+esp_err_t flash_log_read_range(uint32_t addr, uint32_t size, flash_log_range_sink_t sink, void* ctx);
+
 
 
 esp_err_t flash_log_init(void);
@@ -80,9 +195,62 @@ esp_err_t flash_log_set_gps_data(uint32_t utc_time, uint32_t utc_date, int32_t l
 
 esp_err_t flash_log_finish_flight(uint32_t duration);
 
-
-
-esp_err_t flash_log_clear_flights(void);
+/**
+ * @brief Stores the loop profile of one stage in the header of the current flight,
+ *        written when it finishes.
+ */
+esp_err_t flash_log_set_stage_profile(uint32_t stage, uint32_t mean_us, uint32_t p99_us, uint32_t max_us);
+
+/**
+ * @brief Resolution of the raw accel and ang_vel counts, recorded in the header of the next flights.
+ */
+void flash_log_set_imu_scale(float accel_scale, float ang_vel_scale);
+
+/**
+ * @brief Minimum ms between logged samples in a phase, indexed by flash_payload_t.phase.
+ *        0 logs every sample. Applied by the producer, recorded in each flight header.
+ */
+uint16_t flash_log_phase_interval(uint8_t phase);
+
+/**
+ * @brief Holds a sample in the pre-trigger RAM ring, overwriting the oldest one. No flash access.
+ */
+void flash_log_history_push(const flash_payload_t *payload);
+
+/**
+ * @brief Appends the held samples to the current flight, oldest first, and empties the ring.
+ *        Call before the first live sample so the history lands ahead of it.
+ */
+esp_err_t flash_log_history_flush(void);
+
+/**
+ * @brief Verifies or erases one sector ahead of the write position, reclaiming the
+ *        oldest flight when the log wraps. Blocks for up to a sector erase, call it
+ *        whenever the writer can afford that, in flight too. No-op once the window is full.
+ */
+esp_err_t flash_log_erase_ahead(void);
+
+/**
+ * @brief Bytes known to be erased ahead of the write position.
+ */
+uint32_t flash_log_get_erased_ahead(void);
+
+/**
+ * @brief Pages dropped in the current flight because they reached unerased flash.
+ */
+uint32_t flash_log_get_overrun_pages(void);
+
+/**
+ * @brief Write path counters, for measuring the logging budget.
+ */
+void flash_log_get_stats(flash_log_stats_t *stats);
+
+
+
+/**
+ * @brief Erases every flight with block erases where aligned. progress may be NULL.
+ */
+esp_err_t flash_log_clear_flights(flash_log_progress_t progress, void* ctx);
 
 esp_err_t flash_log_clear(uint32_t last_sector_idx);
 
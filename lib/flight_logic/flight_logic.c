@@ -5,11 +5,12 @@
 #define DESCENT_MAX_TIME 30000 // ms
 #define EJECTION_MAX_TIME 2000 // ms
 
+// confirmations are times, so they hold at any loop rate: the spans of 5 baro and 3 loop samples at 25 Hz
 #define EJECTION_MIN_ALTITUDE 10.0f
 #define EJECTION_ALTITUDE_THRESHOLD 0.5f
-#define EJECTION_CONFIRMATION_COUNT 5
+#define EJECTION_CONFIRMATION_TIME 160 // ms
 
-#define LAUNCH_CONFIRMATION_COUNT 3
+#define LAUNCH_CONFIRMATION_TIME 80 // ms
 #define LAUNCH_ACC_THRESHOLD 2.0f
 
 #define _acc_threshold2 (LAUNCH_ACC_THRESHOLD*LAUNCH_ACC_THRESHOLD)
@@ -59,8 +60,10 @@ void flight_logic_init(flight_logic_t *core) {
 void flight_logic_update(flight_logic_t *core) {
     static float prev_pressure = 0.0f;
     static float max_altitude_baro = -999.9f;
-    static uint32_t liftoff_count = 0;
-    static uint32_t parachute_ejection_count = 0;
+    static bool liftoff_pending = false;
+    static uint32_t liftoff_ut = 0;
+    static bool ejection_pending = false;
+    static uint32_t ejection_ut = 0;
     static uint32_t descent_time = 0;
     static uint32_t ut_ref = 0;
 
@@ -98,15 +101,19 @@ void flight_logic_update(flight_logic_t *core) {
 
             // liftoff detection
             if (core->state.accel.x*core->state.accel.x + core->state.accel.y*core->state.accel.y + core->state.accel.z*core->state.accel.z > _acc_threshold2) {
-                liftoff_count++;
-                if (liftoff_count >= LAUNCH_CONFIRMATION_COUNT) {
+                if (!liftoff_pending) {
+                    liftoff_pending = true;
+                    liftoff_ut = core->state.ut;
+                }
+
+                if (core->state.ut - liftoff_ut >= LAUNCH_CONFIRMATION_TIME) {
                     core->state.phase = PHASE_ASCENT;
                 }
             } else {
-                liftoff_count = 0;
+                liftoff_pending = false;
             }
 
-            // ESP_LOGI(TAG, "ascent_count: %d", liftoff_count);
+            // ESP_LOGI(TAG, "liftoff for %lu ms", core->state.ut - liftoff_ut);
             break;
 
         case PHASE_ASCENT:
@@ -119,11 +126,14 @@ void flight_logic_update(flight_logic_t *core) {
             // altitude tracking
             if (core->altitude_baro > max_altitude_baro) {
                 max_altitude_baro = core->altitude_baro;
-                parachute_ejection_count = 0; // reset count
+                ejection_pending = false; // reset confirmation
             } else if (max_altitude_baro - core->altitude_baro >= EJECTION_ALTITUDE_THRESHOLD) {
-                parachute_ejection_count++;
+                if (!ejection_pending) {
+                    ejection_pending = true;
+                    ejection_ut = core->state.ut;
+                }
 
-                if (parachute_ejection_count >= EJECTION_CONFIRMATION_COUNT) { // EJECT
+                if (core->state.ut - ejection_ut >= EJECTION_CONFIRMATION_TIME) { // EJECT
                     core->state.phase = PHASE_PARACHUTE_DEPLOY;
                 }
             }
@@ -0,0 +1,241 @@
+#include "imu_fifo.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include <string.h>
+
+static const char *TAG = "imu_fifo";
+
+#define IMU_FIFO_TASK_STACK 4096
+#define IMU_FIFO_TASK_PRIORITY 6 // above flash and lora, it mostly waits on the bus
+
+// a full FIFO: a larger read could only return a misaligned overflow
+#define MAX_FRAMES (MPU6050_FIFO_SIZE / sizeof(mpu6050_raw_motion_t))
+
+// a batch without any INT edge for this long is read anyway
+#define INT_TIMEOUT_BATCHES 2
+
+static mpu6050_dev_t *imu_dev;
+static TaskHandle_t reader_task;
+static QueueHandle_t sample_queue;
+static uint32_t period_us;
+static uint32_t batch_samples;
+
+// data ready edges, counted by the ISR: edge k is the sampling instant of FIFO frame k
+static portMUX_TYPE edge_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t edges;
+static int64_t last_edge_us;
+
+static uint32_t consumed; // frames read since the FIFO was last reset
+
+static mpu6050_raw_motion_t frames[MAX_FRAMES];
+
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static imu_fifo_stats_t stats;
+
+static void IRAM_ATTR imu_fifo_on_int(void *arg) {
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL_ISR(&edge_mux);
+    last_edge_us = now;
+    uint32_t count = ++edges;
+    portEXIT_CRITICAL_ISR(&edge_mux);
+
+    if (count % batch_samples != 0) return;
+
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(reader_task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void snapshot_edges(uint32_t *count, int64_t *time_us) {
+    portENTER_CRITICAL(&edge_mux);
+    *count = edges;
+    *time_us = last_edge_us;
+    portEXIT_CRITICAL(&edge_mux);
+}
+
+static esp_err_t reset_fifo(void) {
+    esp_err_t ret = mpu6050_set_fifo_enabled(imu_dev, false);
+    if (ret == ESP_OK) ret = mpu6050_reset_fifo(imu_dev);
+    if (ret == ESP_OK) ret = mpu6050_set_fifo_enabled(imu_dev, true);
+
+    // the next frame belongs to the next edge, within one sample
+    int64_t unused;
+    snapshot_edges(&consumed, &unused);
+
+    return ret;
+}
+
+static void queue_sample(const imu_sample_t *sample) {
+    if (xQueueSend(sample_queue, sample, 0) == pdTRUE) return;
+
+    // keep the newest sample
+    imu_sample_t discarded;
+    xQueueReceive(sample_queue, &discarded, 0);
+    xQueueSend(sample_queue, sample, 0);
+
+    portENTER_CRITICAL(&stats_mux);
+    stats.queue_dropped++;
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+static void imu_fifo_task(void *arg) {
+    TickType_t timeout = pdMS_TO_TICKS(INT_TIMEOUT_BATCHES * IMU_FIFO_BATCH_MS) + 1;
+    uint32_t seen_edges = 0;
+
+    while (1) {
+        bool notified = ulTaskNotifyTake(pdTRUE, timeout) > 0;
+
+        // taken before FIFO_COUNT: the read can hold at most one frame past the newest edge
+        uint32_t edge_count;
+        int64_t edge_us;
+        snapshot_edges(&edge_count, &edge_us);
+
+        size_t n;
+        esp_err_t ret = mpu6050_get_fifo_motion(imu_dev, frames, MAX_FRAMES, &n);
+
+        if (ret == ESP_ERR_INVALID_SIZE) {
+            ESP_LOGW(TAG, "FIFO overflow, resetting");
+
+            if (reset_fifo() != ESP_OK) ESP_LOGW(TAG, "FIFO reset failed");
+
+            portENTER_CRITICAL(&stats_mux);
+            stats.fifo_overflows++;
+            portEXIT_CRITICAL(&stats_mux);
+            continue;
+        }
+
+        if (ret != ESP_OK) {
+            portENTER_CRITICAL(&stats_mux);
+            stats.read_errors++;
+            portEXIT_CRITICAL(&stats_mux);
+            continue;
+        }
+
+        if (n == 0) continue;
+
+        // frame k was sampled at edge k: the newest edge anchors the batch, the period steps from it
+        uint32_t anchor = edge_count - 1;
+        bool has_edges = edge_count != seen_edges;
+        seen_edges = edge_count;
+
+        if (!has_edges) {
+            // INT pin silent: the newest frame is about as old as the read
+            anchor = consumed + n - 1;
+            edge_us = esp_timer_get_time();
+        } else {
+            // a missed edge shifts the pairing, realign on the newest frame
+            int32_t lead = (int32_t)(consumed + n - 1 - anchor);
+            if (lead < 0 || lead > 1) consumed = anchor + 1 - n;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            imu_sample_t sample = {
+                .ut_us = edge_us + (int64_t)(int32_t)(consumed + i - anchor) * period_us,
+                .motion = frames[i],
+            };
+            queue_sample(&sample);
+        }
+
+        consumed += n;
+
+        portENTER_CRITICAL(&stats_mux);
+        stats.samples += n;
+        stats.batches++;
+        if (n > stats.max_batch) stats.max_batch = n;
+        if (!notified) stats.int_timeouts++;
+        portEXIT_CRITICAL(&stats_mux);
+    }
+}
+
+esp_err_t imu_fifo_start(mpu6050_dev_t *dev, gpio_num_t int_pin, uint32_t rate_hz, int core) {
+    if (imu_dev != NULL) return ESP_ERR_INVALID_STATE;
+    if (rate_hz == 0 || rate_hz > IMU_FIFO_BASE_RATE_HZ) return ESP_ERR_INVALID_ARG;
+
+    // sample rate = 1 kHz / (1 + divider)
+    uint8_t divider = IMU_FIFO_BASE_RATE_HZ / rate_hz - 1;
+    rate_hz = IMU_FIFO_BASE_RATE_HZ / (divider + 1);
+
+    period_us = 1000000 / rate_hz;
+    batch_samples = rate_hz * IMU_FIFO_BATCH_MS / 1000;
+    if (batch_samples == 0) batch_samples = 1;
+
+    imu_dev = dev;
+
+    sample_queue = xQueueCreate(IMU_FIFO_QUEUE_SIZE, sizeof(imu_sample_t));
+    if (sample_queue == NULL) return ESP_ERR_NO_MEM;
+
+    // accel then gyro, 12 byte frames; a 50 us pulse per sample needs no status read to clear
+    esp_err_t ret = mpu6050_set_rate(dev, divider);
+    if (ret == ESP_OK) ret = mpu6050_set_interrupt_mode(dev, MPU6050_INT_LEVEL_HIGH);
+    if (ret == ESP_OK) ret = mpu6050_set_interrupt_drive(dev, MPU6050_INT_PUSH_PULL);
+    if (ret == ESP_OK) ret = mpu6050_set_interrupt_latch(dev, MPU6050_INT_LATCH_PULSE);
+    if (ret == ESP_OK) ret = mpu6050_set_temp_fifo_enabled(dev, false);
+    if (ret == ESP_OK) ret = mpu6050_set_accel_fifo_enabled(dev, true);
+    if (ret == ESP_OK) ret = mpu6050_set_gyro_fifo_enabled(dev, MPU6050_X_AXIS, true);
+    if (ret == ESP_OK) ret = mpu6050_set_gyro_fifo_enabled(dev, MPU6050_Y_AXIS, true);
+    if (ret == ESP_OK) ret = mpu6050_set_gyro_fifo_enabled(dev, MPU6050_Z_AXIS, true);
+    if (ret != ESP_OK) return ret;
+
+    gpio_config_t int_conf = {
+        .pin_bit_mask = 1ULL << int_pin,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_POSEDGE,
+    };
+    ret = gpio_config(&int_conf);
+    if (ret != ESP_OK) return ret;
+
+    // shared with other pins, may already be installed
+    ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) return ret;
+
+    imu_fifo_reset_stats();
+    stats.rate_hz = rate_hz;
+
+    ret = reset_fifo();
+    if (ret != ESP_OK) return ret;
+
+    // the reader exists before the first edge can notify it
+    if (xTaskCreatePinnedToCore(imu_fifo_task, "imu_fifo", IMU_FIFO_TASK_STACK, NULL, IMU_FIFO_TASK_PRIORITY, &reader_task, core) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ret = gpio_isr_handler_add(int_pin, imu_fifo_on_int, NULL);
+    if (ret != ESP_OK) return ret;
+
+    ret = mpu6050_set_int_enabled(dev, MPU6050_INT_DATA_READY);
+    if (ret != ESP_OK) return ret;
+
+    ESP_LOGI(TAG, "IMU at %lu Hz, %lu samples per batch", rate_hz, batch_samples);
+    return ESP_OK;
+}
+
+bool imu_fifo_receive(imu_sample_t *sample) {
+    if (sample_queue == NULL) return false;
+
+    return xQueueReceive(sample_queue, sample, 0) == pdTRUE;
+}
+
+void imu_fifo_get_stats(imu_fifo_stats_t *out) {
+    portENTER_CRITICAL(&stats_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+void imu_fifo_reset_stats(void) {
+    portENTER_CRITICAL(&stats_mux);
+
+    uint32_t rate_hz = stats.rate_hz;
+    memset(&stats, 0, sizeof(stats));
+    stats.rate_hz = rate_hz;
+
+    portEXIT_CRITICAL(&stats_mux);
+}
@@ -0,0 +1,49 @@
+#ifndef __IMU_FIFO_H__
+#define __IMU_FIFO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+
+#include "mpu6050.h"
+
+// gyro output rate with the DLPF on, the sample rate divides it
+#define IMU_FIFO_BASE_RATE_HZ 1000
+#define IMU_FIFO_BATCH_MS 10 // the reader wakes once per batch, not per sample
+#define IMU_FIFO_QUEUE_SIZE 128 // samples
+
+typedef struct {
+    int64_t ut_us; // sampling instant on the esp_timer clock, reconstructed from the INT edges
+    mpu6050_raw_motion_t motion;
+} imu_sample_t;
+
+typedef struct {
+    uint32_t rate_hz;
+    uint32_t samples;
+    uint32_t batches; // FIFO reads
+    uint32_t max_batch; // samples
+    uint32_t fifo_overflows; // FIFO resets, the samples it held are lost
+    uint32_t queue_dropped; // oldest samples dropped for a slow consumer
+    uint32_t int_timeouts; // batches read without an INT edge, timed from the read instead
+    uint32_t read_errors;
+} imu_fifo_stats_t;
+
+/**
+ * @brief Streams accel and gyro samples through the MPU6050 FIFO at rate_hz.
+ *        The data ready interrupt on int_pin paces a reader task pinned to core,
+ *        which burst-reads each batch. The DLPF must be on (modes 1 to 6).
+ */
+esp_err_t imu_fifo_start(mpu6050_dev_t *dev, gpio_num_t int_pin, uint32_t rate_hz, int core);
+
+/**
+ * @brief Takes the oldest sample without blocking.
+ * @return false if none is queued.
+ */
+bool imu_fifo_receive(imu_sample_t *sample);
+
+void imu_fifo_get_stats(imu_fifo_stats_t *stats);
+
+void imu_fifo_reset_stats(void);
+
+#endif
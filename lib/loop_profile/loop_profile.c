@@ -0,0 +1,123 @@
+#include "loop_profile.h"
+
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+
+#include <string.h>
+
+// log-linear histogram: 4 buckets per power of two of the cycle count
+#define SUB_BUCKETS 4
+#define BUCKETS (32 * SUB_BUCKETS)
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t hist[BUCKETS];
+} accumulator_t;
+
+static accumulator_t window[PROFILE_STAGE_COUNT];
+static accumulator_t total[PROFILE_STAGE_COUNT];
+static loop_profile_stats_t window_stats[PROFILE_STAGE_COUNT];
+
+static uint32_t iteration_start;
+static uint32_t last_mark;
+static uint32_t window_iterations;
+
+static inline uint32_t bucket_of(uint32_t cycles) {
+    if (cycles < SUB_BUCKETS) return cycles;
+
+    uint32_t exp = 31 - __builtin_clz(cycles);
+    uint32_t sub = (cycles >> (exp - 2)) & (SUB_BUCKETS - 1);
+
+    return (exp - 1) * SUB_BUCKETS + sub;
+}
+
+// largest cycle count that falls in bucket
+static inline uint32_t bucket_top(uint32_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+
+    uint32_t exp = bucket / SUB_BUCKETS + 1;
+    uint32_t sub = bucket % SUB_BUCKETS;
+
+    return (uint32_t)((((uint64_t)(SUB_BUCKETS + sub + 1)) << (exp - 2)) - 1);
+}
+
+static inline void accumulate(accumulator_t *acc, uint32_t cycles) {
+    if (acc->count == 0 || cycles < acc->min) acc->min = cycles;
+    if (cycles > acc->max) acc->max = cycles;
+    acc->sum += cycles;
+    acc->count++;
+    acc->hist[bucket_of(cycles)]++;
+}
+
+static void summarize(const accumulator_t *acc, loop_profile_stats_t *stats) {
+    uint32_t cycles_per_us = esp_rom_get_cpu_ticks_per_us();
+
+    memset(stats, 0, sizeof(*stats));
+    if (acc->count == 0) return;
+
+    // first bucket holding the 99th percentile sample
+    uint32_t rank = acc->count - acc->count / 100;
+    uint32_t seen = 0;
+    uint32_t p99 = acc->max;
+
+    for (uint32_t i = 0; i < BUCKETS; i++) {
+        seen += acc->hist[i];
+        if (seen >= rank) {
+            p99 = bucket_top(i);
+            break;
+        }
+    }
+
+    if (p99 > acc->max) p99 = acc->max;
+
+    stats->count = acc->count;
+    stats->min_us = acc->min / cycles_per_us;
+    stats->mean_us = (uint32_t)(acc->sum / acc->count / cycles_per_us);
+    stats->p99_us = p99 / cycles_per_us;
+    stats->max_us = acc->max / cycles_per_us;
+}
+
+static inline void record(loop_profile_stage_t stage, uint32_t cycles) {
+    accumulate(&window[stage], cycles);
+    accumulate(&total[stage], cycles);
+}
+
+void loop_profile_begin(void) {
+    iteration_start = esp_cpu_get_cycle_count();
+    last_mark = iteration_start;
+}
+
+void loop_profile_mark(loop_profile_stage_t stage) {
+    uint32_t now = esp_cpu_get_cycle_count();
+
+    // wrapping subtraction: the counter rolls over every ~18 s at 240 MHz
+    record(stage, now - last_mark);
+    last_mark = now;
+}
+
+void loop_profile_end(void) {
+    record(PROFILE_LOOP, esp_cpu_get_cycle_count() - iteration_start);
+
+    if (++window_iterations < LOOP_PROFILE_WINDOW) return;
+
+    // publish the window, the summaries are only computed here
+    for (uint32_t i = 0; i < PROFILE_STAGE_COUNT; i++) summarize(&window[i], &window_stats[i]);
+
+    memset(window, 0, sizeof(window));
+    window_iterations = 0;
+}
+
+void loop_profile_get_window(loop_profile_stage_t stage, loop_profile_stats_t *stats) {
+    *stats = window_stats[stage];
+}
+
+void loop_profile_get_total(loop_profile_stage_t stage, loop_profile_stats_t *stats) {
+    summarize(&total[stage], stats);
+}
+
+void loop_profile_reset(void) {
+    memset(total, 0, sizeof(total));
+}
@@ -0,0 +1,58 @@
+#ifndef __LOOP_PROFILE_H__
+#define __LOOP_PROFILE_H__
+
+#include <stdint.h>
+
+// iterations per rolling window
+#define LOOP_PROFILE_WINDOW 256
+
+// stages of the avionics loop, in execution order
+typedef enum {
+    PROFILE_BMP280,
+    PROFILE_MPU6050,
+    PROFILE_GPS,
+    PROFILE_BATTERY,
+    PROFILE_TELECOMMAND,
+    PROFILE_FLIGHT_LOGIC,
+    PROFILE_LOG,
+    PROFILE_OUTPUT, // telemetry and flash hand-off
+    PROFILE_LOOP, // whole iteration, wake-up to the last stage
+    PROFILE_STAGE_COUNT,
+} loop_profile_stage_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t mean_us;
+    uint32_t p99_us; // upper edge of the histogram bucket, within 25%
+    uint32_t max_us;
+} loop_profile_stats_t;
+
+/**
+ * @brief Starts an iteration. Call from one task only, pinned to a core: the cycle counter is per core.
+ */
+void loop_profile_begin(void);
+
+/**
+ * @brief Charges the cycles since the previous mark, or since loop_profile_begin(), to stage.
+ */
+void loop_profile_mark(loop_profile_stage_t stage);
+
+/**
+ * @brief Ends an iteration and charges it whole to PROFILE_LOOP.
+ */
+void loop_profile_end(void);
+
+/**
+ * @brief Stage statistics over the last complete window of LOOP_PROFILE_WINDOW iterations.
+ */
+void loop_profile_get_window(loop_profile_stage_t stage, loop_profile_stats_t *stats);
+
+/**
+ * @brief Stage statistics since the last loop_profile_reset().
+ */
+void loop_profile_get_total(loop_profile_stage_t stage, loop_profile_stats_t *stats);
+
+void loop_profile_reset(void);
+
+#endif
@@ -0,0 +1,131 @@
+#include "loop_timer.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "driver/gptimer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <string.h>
+
+static const char *TAG = "loop_timer";
+
+#define TIMER_RESOLUTION_HZ 1000000 // 1 us per count
+
+// a wait longer than this many periods means the timer stopped
+#define WAIT_TIMEOUT_PERIODS 10
+
+static gptimer_handle_t timer;
+static TaskHandle_t loop_task;
+static uint32_t period_us;
+
+// nominal start of period n is start_us + n * period_us
+static int64_t start_us;
+static uint32_t consumed; // periods the task has been notified of
+
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static loop_timer_stats_t stats;
+static uint64_t total_jitter_us;
+
+static bool IRAM_ATTR loop_timer_on_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *ctx) {
+    BaseType_t woken = pdFALSE;
+
+    vTaskNotifyGiveFromISR(loop_task, &woken);
+
+    return woken == pdTRUE;
+}
+
+esp_err_t loop_timer_start(uint32_t rate_hz) {
+    if (timer != NULL) return ESP_ERR_INVALID_STATE;
+    if (rate_hz < LOOP_TIMER_MIN_RATE_HZ || rate_hz > LOOP_TIMER_MAX_RATE_HZ) return ESP_ERR_INVALID_ARG;
+
+    loop_task = xTaskGetCurrentTaskHandle();
+    period_us = TIMER_RESOLUTION_HZ / rate_hz;
+
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = TIMER_RESOLUTION_HZ,
+    };
+
+    esp_err_t ret = gptimer_new_timer(&timer_config, &timer);
+    if (ret != ESP_OK) return ret;
+
+    gptimer_event_callbacks_t callbacks = { .on_alarm = loop_timer_on_alarm };
+    ret = gptimer_register_event_callbacks(timer, &callbacks, NULL);
+    if (ret != ESP_OK) return ret;
+
+    // the alarm reloads in hardware, so periods never accumulate software latency
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = period_us,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    ret = gptimer_set_alarm_action(timer, &alarm_config);
+    if (ret != ESP_OK) return ret;
+
+    ret = gptimer_enable(timer);
+    if (ret != ESP_OK) return ret;
+
+    loop_timer_reset_stats();
+    stats.rate_hz = rate_hz;
+
+    consumed = 0;
+    start_us = esp_timer_get_time();
+
+    ret = gptimer_start(timer);
+    if (ret != ESP_OK) return ret;
+
+    ESP_LOGI(TAG, "Loop at %lu Hz (%lu us)", rate_hz, period_us);
+    return ESP_OK;
+}
+
+esp_err_t loop_timer_wait(void) {
+    if (timer == NULL) return ESP_ERR_INVALID_STATE;
+
+    TickType_t timeout = pdMS_TO_TICKS(WAIT_TIMEOUT_PERIODS * period_us / 1000) + 1;
+    // the notification value counts the periods fired since the last wait
+    uint32_t pending = ulTaskNotifyTake(pdTRUE, timeout);
+    if (pending == 0) return ESP_ERR_TIMEOUT;
+
+    int64_t now = esp_timer_get_time();
+
+    // run once for the newest period, the ones in between are lost
+    uint32_t missed = pending - 1;
+    consumed += pending;
+
+    int32_t jitter = (int32_t)(now - (start_us + (int64_t)consumed * period_us));
+    uint32_t abs_jitter = jitter < 0 ? -jitter : jitter;
+
+    portENTER_CRITICAL(&stats_mux);
+
+    if (stats.periods == 0 || jitter < stats.min_jitter_us) stats.min_jitter_us = jitter;
+    if (stats.periods == 0 || jitter > stats.max_jitter_us) stats.max_jitter_us = jitter;
+
+    stats.periods++;
+    stats.missed += missed;
+    total_jitter_us += abs_jitter;
+    stats.avg_jitter_us = total_jitter_us / stats.periods;
+
+    portEXIT_CRITICAL(&stats_mux);
+
+    return ESP_OK;
+}
+
+void loop_timer_get_stats(loop_timer_stats_t *out) {
+    portENTER_CRITICAL(&stats_mux);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+void loop_timer_reset_stats(void) {
+    portENTER_CRITICAL(&stats_mux);
+
+    uint32_t rate_hz = stats.rate_hz;
+    memset(&stats, 0, sizeof(stats));
+    stats.rate_hz = rate_hz;
+    total_jitter_us = 0;
+
+    portEXIT_CRITICAL(&stats_mux);
+}
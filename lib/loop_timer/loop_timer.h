@@ -0,0 +1,36 @@
+#ifndef __LOOP_TIMER_H__
+#define __LOOP_TIMER_H__
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define LOOP_TIMER_MIN_RATE_HZ 1
+#define LOOP_TIMER_MAX_RATE_HZ 1000
+
+/**
+ * @brief Wake-up timing of the loop, relative to the nominal start of each period.
+ */
+typedef struct {
+    uint32_t rate_hz;
+    uint32_t periods; // waits that returned
+    uint32_t missed; // periods that fired while the loop was still busy
+    int32_t min_jitter_us;
+    int32_t max_jitter_us;
+    uint32_t avg_jitter_us; // mean absolute deviation
+} loop_timer_stats_t;
+
+/**
+ * @brief Starts a hardware timer that wakes the calling task at rate_hz, independent of the FreeRTOS tick.
+ */
+esp_err_t loop_timer_start(uint32_t rate_hz);
+
+/**
+ * @brief Blocks until the next period. A period that already fired returns at once, several count as missed.
+ */
+esp_err_t loop_timer_wait(void);
+
+void loop_timer_get_stats(loop_timer_stats_t *stats);
+
+void loop_timer_reset_stats(void);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef __MATH_HELPER_H__
 #define __MATH_HELPER_H__
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,6 +13,13 @@ typedef struct {
     float z;
 } vector3f_t;
 
+// fixed point, in the units of the sensor that produced it
+typedef struct {
+    int16_t x;
+    int16_t y;
+    int16_t z;
+} vector3s_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,11 +31,18 @@ typedef struct __attribute__((packed)) {
 } telecommand_packet_t;
 
 // downlink
+
+// fixed-point scales of the lora_payload_t magnitudes, TMTC_SCALE_<field>
+#define TMTC_SCALE_ACCEL_MAG 1000.0f // mg
+#define TMTC_SCALE_ANG_VEL_MAG 10.0f
+
+// a magnitude that is NaN, larger ones saturate at TMTC_FIXED_INVALID - 1
+#define TMTC_FIXED_INVALID 0xFFFF
 typedef struct __attribute__((packed)) {
     uint32_t ut;
 
-    float accel_mag;
-    float ang_vel_mag;
+    uint16_t accel_mag; // g * TMTC_SCALE_ACCEL_MAG
+    uint16_t ang_vel_mag; // deg/s * TMTC_SCALE_ANG_VEL_MAG
     float pressure;
     float temperature;
     float altitude;
@@ -46,6 +53,10 @@ typedef struct __attribute__((packed)) {
     float v_bat;
 
     uint8_t phase;
+
+    // avionics loop profile over the last window
+    uint8_t loop_load; // p99 of the iteration time, percent of the period
+    uint8_t loop_slowest; // loop_profile_stage_t with the highest p99
 } lora_payload_t;
 
 typedef struct __attribute__((packed)) {
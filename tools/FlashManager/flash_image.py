@@ -0,0 +1,110 @@
+import mmap
+import struct
+from pathlib import Path
+
+from logger import Logger
+
+from parser import parse_flash_dir_size, unpack_flash_header
+
+class FlashImage:
+    """Whole-chip dump opened with mmap, parsed in place without the board."""
+
+    def __init__(self, path, link):
+        self.link = link
+        self.path = Path(path)
+
+        self.file = open(self.path, "rb")
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+
+        flash_dir_path = (Path(__file__).resolve().parent / "../../lib/flash_log/flash_dir.h").resolve()
+
+        # the log ring ends where the flight directory starts
+        self.log_start = 0
+        self.log_end = len(self.map) - parse_flash_dir_size(flash_dir_path)
+
+        self.headers = self._scan_headers()
+
+        Logger.info(f"{self.path.name}: {len(self.map)} bytes, {len(self.headers)} flights")
+
+    def close(self):
+        self.map.close()
+        self.file.close()
+
+    def _header_at(self, addr):
+        if addr + self.link.HEADER_SIZE > self.log_end: return None
+        if self.map[addr:addr + self.link.HEADER_MAGIC_SIZE] != self.link.HEADER_MAGIC_BYTES: return None
+
+        header = unpack_flash_header(self.map[addr:addr + self.link.HEADER_SIZE], self.link.HEADER_FORMAT, self.link.HEADER_FIELDS)
+        header["header_addr"] = addr
+
+        return header
+
+    def _scan_headers(self):
+        headers = {}
+
+        # current formats start headers on page boundaries
+        for addr in range(self.log_start, self.log_end, self.link.PAGE_SIZE):
+            header = self._header_at(addr)
+            if header is not None: headers[addr] = header
+
+        # older ones pack the next header right after the last packet: follow the chain
+        pending = list(headers.values())
+        while pending:
+            next_addr = pending.pop()["next_header_addr"]
+            if next_addr == 0xFFFFFFFF or next_addr in headers: continue
+
+            header = self._header_at(self._wrap(next_addr))
+            if header is not None:
+                headers[header["header_addr"]] = header
+                pending.append(header)
+
+        return sorted(headers.values(), key=lambda header: header["flight_number"])
+
+    def _wrap(self, addr):
+        return self.log_start + (addr - self.log_end) if addr >= self.log_end else addr
+
+    def _distance(self, from_addr, to_addr):
+        return to_addr - from_addr if to_addr >= from_addr else (self.log_end - from_addr) + (to_addr - self.log_start)
+
+    def _flight_size(self, header):
+        addr = header["header_addr"]
+
+        if header["next_header_addr"] != 0xFFFFFFFF:
+            return self._distance(addr, self._wrap(header["next_header_addr"]))
+
+        # unfinished: up to the next header or the first erased page
+        size = min((self._distance(addr, other["header_addr"]) for other in self.headers if other is not header), default=self.log_end - self.log_start)
+        blank_page = b'\xff' * self.link.PAGE_SIZE
+
+        for offset in range(self.link.PAGE_SIZE, size, self.link.PAGE_SIZE):
+            page_addr = self._wrap(addr + offset)
+            if self.map[page_addr:page_addr + self.link.PAGE_SIZE] == blank_page: return offset
+
+        return size
+
+    def get_header(self, flight_number):
+        for header in self.headers:
+            if header["flight_number"] == flight_number: return header
+        return None
+
+    def flight_bytes(self, flight_number):
+        """The flight from its header on: a view into the map, or a copy when it wraps around the ring."""
+        header = self.get_header(flight_number)
+        if header is None: return None
+
+        addr = header["header_addr"]
+        size = self._flight_size(header)
+
+        if addr + size <= self.log_end:
+            return memoryview(self.map)[addr:addr + size]
+
+        first = self.log_end - addr
+        return self.map[addr:self.log_end] + self.map[self.log_start:self.log_start + size - first]
+
+    def read_flight(self, flight_number) -> list[dict]:
+        flight = self.flight_bytes(flight_number)
+        if flight is None:
+            Logger.error(f"Flight {flight_number} not in {self.path.name}")
+            return []
+
+        return self.link.decode_flight(flight)
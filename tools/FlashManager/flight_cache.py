@@ -0,0 +1,27 @@
+from pathlib import Path
+
+class FlightCache:
+    """Flight bytes downloaded so far, kept on disk so that interrupted downloads resume."""
+
+    def __init__(self, cache_dir=None):
+        self.cache_dir = Path(cache_dir) if cache_dir else Path.home() / ".cache" / "FlashManager"
+        self.cache_dir.mkdir(parents=True, exist_ok=True)
+
+    @staticmethod
+    def key(flight_number, header_addr, size):
+        # flight numbers restart after a clear, the address and size tell flights apart
+        return f"flight_{flight_number}_{header_addr:08x}_{size}"
+
+    def _path(self, key):
+        return self.cache_dir / f"{key}.bin"
+
+    def load(self, key) -> bytes:
+        path = self._path(key)
+        return path.read_bytes() if path.exists() else b''
+
+    def append(self, key, data):
+        with open(self._path(key), "ab") as f:
+            f.write(data)
+
+    def drop(self, key):
+        self._path(key).unlink(missing_ok=True)
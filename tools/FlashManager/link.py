@@ -6,7 +6,8 @@ from pathlib import Path
 
 from logger import Logger
 
-from parser import parse_flash_header, parse_flash_packet, parse_flash_interface
+from parser import parse_profile_stages, header_loop_profile, phase_intervals, tag_sample_intervals, parse_flash_header, parse_flash_packet, parse_flash_interface, parse_flash_bulk, parse_flash_struct, crc16, parse_flash_layout, parse_flash_codec, parse_flash_trailer, unpack_flash_header, flight_packet_offsets, iter_flight_samples, decode_codec_samples, parse_raw_imu_version, legacy_packet_format, scale_imu_fields, scale_imu_counts
+from flight_cache import FlightCache
 
 class Link:
     def __init__(self):
@@ -18,6 +19,8 @@ class Link:
         base_dir = Path(__file__).resolve().parent
         flash_log_path = (base_dir / "../../lib/flash_log/flash_log.h").resolve()
         flash_interface_path = (base_dir / "../../lib/flash_log/flash_interface.h").resolve()
+        flash_codec_path = (base_dir / "../../lib/flash_log/flash_codec.h").resolve()
+        loop_profile_path = (base_dir / "../../lib/loop_profile/loop_profile.h").resolve()
 
         # get header struct
         try:
@@ -33,14 +36,51 @@ class Link:
             Logger.error(f"<Parser> Fatal error processing flash packet: {e}")
             exit()
 
+        # get flash layout
+        try:
+            self.PAGE_SIZE, self.PAGE_ALIGNED_VERSION, self.COMPRESSED_VERSION, self.TRAILER_VERSION = parse_flash_layout(flash_log_path)
+            self.TRAILER = parse_flash_trailer(flash_log_path)
+            self.RAW_IMU_VERSION = parse_raw_imu_version(flash_log_path)
+        except Exception as e:
+            Logger.error(f"<Parser> Fatal error processing flash layout: {e}")
+            exit()
+
+        # get compressed block layout
+        try:
+            self.CODEC = parse_flash_codec(flash_codec_path)
+        except Exception as e:
+            Logger.error(f"<Parser> Fatal error processing flash codec: {e}")
+            exit()
+
+        # get avionics loop stages
+        try:
+            self.PROFILE_STAGES = parse_profile_stages(loop_profile_path)
+        except Exception as e:
+            Logger.error(f"<Parser> Fatal error processing loop profile: {e}")
+            exit()
+
         # get header size
         self.HEADER_SIZE = struct.calcsize(self.HEADER_FORMAT)
 
         # get packet size
         self.PACKET_SIZE = struct.calcsize(self.PACKET_FORMAT)
 
+        # uncompressed flights before raw IMU fields stored them as floats
+        self.LEGACY_PACKET_FORMAT = legacy_packet_format(self.PACKET_FORMAT, self.PACKET_FIELDS)
+
         # get flash interface info
         self.USB_MAGIC, self.FLASH_CMD, self.FLASH_ACK, self.FLASH_NACK = parse_flash_interface(flash_interface_path)
+        self.BULK = parse_flash_bulk(flash_interface_path)
+        self.BULK_FRAME_SIZE = struct.calcsize(self.BULK["fmt"])
+        self.RANGE_FORMAT, _ = parse_flash_struct(flash_interface_path, "flash_range_t")
+        self.FLIGHT_RANGE_FORMAT, self.FLIGHT_RANGE_FIELDS = parse_flash_struct(flash_interface_path, "flash_flight_range_t")
+        self.FLIGHT_RANGE_SIZE = struct.calcsize(self.FLIGHT_RANGE_FORMAT)
+        self.PROGRESS_FORMAT, _ = parse_flash_struct(flash_interface_path, "flash_progress_t")
+        self.PROGRESS_SIZE = struct.calcsize(self.PROGRESS_FORMAT)
+        self.BULK_STATS_FORMAT, self.BULK_STATS_FIELDS = parse_flash_struct(flash_interface_path, "flash_bulk_stats_t")
+        self.BULK_STATS_SIZE = struct.calcsize(self.BULK_STATS_FORMAT)
+
+        self.cache = FlightCache()
 
     @staticmethod
     def get_available_ports():
@@ -81,9 +121,16 @@ class Link:
         self.serial_port.write(cmd_bytes)
 
 
-    def cmd_clear_flights(self) -> None:
+    def cmd_clear_flights(self, progress=None) -> bool:
+        """progress(done, total) is called for each progress frame, they are logged by default."""
+        if not self.is_running:
+            return False
+
+        self.serial_port.reset_input_buffer()
         self.transmit_cmd(self.FLASH_CMD["CMD_CLEAR_FLIGHTS"], self.USB_MAGIC)
 
+        return self._read_ack(progress or (lambda done, total: Logger.info(f"Clearing: {100 * done // total}%")))
+
     def cmd_list_headers(self) -> list[dict]:
         if not self.is_running:
             return []
@@ -100,13 +147,19 @@ class Link:
             if len(response) != self.HEADER_SIZE:
                 break
 
-            unpacked_header = struct.unpack(self.HEADER_FORMAT, response)
-            header = dict(zip(self.HEADER_FIELDS, unpacked_header))
+            header = unpack_flash_header(response, self.HEADER_FORMAT, self.HEADER_FIELDS)
 
             headers.append(header)
 
             print(header)
 
+            # headers with a summary: one table row, no packet download needed
+            if header.get("samples") not in (None, 0xFFFFFFFF):
+                Logger.info(
+                    f"Flight {header['flight_number']}: {header['duration'] / 1000:.1f} s, {header['samples']} samples, "
+                    f"apogee {header['max_altitude']:.1f} m, max |accel| {header['max_accel']:.2f}, min battery {header['min_v_bat']:.2f} V"
+                )
+
         return headers
 
     def cmd_read_header(self, flight_number) -> dict | None:
@@ -124,17 +177,37 @@ class Link:
             if len(response) != self.HEADER_SIZE:
                 break
 
-            unpacked_header = struct.unpack(self.HEADER_FORMAT, response)
-            header = dict(zip(self.HEADER_FIELDS, unpacked_header))
+            header = unpack_flash_header(response, self.HEADER_FORMAT, self.HEADER_FIELDS)
 
             print(header)
 
         return header
 
+    def cmd_get_loop_profile(self, flight_number) -> list[dict] | None:
+        """Avionics loop timing of a flight, stage by stage, from its header."""
+        header = self.cmd_read_header(flight_number)
+        if header is None: return None
+
+        profile = header_loop_profile(header, self.PROFILE_STAGES)
+        if profile is None:
+            Logger.warning(f"Flight {flight_number} has no loop profile")
+            return None
+
+        for row in profile:
+            Logger.info(f"{row['stage']:>14}: mean {row['mean_us']:>6} us, p99 {row['p99_us']:>6} us, max {row['max_us']:>7} us")
+
+        return profile
+
     def cmd_read_flight(self, flight_number) -> list[dict]:
         if not self.is_running:
             return []
 
+        # the header says what the IMU counts are worth
+        header = self.cmd_read_header(flight_number)
+        if header is None:
+            Logger.error("Header read failed")
+            return []
+
         self.transmit_cmd(self.FLASH_CMD["CMD_READ_FLIGHT"], flight_number)
 
         packets = []
@@ -158,6 +231,7 @@ class Link:
 
             elif sync_buffer == self.FLASH_ACK:
                 Logger.info("ACK received")
+                scale_imu_counts(packets, header)
                 break
 
             elif sync_buffer == self.PACKET_MAGIC_BYTES:
@@ -173,4 +247,355 @@ class Link:
 
                     Logger.info(packet)
 
-        return packets
\ No newline at end of file
+        return packets
+
+    def _read_ack(self, progress=None) -> bool:
+        sync_buffer = b''
+        progress_magic = self.BULK["progress_magic"]
+
+        while True:
+            rx_byte = self.serial_port.read(1)
+
+            # timeout
+            if not rx_byte: return False
+
+            sync_buffer = (sync_buffer + rx_byte)[-len(self.FLASH_ACK):]
+
+            if sync_buffer == self.FLASH_ACK: return True
+            if sync_buffer == self.FLASH_NACK: return False
+
+            # long commands stream progress frames before their ACK
+            if sync_buffer == progress_magic:
+                sync_buffer = b''
+
+                rest = self.serial_port.read(self.PROGRESS_SIZE - len(progress_magic))
+                if len(rest) != self.PROGRESS_SIZE - len(progress_magic): continue
+
+                _, done, total = struct.unpack(self.PROGRESS_FORMAT, progress_magic + rest)
+                if progress is not None and total > 0: progress(done, total)
+
+    def cmd_set_baud(self, baudrate) -> bool:
+        if not self.is_running:
+            return False
+
+        if baudrate > self.BULK["max_baud"]:
+            Logger.error(f"Baud rate {baudrate} above {self.BULK['max_baud']}")
+            return False
+
+        old_baudrate = self.serial_port.baudrate
+
+        self.serial_port.reset_input_buffer()
+        self.transmit_cmd(self.FLASH_CMD["CMD_SET_BAUD"], baudrate)
+
+        if not self._read_ack():
+            Logger.error("Baud rate refused")
+            return False
+
+        # the device falls back to the old rate if this ack never arrives
+        sleep(0.05)
+        self.serial_port.baudrate = baudrate
+        self.serial_port.reset_input_buffer()
+
+        self.transmit_cmd(self.FLASH_CMD["CMD_ACK"], 0)
+
+        if self._read_ack():
+            Logger.info(f"Baud rate set to {baudrate}")
+            return True
+
+        Logger.error(f"No answer at {baudrate}, back to {old_baudrate}")
+        self.serial_port.baudrate = old_baudrate
+        sleep(1.5) # device confirm timeout
+        self.serial_port.reset_input_buffer()
+
+        return False
+
+    def _bulk_receive(self, sink, stats=None) -> bool:
+        """Hands each chunk to sink, in order, and a stats frame sent before the ACK to stats. False if the transfer failed."""
+        magic = self.BULK["magic"]
+        stats_magic = self.BULK["stats_magic"]
+        received = 0
+        expected = 0
+        done = False
+        timeouts = 0
+        sync_buffer = b''
+
+        while True:
+            rx_byte = self.serial_port.read(1)
+
+            # timeout: the device retransmits unacknowledged chunks, ask again
+            if not rx_byte:
+                timeouts += 1
+                if timeouts > 3:
+                    Logger.error("Bulk transfer timed out")
+                    return False
+                self.transmit_cmd(self.FLASH_CMD["CMD_BULK_ACK"], expected)
+                continue
+
+            sync_buffer = (sync_buffer + rx_byte)[-len(magic):]
+
+            if sync_buffer == self.FLASH_NACK:
+                Logger.error("NACK received")
+                return False
+
+            if done and sync_buffer == self.FLASH_ACK:
+                break
+
+            if done and sync_buffer == stats_magic:
+                sync_buffer = b''
+
+                rest = self.serial_port.read(self.BULK_STATS_SIZE - len(stats_magic))
+                if len(rest) != self.BULK_STATS_SIZE - len(stats_magic): continue
+
+                if stats is not None: stats(dict(zip(self.BULK_STATS_FIELDS, struct.unpack(self.BULK_STATS_FORMAT, stats_magic + rest))))
+                continue
+
+            if sync_buffer != magic: continue
+            sync_buffer = b''
+
+            rest = self.serial_port.read(self.BULK_FRAME_SIZE - len(magic))
+            if len(rest) != self.BULK_FRAME_SIZE - len(magic): continue
+
+            frame = dict(zip(self.BULK["fields"], struct.unpack(self.BULK["fmt"], magic + rest)))
+
+            if frame["size"] > self.BULK["chunk_size"]: continue
+
+            payload = self.serial_port.read(frame["size"])
+            if len(payload) != frame["size"] or crc16(payload) != frame["crc"]:
+                Logger.debug(f"Bad chunk {frame['seq']}")
+                continue
+
+            timeouts = 0
+
+            if frame["seq"] == expected:
+                expected += 1
+
+                # empty chunk ends the transfer, the device answers with ACK once it sees our ack
+                if frame["size"] == 0:
+                    done = True
+
+                sink(payload)
+                received += len(payload)
+
+            # cumulative ack, duplicates included
+            self.transmit_cmd(self.FLASH_CMD["CMD_BULK_ACK"], expected)
+
+        Logger.debug(f"Bulk transfer: {received} bytes in {expected} chunks")
+
+        return True
+
+    def _unpack_packets(self, data) -> list[dict]:
+        packets = []
+
+        for offset in range(0, len(data) - self.PACKET_SIZE + 1, self.PACKET_SIZE):
+            unpacked_data = struct.unpack_from(self.PACKET_FORMAT, data, offset)
+            packets.append(dict(zip(self.PACKET_FIELDS, unpacked_data)))
+
+        return packets
+
+    def cmd_bulk_read_flight(self, flight_number, compressed=True) -> list[dict]:
+        if not self.is_running:
+            return []
+
+        # the header says what the IMU counts are worth
+        header = self.cmd_read_header(flight_number)
+        if header is None:
+            Logger.error("Header read failed")
+            return []
+
+        self.serial_port.reset_input_buffer()
+
+        if not compressed:
+            self.transmit_cmd(self.FLASH_CMD["CMD_BULK_READ_FLIGHT"], flight_number)
+
+            data = bytearray()
+            if not self._bulk_receive(data.extend):
+                Logger.error("Bulk read failed")
+                return []
+
+            return scale_imu_counts(self._unpack_packets(data), header)
+
+        self.transmit_cmd(self.FLASH_CMD["CMD_BULK_READ_FLIGHT_COMPRESSED"], flight_number)
+
+        packets = []
+        wire_bytes = 0
+
+        # each chunk decodes on its own, from a key frame
+        def sink(chunk):
+            nonlocal wire_bytes
+            wire_bytes += len(chunk)
+            packets.extend(decode_codec_samples(chunk, self.CODEC, self.PACKET_FORMAT, self.PACKET_FIELDS))
+
+        def stats(frame):
+            if frame["chunks"]:
+                Logger.info(f"Device encode: {frame['encode_us']} us, {frame['encode_us'] // frame['chunks']} us per chunk")
+
+        if not self._bulk_receive(sink, stats):
+            Logger.error("Bulk read failed")
+            return []
+
+        if wire_bytes:
+            Logger.info(f"Compressed read: {len(packets)} packets, {wire_bytes} bytes on the wire, {len(packets) * self.PACKET_SIZE / wire_bytes:.1f}x")
+
+        return scale_imu_counts(packets, header)
+
+    def cmd_get_flight_range(self, flight_number) -> dict | None:
+        if not self.is_running:
+            return None
+
+        self.serial_port.reset_input_buffer()
+        self.transmit_cmd(self.FLASH_CMD["CMD_GET_FLIGHT_RANGE"], flight_number)
+
+        response = self.serial_port.read(self.FLIGHT_RANGE_SIZE)
+        if len(response) != self.FLIGHT_RANGE_SIZE or not self._read_ack():
+            return None
+
+        return dict(zip(self.FLIGHT_RANGE_FIELDS, struct.unpack(self.FLIGHT_RANGE_FORMAT, response)))
+
+    def cmd_read_range(self, addr, size) -> bytes | None:
+        if not self.is_running:
+            return None
+
+        self.serial_port.reset_input_buffer()
+        self.transmit_cmd(self.FLASH_CMD["CMD_READ_RANGE"], 0)
+        self.serial_port.write(struct.pack(self.RANGE_FORMAT, addr, size))
+
+        data = bytearray()
+        if not self._bulk_receive(data.extend) or len(data) != size:
+            return None
+
+        return bytes(data)
+
+    def cmd_dump_chip(self, path) -> bool:
+        """Streams the whole chip into path, through a .part file so a failed dump never looks complete."""
+        if not self.is_running:
+            return False
+
+        path = Path(path)
+        part_path = path.with_name(path.name + ".part")
+
+        self.serial_port.reset_input_buffer()
+        self.transmit_cmd(self.FLASH_CMD["CMD_DUMP_CHIP"], 0)
+
+        written = 0
+
+        with open(part_path, "wb") as f:
+            def sink(payload):
+                nonlocal written
+                f.write(payload)
+
+                # progress every MB
+                if (written + len(payload)) >> 20 != written >> 20:
+                    Logger.info(f"Dump: {(written + len(payload)) >> 20} MB")
+                written += len(payload)
+
+            ok = self._bulk_receive(sink)
+
+        if not ok:
+            Logger.error(f"Dump failed after {written} bytes")
+            return False
+
+        part_path.replace(path)
+        Logger.info(f"Dumped {written} bytes to {path}")
+
+        return True
+
+    def _read_flight_bytes(self, flight_range, offset, size) -> bytes | None:
+        addr = flight_range["header_addr"] + offset
+        data = b''
+
+        # flights wrap from the end of the log back to its start
+        while size > 0:
+            if addr >= flight_range["log_end"]:
+                addr = flight_range["log_start"] + (addr - flight_range["log_end"])
+
+            n = min(size, flight_range["log_end"] - addr)
+
+            part = self.cmd_read_range(addr, n)
+            if part is None: return None
+
+            data += part
+            addr += n
+            size -= n
+
+        return data
+
+    def download_flight(self, flight_number, limit=None, chunk_size=64 * 1024) -> bytes | None:
+        """Flight bytes from the header on, resuming from the cache. Partial if the link drops."""
+        flight_range = self.cmd_get_flight_range(flight_number)
+        if flight_range is None:
+            Logger.error(f"Flight {flight_number} not found")
+            return None
+
+        key = FlightCache.key(flight_number, flight_range["header_addr"], flight_range["size"])
+        size = flight_range["size"] if limit is None else min(limit, flight_range["size"])
+
+        flight = self.cache.load(key)
+
+        # the slot may hold a newer flight since: compare its first page
+        if flight:
+            head = self._read_flight_bytes(flight_range, 0, min(len(flight), self.PAGE_SIZE))
+            if head is None: return flight
+            if head != flight[:len(head)]:
+                self.cache.drop(key)
+                flight = b''
+
+        while len(flight) < size:
+            data = self._read_flight_bytes(flight_range, len(flight), min(chunk_size, size - len(flight)))
+
+            if data is None:
+                Logger.warning(f"Download stopped at {len(flight)}/{flight_range['size']} bytes, it resumes on the next call")
+                break
+
+            self.cache.append(key, data)
+            flight += data
+
+        return flight[:size]
+
+    def decode_flight(self, flight) -> list[dict]:
+        """Packets of a flight, or of the downloaded part of it."""
+        if len(flight) < self.HEADER_SIZE: return []
+
+        header = unpack_flash_header(flight[:self.HEADER_SIZE], self.HEADER_FORMAT, self.HEADER_FIELDS)
+
+        if header["format_version"] >= self.COMPRESSED_VERSION:
+            packets = list(iter_flight_samples(flight, header, self.PAGE_SIZE, self.TRAILER_VERSION, self.TRAILER, self.CODEC, self.PACKET_FORMAT, self.PACKET_FIELDS))
+            scale_imu_fields(packets, header, self.RAW_IMU_VERSION, self.COMPRESSED_VERSION, self.CODEC[3])
+
+            # the sample rate changes with the phase: ut is the time base, the header says what each phase logged at
+            intervals = phase_intervals(header)
+            if intervals is not None:
+                gaps = tag_sample_intervals(packets, intervals)
+                if gaps: Logger.warning(f"Flight {header['flight_number']}: {gaps} gaps longer than the logging policy")
+
+            return packets
+
+        packets = []
+        packet_fmt = self.PACKET_FORMAT if header["format_version"] >= self.RAW_IMU_VERSION else self.LEGACY_PACKET_FORMAT
+
+        for offset in flight_packet_offsets(header, len(flight), self.PAGE_SIZE, self.PAGE_ALIGNED_VERSION):
+            if flight[offset:offset + self.PACKET_MAGIC_SIZE] != self.PACKET_MAGIC_BYTES: continue
+
+            packets.append(dict(zip(self.PACKET_FIELDS, struct.unpack_from(packet_fmt, flight, offset))))
+
+        return scale_imu_fields(packets, header, self.RAW_IMU_VERSION, self.COMPRESSED_VERSION, self.CODEC[3])
+
+    def preview_flight(self, flight_number, seconds, chunk_size=16 * 1024) -> list[dict]:
+        """Packets of the first seconds of a flight, downloading only as much as they need."""
+        limit = 0
+        packets = []
+
+        while True:
+            limit += chunk_size
+
+            flight = self.download_flight(flight_number, limit=limit, chunk_size=chunk_size)
+            if flight is None: return packets
+
+            packets = self.decode_flight(flight)
+
+            # ut is in ms
+            if packets and packets[-1]["ut"] - packets[0]["ut"] >= seconds * 1000: break
+
+            # whole flight, or the link dropped
+            if len(flight) < limit: break
+
+        return [packet for packet in packets if packet["ut"] - packets[0]["ut"] <= seconds * 1000]
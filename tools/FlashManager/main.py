@@ -1,5 +1,6 @@
 if __name__ == "__main__":
     import sys
+    import argparse
 
     from PyQt6.QtWidgets import QApplication
 
@@ -7,13 +8,19 @@ if __name__ == "__main__":
     from viewer_window import ViewerWindow
 
     from store import Store
+    from flash_image import FlashImage
 
     from widgets.graph import GraphWidget
     from widgets.status import StatusWidget
     from widgets.gps import GpsWidget
 
+    parser = argparse.ArgumentParser(description="Flash Manager")
+    parser.add_argument("--image", help="whole-chip dump (.bin) to open instead of a board")
+    parser.add_argument("--flight", type=int, help="flight to load from the image, the newest by default")
+    args, qt_args = parser.parse_known_args()
+
     # init app
-    app = QApplication(sys.argv)
+    app = QApplication(sys.argv[:1] + qt_args)
     app.setStyle("Fusion")
 
     store = Store()
@@ -94,6 +101,17 @@ if __name__ == "__main__":
         )
     )
 
+    # offline mode: parse a chip dump
+    if args.image:
+        image = FlashImage(args.image, flash_window.link)
+
+        for header in image.headers:
+            print(header)
+
+        if image.headers:
+            flight_number = args.flight if args.flight is not None else image.headers[-1]["flight_number"]
+            store.load(image.read_flight(flight_number))
+
     # display windows
     viewer_window.show()
     flash_window.show()
@@ -1,5 +1,6 @@
 import CppHeaderParser
 import struct
+import re
 
 type_map = {
     "uint32_t": 'I',
@@ -25,6 +26,12 @@ def _get_define(defines, field):
         if define.startswith(field):
             return define.replace(field, "").split("//")[0].strip()
 
+def _eval_define(expr):
+    """Value of a define made of integers and + - * / ( ), e.g. (2 * 4096)."""
+    if not re.fullmatch(r"[0-9xXa-fA-F+\-*/() ]+", expr):
+        raise ValueError(f"Unsupported define expression: {expr}")
+    return int(eval(expr, {"__builtins__": {}}))
+
 def _get_enum(enums, enum_name):
     for enum in enums:
         if enum["name"] == enum_name:
@@ -61,6 +68,80 @@ def parse_flash_interface(filepath):
 
     return usb_magic_val, enum, flash_ack_val, flash_nack_val
 
+def parse_flash_struct(filepath, struct_name):
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    struct_def = cpp_header.classes.get(struct_name)
+    if not struct_def: raise ValueError(f"Struct {struct_name} was not found.")
+
+    fmt = byte_order
+    fields = []
+
+    for prop in struct_def["properties"]["public"]:
+        if prop["type"] in type_map:
+            fmt += type_map[prop["type"]]
+            fields.append(prop["name"])
+
+    return fmt, fields
+
+def parse_flash_bulk(filepath):
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    bulk_magic_str = _get_define(cpp_header.defines, "FLASH_BULK_MAGIC")
+    chunk_size_str = _get_define(cpp_header.defines, "FLASH_BULK_CHUNK_SIZE")
+    window_str = _get_define(cpp_header.defines, "FLASH_BULK_WINDOW")
+    max_baud_str = _get_define(cpp_header.defines, "FLASH_USB_MAX_BAUD")
+    progress_magic_str = _get_define(cpp_header.defines, "FLASH_PROGRESS_MAGIC")
+    stats_magic_str = _get_define(cpp_header.defines, "FLASH_BULK_STATS_MAGIC")
+
+    if None in (bulk_magic_str, chunk_size_str, window_str, max_baud_str, progress_magic_str, stats_magic_str):
+        raise ValueError("Bulk transfer defines not found")
+
+    # get bulk frame struct
+    frame_struct = cpp_header.classes.get("flash_bulk_frame_t")
+    if not frame_struct: raise ValueError("Struct flash_bulk_frame_t was not found.")
+
+    fmt = byte_order
+    fields = []
+
+    for prop in frame_struct["properties"]["public"]:
+        if prop["type"] in type_map:
+            fmt += type_map[prop["type"]]
+            fields.append(prop["name"])
+
+    return {
+        "magic": struct.pack('<I', int(bulk_magic_str, 16)),
+        "fmt": fmt,
+        "fields": fields,
+        "chunk_size": int(chunk_size_str),
+        "window": int(window_str),
+        "max_baud": int(max_baud_str),
+        "progress_magic": struct.pack('<I', int(progress_magic_str, 16)),
+        "stats_magic": struct.pack('<I', int(stats_magic_str, 16)),
+    }
+
+def parse_profile_stages(filepath):
+    """Avionics loop stage names, in loop_profile_stage_t order."""
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+    enum = _get_enum(cpp_header.enums, "loop_profile_stage_t")
+
+    stages = sorted((value, name) for name, value in enum.items() if name != "PROFILE_STAGE_COUNT")
+    return [name.removeprefix("PROFILE_").lower() for _, name in stages]
+
+def header_loop_profile(header, stages):
+    """Per-stage loop profile stored in a flight header, None if the flight has none."""
+    if header.get("stage_max_us_0") in (None, 0xFFFFFFFF): return None
+
+    return [
+        {
+            "stage": name,
+            "mean_us": header[f"stage_mean_us_{i}"],
+            "p99_us": header[f"stage_p99_us_{i}"],
+            "max_us": header[f"stage_max_us_{i}"],
+        }
+        for i, name in enumerate(stages)
+    ]
+
 def parse_flash_header(filepath):
     cpp_header = CppHeaderParser.CppHeader(filepath)
 
@@ -81,7 +162,15 @@ def parse_flash_header(filepath):
         c_type = prop["type"]
         c_name = prop["name"]
 
-        if c_type in type_map:
+        # arrays become one field per element, name_0, name_1, ...
+        if prop.get("array") and c_type in type_map:
+            array_size = str(prop["array_size"])
+            count = int(array_size) if array_size.isdigit() else _eval_define(_get_define(cpp_header.defines, array_size))
+
+            fmt += type_map[c_type] * count
+            fields.extend(f"{c_name}_{i}" for i in range(count))
+
+        elif c_type in type_map:
             fmt += type_map[c_type]
             fields.append(c_name)
 
@@ -96,6 +185,333 @@ def parse_flash_header(filepath):
 
     return header_magic_size, header_magic_bytes, fmt, fields
 
+def parse_flash_layout(filepath):
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    page_size_str = _get_define(cpp_header.defines, "FLASH_PAGE_SIZE")
+    if page_size_str is None:
+        raise ValueError("FLASH_PAGE_SIZE not found in defines")
+
+    page_aligned_version_str = _get_define(cpp_header.defines, "FLASH_PAGE_ALIGNED_VERSION")
+    if page_aligned_version_str is None:
+        raise ValueError("FLASH_PAGE_ALIGNED_VERSION not found in defines")
+
+    compressed_version_str = _get_define(cpp_header.defines, "FLASH_COMPRESSED_VERSION")
+    if compressed_version_str is None:
+        raise ValueError("FLASH_COMPRESSED_VERSION not found in defines")
+
+    trailer_version_str = _get_define(cpp_header.defines, "FLASH_PAGE_TRAILER_VERSION")
+    if trailer_version_str is None:
+        raise ValueError("FLASH_PAGE_TRAILER_VERSION not found in defines")
+
+    return int(page_size_str), int(page_aligned_version_str), int(compressed_version_str), int(trailer_version_str)
+
+def parse_raw_imu_version(filepath):
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    raw_imu_version_str = _get_define(cpp_header.defines, "FLASH_RAW_IMU_VERSION")
+    if raw_imu_version_str is None:
+        raise ValueError("FLASH_RAW_IMU_VERSION not found in defines")
+
+    return int(raw_imu_version_str)
+
+def legacy_packet_format(packet_fmt, packet_fields):
+    """Packet format of uncompressed flights, written before accel and ang_vel became raw counts: floats instead."""
+    codes = "".join(code * int(count or 1) for count, code in re.findall(r"(\d*)([a-zA-Z])", packet_fmt))
+    codes = [("f" if re.match(r"(accel|ang_vel)_[xyz]$", name) else code) for name, code in zip(packet_fields, codes)]
+
+    return packet_fmt[0] + "".join(codes)
+
+def scale_imu_counts(packets, header):
+    """Turn accel and ang_vel counts into g and deg/s at the header's resolution, as the device decodes every flight."""
+    return _scale_imu(packets, header["accel_scale"], header["ang_vel_scale"])
+
+def scale_imu_fields(packets, header, raw_imu_version, compressed_version, scales):
+    """Turn the accel and ang_vel fields into g and deg/s, as stored by the flight's format version."""
+    version = header["format_version"]
+
+    if version >= raw_imu_version:
+        # raw counts, the header records their resolution
+        accel_scale, ang_vel_scale = header["accel_scale"], header["ang_vel_scale"]
+    elif version >= compressed_version:
+        # the codec's fixed point
+        accel_scale, ang_vel_scale = 1 / scales["accel"], 1 / scales["ang_vel"]
+    else:
+        # already floats
+        return packets
+
+    return _scale_imu(packets, accel_scale, ang_vel_scale)
+
+def _scale_imu(packets, accel_scale, ang_vel_scale):
+    for packet in packets:
+        for axis in "xyz":
+            packet[f"accel_{axis}"] *= accel_scale
+            packet[f"ang_vel_{axis}"] *= ang_vel_scale
+
+    return packets
+
+def parse_flash_dir_size(filepath):
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    # FLASH_DIR_SIZE is written in terms of FLASH_DIR_HALF_SIZE
+    half_size_str = _get_define(cpp_header.defines, "FLASH_DIR_HALF_SIZE")
+    if half_size_str is None:
+        raise ValueError("FLASH_DIR_HALF_SIZE not found in defines")
+
+    return 2 * _eval_define(half_size_str)
+
+def parse_flash_trailer(filepath):
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    # get page trailer struct
+    trailer_struct = cpp_header.classes.get("flash_page_trailer_t")
+    if not trailer_struct: raise ValueError("Struct flash_page_trailer_t was not found.")
+
+    fmt = byte_order
+    fields = []
+
+    for prop in trailer_struct["properties"]["public"]:
+        if prop["type"] in type_map:
+            fmt += type_map[prop["type"]]
+            fields.append(prop["name"])
+
+    return fmt, fields
+
+def page_trailer_valid(page, trailer, flight_number, seq):
+    """Check the trailer of a packet page: CRC over the page, flight and page index."""
+    trailer_fmt, trailer_fields = trailer
+    trailer_size = struct.calcsize(trailer_fmt)
+
+    values = dict(zip(trailer_fields, struct.unpack_from(trailer_fmt, page, len(page) - trailer_size)))
+
+    return (values["seq"] == seq and
+            values["flight"] == flight_number & 0xFFFF and
+            values["crc"] == crc16(page[:-2]))
+
+def _field_offsets(fmt, fields):
+    offsets = []
+    offset = 0
+
+    for count, code in re.findall(r"(\d*)([a-zA-Z])", fmt):
+        size = struct.calcsize(byte_order + code)
+        for _ in range(int(count or 1)):
+            offsets.append(offset)
+            offset += size
+
+    return dict(zip(fields, offsets))
+
+def unpack_flash_header(raw, fmt, fields):
+    header = dict(zip(fields, struct.unpack(fmt, raw)))
+
+    # older formats have a shorter header: fields past header_size are not part of it
+    offsets = _field_offsets(fmt, fields)
+    for field in fields:
+        if offsets[field] >= header["header_size"]:
+            header[field] = None
+
+    return header
+
+def phase_intervals(header):
+    """Logging interval policy of a flight, ms by phase (0 = every sample). None for headers written before it."""
+    intervals = []
+
+    while f"phase_interval_ms_{len(intervals)}" in header:
+        intervals.append(header[f"phase_interval_ms_{len(intervals)}"])
+
+    if not intervals or intervals[0] is None: return None
+
+    return intervals
+
+def tag_sample_intervals(packets, intervals):
+    """Give each packet the interval it was logged at, and count the gaps the policy does not explain."""
+    gaps = 0
+
+    for i, packet in enumerate(packets):
+        phase = packet["phase"]
+        packet["log_interval"] = intervals[phase] if phase < len(intervals) else 0
+
+        # a decimated phase steps by about its interval, anything well past it lost samples
+        if i > 0 and packet["log_interval"] > 0 and packet["phase"] == packets[i - 1]["phase"]:
+            if packet["ut"] - packets[i - 1]["ut"] > 2 * packet["log_interval"]:
+                gaps += 1
+
+    return gaps
+
+def flight_packet_offsets(header, flight_size, page_size, page_aligned_version):
+    """Yield packet offsets, relative to the header address, of a flight spanning flight_size bytes."""
+    packet_size = header["packet_size"]
+    page_aligned = header["format_version"] >= page_aligned_version
+
+    # old formats pack packets right after the header, new ones start on the next page
+    offset = page_size if page_aligned else header["header_size"]
+
+    while offset + packet_size <= flight_size:
+        yield offset
+
+        offset += packet_size
+
+        # packets never straddle a page
+        if page_aligned and (offset % page_size) + packet_size > page_size:
+            offset += page_size - (offset % page_size)
+
+def parse_flash_codec(filepath):
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    # get block magic value
+    block_magic_str = _get_define(cpp_header.defines, "FLASH_BLOCK_MAGIC")
+    if block_magic_str is None:
+        raise ValueError("FLASH_BLOCK_MAGIC not found in defines")
+    block_magic_val = int(block_magic_str, 16)
+
+    # get block header struct
+    block_struct = cpp_header.classes.get("flash_block_header_t")
+    if not block_struct: raise ValueError("Struct flash_block_header_t was not found.")
+
+    fmt = byte_order
+    fields = []
+
+    for prop in block_struct["properties"]["public"]:
+        if prop["type"] in type_map:
+            fmt += type_map[prop["type"]]
+            fields.append(prop["name"])
+
+    # fixed-point scales of the float fields: FLASH_CODEC_SCALE_<field>
+    scales = {}
+    for define in cpp_header.defines:
+        if define.startswith("FLASH_CODEC_SCALE_"):
+            name, value = define.split("//")[0].split()[:2]
+            scales[name.replace("FLASH_CODEC_SCALE_", "").lower()] = float(value.rstrip("fF"))
+
+    return block_magic_val, fmt, fields, scales
+
+def crc16(data):
+    """CRC-16-CCITT, as lib/crc."""
+    crc = 0xFFFF
+
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+
+    return crc
+
+def _read_varint(data, offset):
+    value = 0
+    shift = 0
+
+    while True:
+        if offset >= len(data):
+            raise ValueError("truncated varint")
+
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+
+        if not byte & 0x80:
+            return value, offset
+
+        shift += 7
+        if shift >= 35:
+            raise ValueError("varint too long")
+
+def _to_int32(value):
+    value &= 0xFFFFFFFF
+    return value - (1 << 32) if value & 0x80000000 else value
+
+def _field_scale(field, scales):
+    if field in scales:
+        return scales[field]
+
+    # vector components share the scale of the vector
+    base = re.sub(r"_[xyz]$", "", field)
+    if base in scales:
+        return scales[base]
+
+    raise ValueError(f"No FLASH_CODEC_SCALE for float field {field}")
+
+def decode_flash_block(page, codec, packet_fmt, packet_fields, data_size=None, check_crc=True):
+    """Yield the samples of one compressed page as packet dicts. Blank pages yield nothing."""
+    block_magic, block_fmt, block_fields, scales = codec
+
+    block = dict(zip(block_fields, struct.unpack_from(block_fmt, page)))
+    if block["magic"] != block_magic:
+        return
+
+    start = struct.calcsize(block_fmt)
+    data = bytes(page[start:start + block["size"]])
+
+    # pages with a trailer carry no block CRC, the trailer covers them
+    if block["size"] > (data_size or len(page)) - start or (check_crc and crc16(data) != block["crc"]):
+        raise ValueError("corrupted block")
+
+    yield from decode_codec_samples(data, codec, packet_fmt, packet_fields, block["count"])
+
+def decode_codec_samples(data, codec, packet_fmt, packet_fields, count=None):
+    """Yield count samples encoded back to back from a key frame, or all of data if count is None."""
+    scales = codec[3]
+
+    # the codec encodes the payload fields in declaration order, the packet magic is not stored
+    codes = [code * int(count or 1) for count, code in re.findall(r"(\d*)([a-zA-Z])", packet_fmt)]
+    codes = "".join(codes)
+    fields = [(name, code) for name, code in zip(packet_fields, codes) if name != "magic"]
+
+    last = [0] * len(fields)
+    last_ut_delta = 0
+    offset = 0
+
+    sample = 0
+
+    while (sample < count) if count is not None else (offset < len(data)):
+        if offset + 2 > len(data): raise ValueError("truncated sample")
+
+        mask = data[offset] | (data[offset + 1] << 8)
+        offset += 2
+
+        packet = {}
+
+        for i, (name, code) in enumerate(fields):
+            residual = 0
+            if mask & (1 << i):
+                value, offset = _read_varint(data, offset)
+                residual = (value >> 1) ^ -(value & 1) # zigzag
+
+            # ut stores the change of its step, except in the key frame
+            if name == "ut" and sample > 0:
+                last_ut_delta = _to_int32(last_ut_delta + residual)
+                residual = last_ut_delta
+
+            last[i] = _to_int32(last[i] + residual)
+
+            if code == "f":
+                packet[name] = last[i] / _field_scale(name, scales)
+            elif code.isupper():
+                packet[name] = last[i] & ((1 << (8 * struct.calcsize(code))) - 1)
+            else:
+                packet[name] = last[i]
+
+        sample += 1
+
+        yield packet
+
+def iter_flight_samples(flight, header, page_size, trailer_version, trailer, codec, packet_fmt, packet_fields):
+    """Yield the samples of a compressed flight, given its bytes starting at the header."""
+    has_trailer = header["format_version"] >= trailer_version
+    data_size = page_size - struct.calcsize(trailer[0]) if has_trailer else page_size
+
+    for seq, offset in enumerate(range(page_size, len(flight) - page_size + 1, page_size)):
+        page = flight[offset:offset + page_size]
+
+        # a damaged page costs only its own samples
+        if has_trailer and not page_trailer_valid(page, trailer, header["flight_number"], seq):
+            print(f"Skipping page at offset {offset}: bad trailer")
+            continue
+
+        try:
+            yield from decode_flash_block(page, codec, packet_fmt, packet_fields, data_size, check_crc=not has_trailer)
+        except ValueError as e:
+            print(f"Skipping page at offset {offset}: {e}")
+
 def parse_flash_packet(filepath):
     cpp_header = CppHeaderParser.CppHeader(filepath)
 
@@ -131,6 +547,9 @@ def parse_flash_packet(filepath):
                 elif payload_c_type == "vector3f_t":
                     fmt += "3f"
                     fields.extend([f"{payload_c_name}_x", f"{payload_c_name}_y", f"{payload_c_name}_z"])
+                elif payload_c_type == "vector3s_t":
+                    fmt += "3h"
+                    fields.extend([f"{payload_c_name}_x", f"{payload_c_name}_y", f"{payload_c_name}_z"])
 
         elif c_type in type_map:
             fmt += type_map[c_type]
@@ -167,3 +586,25 @@ if __name__ == "__main__":
     print("\tMagic Bytes:", packet_magic_bytes)
     print("\tFormat:", packet_fmt)
     print("\tFields:", packet_fields)
+
+    print()
+
+    # flash layout
+    page_size, page_aligned_version, compressed_version, trailer_version = parse_flash_layout(flash_log_path)
+    print("FLASH LAYOUT")
+    print("\tPage Size:", page_size)
+    print("\tPage Aligned Version:", page_aligned_version)
+    print("\tCompressed Version:", compressed_version)
+    print("\tPage Trailer Version:", trailer_version)
+    print("\tPage Trailer Format:", parse_flash_trailer(flash_log_path))
+    print("\tRaw IMU Version:", parse_raw_imu_version(flash_log_path))
+
+    print()
+
+    # flash codec
+    block_magic, block_fmt, block_fields, scales = parse_flash_codec("../../lib/flash_log/flash_codec.h")
+    print("FLASH CODEC")
+    print("\tBlock Magic:", hex(block_magic))
+    print("\tBlock Format:", block_fmt)
+    print("\tBlock Fields:", block_fields)
+    print("\tScales:", scales)
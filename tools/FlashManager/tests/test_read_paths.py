@@ -0,0 +1,312 @@
+"""Flight reads over USB against a fake device, one flight per packet layout the log has had.
+
+Run from tools/FlashManager: python -m unittest discover tests
+"""
+import re
+import struct
+import sys
+import tempfile
+import unittest
+from pathlib import Path
+
+sys.path.insert(0, str(Path(__file__).resolve().parent.parent))
+
+from link import Link
+from flight_cache import FlightCache
+from parser import crc16, unpack_flash_header, flight_packet_offsets, iter_flight_samples, _field_offsets
+
+FLIGHT_UNCOMPRESSED = 1 # v5: float accel and ang_vel
+FLIGHT_FIXED_POINT = 2 # v7: codec fixed point
+FLIGHT_RAW = 3 # v8: raw counts
+
+ACCEL_SCALE = 16 / 32768 # g per count at +-16 g
+ANG_VEL_SCALE = 2000 / 32768 # deg/s per count at +-2000 deg/s
+
+# FLASH_LEGACY_ACCEL_SCALE and FLASH_LEGACY_ANG_VEL_SCALE: older flights are decoded to counts at these on the device
+LEGACY_ACCEL_SCALE = 1 / 1000
+LEGACY_ANG_VEL_SCALE = 1 / 16.4
+
+# g and deg/s, rates past 327.67 deg/s no longer fit an int16 at the old x100 fixed point
+SAMPLES = [
+    {"ut": 1000 + 10 * i, "accel": (0.4 * i, -1.0, 2.0), "ang_vel": (12.0 * i, 0.0, -45.0), "phase": 2}
+    for i in range(40)
+]
+
+def _codes(fmt, fields):
+    codes = "".join(code * int(count or 1) for count, code in re.findall(r"(\d*)([a-zA-Z])", fmt))
+    return [(name, code) for name, code in zip(fields, codes) if name != "magic"]
+
+def _payload(link, sample, imu):
+    values = {"ut": sample["ut"], "pressure": 101325.0, "temperature": 25.0, "lat_nmea": 0, "lon_nmea": 0, "satellites": 0, "v_bat": 8.4, "phase": sample["phase"]}
+
+    for name, vector in (("accel", sample["accel"]), ("ang_vel", sample["ang_vel"])):
+        for axis, value in zip("xyz", vector):
+            values[f"{name}_{axis}"] = imu(name, value)
+
+    return values
+
+def _zigzag(value):
+    return ((value << 1) ^ (value >> 31)) & 0xFFFFFFFF
+
+def _varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+def encode_samples(link, payloads):
+    """flash_codec_encode() of a run of payloads from a key frame."""
+    scales = link.CODEC[3]
+    fields = _codes(link.PACKET_FORMAT, link.PACKET_FIELDS)
+
+    last = [0] * len(fields)
+    last_ut_delta = 0
+    out = bytearray()
+
+    for n, payload in enumerate(payloads):
+        values = []
+        for name, code in fields:
+            value = payload[name]
+            if code == "f":
+                value = round(value * scales[re.sub(r"_[xyz]$", "", name)])
+            values.append(int(value))
+
+        residuals = [value - prev for value, prev in zip(values, last)]
+
+        if n > 0:
+            ut_delta = residuals[0]
+            residuals[0] = ut_delta - last_ut_delta
+            last_ut_delta = ut_delta
+
+        last = values
+
+        mask = sum(1 << i for i, residual in enumerate(residuals) if residual != 0)
+        out += struct.pack("<H", mask)
+        for residual in residuals:
+            if residual != 0: out += _varint(_zigzag(residual))
+
+    return bytes(out)
+
+def build_header(link, flight_number, version, packet_size, header_size, next_addr):
+    values = dict.fromkeys(link.HEADER_FIELDS, 0)
+    values.update({
+        "magic": struct.unpack("<I", link.HEADER_MAGIC_BYTES)[0],
+        "header_size": header_size,
+        "packet_size": packet_size,
+        "format_version": version,
+        "next_header_addr": next_addr,
+        "flight_number": flight_number,
+        "accel_scale": ACCEL_SCALE,
+        "ang_vel_scale": ANG_VEL_SCALE,
+    })
+
+    raw = struct.pack(link.HEADER_FORMAT, *(values[field] for field in link.HEADER_FIELDS))
+    return raw[:header_size] + b'\xff' * (link.PAGE_SIZE - header_size)
+
+def build_uncompressed_flight(link, flight_number):
+    packet_fmt = link.LEGACY_PACKET_FORMAT
+    packet_size = struct.calcsize(packet_fmt)
+    header_size = _field_offsets(link.HEADER_FORMAT, link.HEADER_FIELDS)["page_programs"] # v5 headers ended before the summary
+
+    per_page = link.PAGE_SIZE // packet_size
+    size = link.PAGE_SIZE * (1 + (len(SAMPLES) + per_page - 1) // per_page)
+    header = {"packet_size": packet_size, "format_version": 5, "header_size": header_size}
+    offsets = list(flight_packet_offsets(header, size, link.PAGE_SIZE, link.PAGE_ALIGNED_VERSION))[:len(SAMPLES)]
+
+    flight = bytearray(build_header(link, flight_number, 5, packet_size, header_size, size)) + b'\xff' * (size - link.PAGE_SIZE)
+
+    for offset, sample in zip(offsets, SAMPLES):
+        values = _payload(link, sample, lambda name, value: value)
+        values["magic"] = struct.unpack("<I", link.PACKET_MAGIC_BYTES)[0]
+        flight[offset:offset + packet_size] = struct.pack(packet_fmt, *(values[field] for field in link.PACKET_FIELDS))
+
+    return bytes(flight)
+
+def build_compressed_flight(link, flight_number, version, imu):
+    block_magic, block_fmt, block_fields, _ = link.CODEC
+    trailer_fmt, _ = link.TRAILER
+    data_size = link.PAGE_SIZE - struct.calcsize(trailer_fmt)
+
+    payloads = [_payload(link, sample, imu) for sample in SAMPLES]
+    pages = []
+
+    # as many samples per page as fit, each page a block from its own key frame
+    while payloads:
+        count = len(payloads)
+        while struct.calcsize(block_fmt) + len(encode_samples(link, payloads[:count])) > data_size:
+            count -= 1
+
+        data = encode_samples(link, payloads[:count])
+        payloads = payloads[count:]
+
+        block = dict(magic=block_magic, size=len(data), count=count, reserved=0xFF, crc=0xFFFF)
+        page = struct.pack(block_fmt, *(block[field] for field in block_fields)) + data
+        page += b'\xff' * (data_size - len(page))
+
+        seq = len(pages)
+        page += struct.pack(trailer_fmt[:-1], seq, flight_number & 0xFFFF)
+        page += struct.pack("<H", crc16(page))
+        pages.append(page)
+
+    size = link.PAGE_SIZE * (1 + len(pages))
+    header_size = link.HEADER_SIZE if version >= link.RAW_IMU_VERSION else link.HEADER_SIZE - 8
+    packet_size = link.PACKET_SIZE if version >= link.RAW_IMU_VERSION else link.PACKET_SIZE + 12
+
+    return build_header(link, flight_number, version, packet_size, header_size, size) + b''.join(pages)
+
+def _to_counts(packet, header):
+    """flash_codec_to_count() of the accel and ang_vel of a decoded packet."""
+    packet = dict(packet)
+
+    for name, scale in (("accel", header["accel_scale"]), ("ang_vel", header["ang_vel_scale"])):
+        for axis in "xyz":
+            packet[f"{name}_{axis}"] = max(-32768, min(32767, round(packet[f"{name}_{axis}"] / scale)))
+
+    return packet
+
+class FakeDevice(Link):
+    """Answers the flight commands the way firmware/main.c does, from flight images in memory."""
+
+    def __init__(self, cache_dir):
+        super().__init__()
+        self.cache = FlightCache(cache_dir)
+        self.is_running = True
+
+        self.flights = {
+            FLIGHT_UNCOMPRESSED: build_uncompressed_flight(self, FLIGHT_UNCOMPRESSED),
+            FLIGHT_FIXED_POINT: build_compressed_flight(self, FLIGHT_FIXED_POINT, 7,
+                lambda name, value: round(value * self.CODEC[3][name])),
+            FLIGHT_RAW: build_compressed_flight(self, FLIGHT_RAW, self.RAW_IMU_VERSION,
+                lambda name, value: round(value / (ACCEL_SCALE if name == "accel" else ANG_VEL_SCALE))),
+        }
+
+        self.device_decodes = []
+        self.rx = b''
+
+    def _header(self, flight_number):
+        """read_header(): older flights read back with the scales their packets are decoded at."""
+        header = unpack_flash_header(self.flights[flight_number][:self.HEADER_SIZE], self.HEADER_FORMAT, self.HEADER_FIELDS)
+
+        if header["format_version"] < self.RAW_IMU_VERSION:
+            header.update(accel_scale=LEGACY_ACCEL_SCALE, ang_vel_scale=LEGACY_ANG_VEL_SCALE)
+
+        return header
+
+    def _device_packets(self, flight_number):
+        """flash_log_for_each_packet(): every flight comes out as flash_packet_t, accel and ang_vel in counts."""
+        header = self._header(flight_number)
+        self.device_decodes.append(flight_number)
+
+        if header["format_version"] >= self.RAW_IMU_VERSION:
+            packets = iter_flight_samples(self.flights[flight_number], header, self.PAGE_SIZE, self.TRAILER_VERSION, self.TRAILER, self.CODEC, self.PACKET_FORMAT, self.PACKET_FIELDS)
+        else:
+            packets = [_to_counts(packet, header) for packet in Link.decode_flight(self, self.flights[flight_number])]
+
+        magic = struct.unpack("<I", self.PACKET_MAGIC_BYTES)[0]
+
+        # sizeof(flash_packet_t) each
+        return [struct.pack(self.PACKET_FORMAT, *(dict(packet, magic=magic)[field] for field in self.PACKET_FIELDS)) for packet in packets]
+
+    # host side of the link, served from memory
+    def cmd_read_header(self, flight_number):
+        return self._header(flight_number) if flight_number in self.flights else None
+
+    def download_flight(self, flight_number, limit=None, chunk_size=64 * 1024):
+        return self.flights[flight_number][:limit]
+
+    def transmit_cmd(self, id, param):
+        if id == self.FLASH_CMD["CMD_READ_FLIGHT"]:
+            packets = self._device_packets(param)
+            self.rx = (self.FLASH_NACK if packets is None else b''.join(packets)) + self.FLASH_ACK
+        elif id == self.FLASH_CMD["CMD_BULK_READ_FLIGHT"]:
+            packets = self._device_packets(param)
+
+            # chunk boundaries do not line up with packets
+            data = b''.join(packets or [])
+            self.bulk = None if packets is None else [data[i:i + self.BULK["chunk_size"]] for i in range(0, len(data), self.BULK["chunk_size"])]
+        elif id == self.FLASH_CMD["CMD_BULK_READ_FLIGHT_COMPRESSED"]:
+            packets = self._device_packets(param)
+            payloads = [dict(zip(self.PACKET_FIELDS, struct.unpack(self.PACKET_FORMAT, packet))) for packet in packets or []]
+
+            # each chunk starts from a key frame
+            self.bulk = None if packets is None else [encode_samples(self, payloads[i:i + 16]) for i in range(0, len(payloads), 16)]
+
+    def _bulk_receive(self, sink, stats=None):
+        if self.bulk is None: return False
+
+        for chunk in self.bulk:
+            sink(chunk)
+
+        return True
+
+    class _Serial:
+        def __init__(self, device):
+            self.device = device
+
+        def read(self, size):
+            data, self.device.rx = self.device.rx[:size], self.device.rx[size:]
+            return data
+
+        def reset_input_buffer(self):
+            pass
+
+    @property
+    def serial_port(self):
+        return FakeDevice._Serial(self)
+
+    @serial_port.setter
+    def serial_port(self, port):
+        pass
+
+class ReadPathsTest(unittest.TestCase):
+    def setUp(self):
+        self.cache_dir = tempfile.TemporaryDirectory()
+        self.device = FakeDevice(self.cache_dir.name)
+
+    def tearDown(self):
+        self.cache_dir.cleanup()
+
+    def assert_samples(self, packets, tolerance):
+        self.assertEqual(len(packets), len(SAMPLES))
+
+        for packet, sample in zip(packets, SAMPLES):
+            self.assertEqual(packet["ut"], sample["ut"])
+            self.assertEqual(packet["phase"], sample["phase"])
+
+            for name in ("accel", "ang_vel"):
+                for axis, value in zip("xyz", sample[name]):
+                    self.assertAlmostEqual(packet[f"{name}_{axis}"], value, delta=tolerance[name])
+
+    def read_all(self, flight_number):
+        return {
+            "read": self.device.cmd_read_flight(flight_number),
+            "bulk": self.device.cmd_bulk_read_flight(flight_number, compressed=False),
+            "bulk compressed": self.device.cmd_bulk_read_flight(flight_number, compressed=True),
+            "raw bytes": self.device.decode_flight(self.device.flights[flight_number]),
+        }
+
+    def assert_paths(self, flight_number, stored, device):
+        """stored: resolution of the flight on flash, device: of its packets once decoded on the device."""
+        for path, packets in self.read_all(flight_number).items():
+            with self.subTest(path=path):
+                self.assert_samples(packets, stored if path == "raw bytes" else device)
+
+        # every USB read decodes on the device
+        self.assertEqual(self.device.device_decodes, [flight_number] * 3)
+
+    def test_uncompressed_flight(self):
+        self.assert_paths(FLIGHT_UNCOMPRESSED, {"accel": 1e-6, "ang_vel": 1e-6},
+            {"accel": LEGACY_ACCEL_SCALE / 2, "ang_vel": LEGACY_ANG_VEL_SCALE / 2})
+
+    def test_fixed_point_flight(self):
+        self.assert_paths(FLIGHT_FIXED_POINT, {"accel": 1e-3, "ang_vel": 1e-2},
+            {"accel": 1e-3, "ang_vel": LEGACY_ANG_VEL_SCALE / 2 + 1e-2})
+
+    def test_raw_flight(self):
+        self.assert_paths(FLIGHT_RAW, {"accel": ACCEL_SCALE, "ang_vel": ANG_VEL_SCALE},
+            {"accel": ACCEL_SCALE, "ang_vel": ANG_VEL_SCALE})
+
+if __name__ == "__main__":
+    unittest.main()
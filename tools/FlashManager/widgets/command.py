@@ -1,4 +1,4 @@
-from PyQt6.QtWidgets import QVBoxLayout, QHBoxLayout, QPushButton, QFrame
+from PyQt6.QtWidgets import QVBoxLayout, QHBoxLayout, QPushButton, QFrame, QFileDialog
 from PyQt6.QtCore import Qt
 
 from logger import Logger
@@ -31,8 +31,15 @@ class CommandWidget(Widget):
         self.btn_clear_flights.setStyleSheet("QPushButton { background-color: #660000; color: white; font-weight: bold; border-radius: 5px; } QPushButton:hover { background-color: #008800; border: 2px solid #00ff66; }")
         self.btn_clear_flights.clicked.connect(self.cmd_clear_flights)
 
+        # dump chip btn
+        self.btn_dump_chip = QPushButton("Dump chip")
+        self.btn_dump_chip.setMinimumHeight(40)
+        self.btn_dump_chip.setStyleSheet("QPushButton { background-color: #445f85; color: white; font-weight: bold; border-radius: 5px; } QPushButton:hover { background-color: #223355; border: 2px solid #4488ff; }")
+        self.btn_dump_chip.clicked.connect(self.cmd_dump_chip)
+
         buttons_layout.addWidget(self.btn_clear_flights)
         buttons_layout.addWidget(self.btn_list_flights)
+        buttons_layout.addWidget(self.btn_dump_chip)
 
         layout.addLayout(buttons_layout)
 
@@ -52,5 +59,12 @@ class CommandWidget(Widget):
         Logger.info("List flights cmd")
         self.link.cmd_list_headers()
 
+    def cmd_dump_chip(self):
+        path, _ = QFileDialog.getSaveFileName(self, "Save chip dump", "flash.bin", "Flash image (*.bin)")
+        if not path: return
+
+        Logger.info("Dump chip cmd")
+        self.link.cmd_dump_chip(path)
+
     def tick(self):
         pass
\ No newline at end of file
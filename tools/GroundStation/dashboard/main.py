@@ -35,7 +35,8 @@ if __name__ == "__main__":
                 "pressure": lambda val: f"Press: {val:.0f} Pa",
                 "temperature": lambda val: f"Temp: {val:.0f} °C",
                 "satellites": lambda val: f"Satellites: {val}",
-                "v_bat": lambda val: f"Battery: {val:.2f} V"
+                "v_bat": lambda val: f"Battery: {val:.2f} V",
+                "loop_load": lambda val: f"Loop: {val}%"
             },
             interval=0.2 # 200ms
         )
@@ -8,7 +8,7 @@ from pathlib import Path
 
 from logger import Logger
 
-from telemetry_parser import parse_telecommand_header, parse_telemetry_header
+from telemetry_parser import parse_telecommand_header, parse_telemetry_header, parse_telemetry_scales, parse_telemetry_invalid
 
 class TelemetryLink:
     def __init__(self, telemetry_queue, telecommand_queue):
@@ -39,6 +39,8 @@ class TelemetryLink:
         # get TELEMETRY struct
         try:
             self.TM_MAGIC_SIZE, self.TM_MAGIC_BYTES, self.TM_PACKET_FORMAT, self.TM_PACKET_FIELDS = parse_telemetry_header(header_path)
+            self.TM_SCALES = parse_telemetry_scales(header_path)
+            self.TM_INVALID = parse_telemetry_invalid(header_path)
         except Exception as e:
             Logger.error(f"<Parser> Fatal error processing telemetry header: {e}")
             exit()
@@ -201,6 +203,10 @@ class TelemetryLink:
 
                             packet["ut"] /= 1000 # ms to s
 
+                            # fixed point to float
+                            for field, scale in self.TM_SCALES.items():
+                                packet[field] = float("nan") if packet[field] == self.TM_INVALID else packet[field] / scale
+
                             self.telemetry_queue.put(packet)
                         else:
                             Logger.warning("CHECKSUM UNMATCH!")
@@ -144,6 +144,29 @@ def parse_telemetry_header(filepath):
 
     return magic_size, magic_bytes, fmt, fields
 
+def parse_telemetry_scales(filepath):
+    header = CppHeaderParser.CppHeader(filepath)
+
+    # fixed-point fields, TMTC_SCALE_<FIELD>
+    scales = {}
+    for define in header.defines:
+        if not define.startswith("TMTC_SCALE_"): continue
+
+        name, value = define.split("//")[0].split(None, 1)
+        scales[name.replace("TMTC_SCALE_", "").lower()] = float(value.strip().rstrip("f"))
+
+    return scales
+
+def parse_telemetry_invalid(filepath):
+    header = CppHeaderParser.CppHeader(filepath)
+
+    # fixed-point value of a NaN
+    invalid_str = _get_define(header.defines, "TMTC_FIXED_INVALID")
+    if invalid_str is None:
+        raise ValueError("TMTC_FIXED_INVALID not found in defines")
+
+    return int(invalid_str, 16)
+
 if __name__ == "__main__":
     tmtc_path = "../../../lib/tmtc/tmtc.h"
 
@@ -163,3 +186,4 @@ if __name__ == "__main__":
     Logger.debug(tm_magic_bytes)
     Logger.debug(tm_fmt)
     Logger.debug(tm_fields)
+    Logger.debug(parse_telemetry_scales(tmtc_path))
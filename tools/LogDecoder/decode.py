@@ -0,0 +1,109 @@
+import struct
+from pathlib import Path
+
+from dlog_parser import parse_dlog_formats, parse_dlog_frame, format_record
+
+class DlogDecoder:
+    """Splits a console byte stream into text and dlog frames, decoded back to text."""
+
+    def __init__(self):
+        base_dir = Path(__file__).resolve().parent
+        self.formats = parse_dlog_formats((base_dir / "../../lib/dlog/dlog_formats.h").resolve())
+        self.SYNC, self.MAX_ARGS, self.HEADER_FORMAT, self.HEADER_FIELDS = parse_dlog_frame((base_dir / "../../lib/dlog/dlog.h").resolve())
+        self.HEADER_SIZE = struct.calcsize(self.HEADER_FORMAT)
+
+        self.buffer = b''
+        self.bad_frames = 0
+
+    @staticmethod
+    def crc16(data):
+        """CRC-16-CCITT, as lib/crc."""
+        crc = 0xFFFF
+
+        for byte in data:
+            crc ^= byte << 8
+            for _ in range(8):
+                crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+                crc &= 0xFFFF
+
+        return crc
+
+    def _frame(self, offset):
+        """(line, size) of a frame at offset, (None, 0) if it is not one, None if it is still incomplete."""
+        if len(self.buffer) < offset + self.HEADER_SIZE: return None
+
+        header = dict(zip(self.HEADER_FIELDS, struct.unpack_from(self.HEADER_FORMAT, self.buffer, offset)))
+        size = self.HEADER_SIZE + 4 * header["nargs"] + 2
+
+        if header["id"] >= len(self.formats) or header["nargs"] > self.MAX_ARGS: return (None, 0)
+        if len(self.buffer) < offset + size: return None
+
+        frame = self.buffer[offset:offset + size]
+        if struct.unpack_from("<H", frame, size - 2)[0] != self.crc16(frame[:-2]): return (None, 0)
+
+        words = struct.unpack_from(f"<{header['nargs']}I", frame, self.HEADER_SIZE)
+        name, _, fmt = self.formats[header["id"]]
+
+        return f"D ({header['ut']}) {name}: {format_record(fmt, words)}", size
+
+    def feed(self, data):
+        """Yield the console lines and decoded frames completed by data."""
+        self.buffer += data
+
+        while self.buffer:
+            sync = self.buffer.find(self.SYNC)
+            text_end = sync if sync >= 0 else max(len(self.buffer) - len(self.SYNC) + 1, 0)
+
+            # plain console text, line by line
+            newline = self.buffer.rfind(b'\n', 0, text_end)
+            if newline >= 0:
+                for line in self.buffer[:newline + 1].splitlines():
+                    yield line.decode(errors="replace")
+                self.buffer = self.buffer[newline + 1:]
+                continue
+
+            if sync < 0: return
+
+            result = self._frame(sync)
+            if result is None: return
+
+            line, size = result
+            if line is None:
+                # a sync word inside text or a damaged frame: skip past it
+                self.bad_frames += 1
+                self.buffer = self.buffer[:sync] + self.buffer[sync + 1:]
+                continue
+
+            # text before the frame ends where the frame starts
+            if sync > 0: yield self.buffer[:sync].decode(errors="replace")
+
+            yield line
+            self.buffer = self.buffer[sync + size:]
+
+if __name__ == "__main__":
+    import sys
+    import argparse
+
+    parser = argparse.ArgumentParser(description="Decodes deferred log frames from the avionics console")
+    parser.add_argument("source", help="serial port, or a capture file with --file")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--file", action="store_true", help="read a raw capture instead of a port")
+    args = parser.parse_args()
+
+    decoder = DlogDecoder()
+
+    if args.file:
+        with open(args.source, "rb") as f:
+            for line in decoder.feed(f.read()):
+                print(line)
+        sys.exit(0)
+
+    from serial import Serial
+
+    with Serial(args.source, args.baud, timeout=0.1) as port:
+        try:
+            while True:
+                for line in decoder.feed(port.read(4096)):
+                    print(line, flush=True)
+        except KeyboardInterrupt:
+            pass
@@ -0,0 +1,86 @@
+import CppHeaderParser
+import struct
+import re
+
+type_map = {
+    "uint32_t": 'I',
+    "uint16_t": 'H',
+    "uint8_t": 'B',
+    "int32_t": 'i',
+    "int16_t": 'h',
+    "int8_t": 'b',
+    "float": 'f',
+    "double": 'd'
+}
+
+byte_order = "<" # little endian
+
+# X(name, argument count, "format")
+FORMAT_ENTRY = re.compile(r'X\(\s*(\w+)\s*,\s*(\d+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)')
+
+# one printf conversion: flags, width, precision, length, type
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l|z|j|t)?([diuxXcfFeEgGaA%])")
+
+def _get_define(defines, field):
+    for define in defines:
+        if define.startswith(field):
+            return define.replace(field, "").split("//")[0].strip()
+
+def parse_dlog_formats(filepath):
+    """Formats of dlog_formats.h, indexed by id: (name, nargs, format)."""
+    with open(filepath) as f:
+        source = f.read()
+
+    return [(name, int(nargs), fmt.encode().decode("unicode_escape")) for name, nargs, fmt in FORMAT_ENTRY.findall(source)]
+
+def parse_dlog_frame(filepath):
+    """Sync word bytes, max record words and struct format of dlog_frame_header_t."""
+    cpp_header = CppHeaderParser.CppHeader(filepath)
+
+    sync_str = _get_define(cpp_header.defines, "DLOG_SYNC")
+    if sync_str is None:
+        raise ValueError("DLOG_SYNC not found in defines")
+
+    max_args_str = _get_define(cpp_header.defines, "DLOG_MAX_ARGS")
+    if max_args_str is None:
+        raise ValueError("DLOG_MAX_ARGS not found in defines")
+
+    frame_struct = cpp_header.classes.get("dlog_frame_header_t")
+    if not frame_struct: raise ValueError("Struct dlog_frame_header_t was not found.")
+
+    fmt = byte_order
+    fields = []
+
+    for prop in frame_struct["properties"]["public"]:
+        fmt += type_map[prop["type"]]
+        fields.append(prop["name"])
+
+    sync_bytes = struct.pack(byte_order + fmt[fields.index("sync") + 1], int(sync_str, 16))
+
+    return sync_bytes, int(max_args_str), fmt, fields
+
+def format_record(fmt, words):
+    """printf the record words the way the device would, floats from their bits."""
+    args = iter(words)
+
+    def convert(match):
+        flags, _, conv = match.groups()
+        if conv == "%": return "%"
+
+        word = next(args, 0)
+
+        if conv in "fFeEgGaA":
+            value = struct.unpack("<f", struct.pack("<I", word))[0]
+            conv = {"F": "f", "a": "e", "A": "E"}.get(conv, conv)
+        elif conv in "di":
+            value = word - (1 << 32) if word & 0x80000000 else word
+            conv = "d"
+        elif conv == "u":
+            value = word
+            conv = "d"
+        else:
+            value = word
+
+        return f"%{flags}{conv}" % value
+
+    return CONVERSION.sub(convert, fmt)